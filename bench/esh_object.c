@@ -0,0 +1,79 @@
+#include "esh_object.h"
+
+#include <stdio.h>
+#include <time.h>
+
+// Microbenchmark for the object entries table: insertion, lookup, and delete churn
+
+#define N_KEYS 100000
+#define CHURN_WINDOW 64
+#define CHURN_OPS 2000000
+
+static char keys[N_KEYS][16];
+static size_t key_lens[N_KEYS];
+
+static double now() {
+	return (double) clock() / CLOCKS_PER_SEC;
+}
+
+static void report(const char *name, double start, size_t ops) {
+	double elapsed = now() - start;
+	printf("%-8s %10zu ops %8.3f s %8.1f ns/op\n", name, ops, elapsed, elapsed * 1e9 / ops);
+}
+
+int main() {
+	esh_state *esh = esh_open(NULL);
+	esh_gc_conf(esh, 0, -1); // The objects live on the C stack, so the GC can't see their keys
+	
+	for(size_t i = 0; i < N_KEYS; i++) key_lens[i] = snprintf(keys[i], sizeof(keys[i]), "key-%zu", i);
+	
+	esh_table obj;
+	esh_object_init_entries(esh, &obj);
+	esh_object_make_dict(esh, &obj);
+	
+	double start = now();
+	for(size_t i = 0; i < N_KEYS; i++) esh_object_set(esh, &obj, keys[i], key_lens[i], (esh_val) 1);
+	report("insert", start, N_KEYS);
+	
+	size_t found = 0;
+	esh_val val;
+	start = now();
+	for(size_t r = 0; r < 10; r++) {
+		for(size_t i = 0; i < N_KEYS; i++) found += esh_object_get(esh, &obj, keys[(i * 7919) % N_KEYS], key_lens[(i * 7919) % N_KEYS], &val);
+	}
+	report("lookup", start, N_KEYS * 10);
+	
+	// Lookups with keys that are already interned, as done by the VM, skip hashing the string and probing the intern table
+	static esh_val key_vals[N_KEYS];
+	for(size_t i = 0; i < N_KEYS; i++) key_vals[i] = esh_intern(esh, keys[i], key_lens[i]);
+	
+	start = now();
+	for(size_t r = 0; r < 10; r++) {
+		for(size_t i = 0; i < N_KEYS; i++) found += esh_object_get_v(esh, &obj, key_vals[(i * 7919) % N_KEYS], &val);
+	}
+	report("lookup_v", start, N_KEYS * 10);
+	
+	esh_object_free_entries(esh, &obj);
+	
+	// A sliding window of in-flight keys, each of which is added, looked up and removed
+	esh_object_init_entries(esh, &obj);
+	esh_object_make_dict(esh, &obj);
+	
+	start = now();
+	for(size_t i = 0; i < CHURN_OPS; i++) {
+		size_t k = i % N_KEYS;
+		esh_object_set(esh, &obj, keys[k], key_lens[k], (esh_val) 1);
+		
+		if(i >= CHURN_WINDOW) {
+			size_t old = (i - CHURN_WINDOW) % N_KEYS;
+			found += esh_object_get(esh, &obj, keys[old], key_lens[old], &val);
+			esh_object_delete_entry(esh, &obj, keys[old], key_lens[old]);
+		}
+	}
+	report("churn", start, CHURN_OPS);
+	printf("(%zu entries left, capacity %zu, %zu found)\n", obj.entries_len, obj.cap, found);
+	
+	esh_object_free_entries(esh, &obj);
+	esh_close(esh);
+	return 0;
+}
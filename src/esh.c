@@ -7,7 +7,13 @@
 #include <assert.h>
 #include <stdint.h>
 #include <stdbool.h>
+#include <limits.h>
 #include <string.h>
+#include <time.h>
+
+#ifndef NO_THREADS
+#include <pthread.h>
+#endif
 
 const char *esh_get_project_name() {
 	#ifdef DEBUG
@@ -59,18 +65,27 @@ char *int_to_str(long long i, size_t *out_len) {
 	return s;
 }
 
-static void inc_gc(esh_state *esh) {
-	if(esh->gc_freq > 0) {
-		esh->alloc_step++;
-		if(esh->alloc_step >= (unsigned) esh->gc_freq) {
-			esh->alloc_step = 0;
-			esh_gc(esh, esh->gc_step_size);
-		}
+static void gc_paced_collect(esh_state *esh);
+static void gc_free_all(esh_state *esh);
+static uint64_t gc_now();
+
+// Called before allocating n bytes. The GC runs every gc_freq allocations in ESH_GC_MODE_COUNT, and every time gc_nursery bytes were allocated otherwise
+static void inc_gc(esh_state *esh, size_t n) {
+	if(esh->gc_freq <= 0) return;
+	
+	esh->gc_debt += n;
+	if(esh->gc_mode == ESH_GC_MODE_COUNT) {
+		if(++esh->alloc_step < (unsigned) esh->gc_freq) return;
+		esh->alloc_step = 0;
+	} else if(esh->gc_debt < esh->gc_nursery) {
+		return;
 	}
+	
+	gc_paced_collect(esh);
 }
 
 void *esh_alloc(esh_state *esh, size_t n) {
-	inc_gc(esh);
+	inc_gc(esh, n);
 	return esh->realloc(NULL, n);
 }
 
@@ -79,10 +94,326 @@ void esh_free(esh_state *esh, void *p) {
 }
 
 void *esh_realloc(esh_state *esh, void *p, size_t n) {
-	inc_gc(esh);
+	inc_gc(esh, n);
 	return esh->realloc(p, n);
 }
 
+// SLAB ALLOCATOR
+// Small objects and tables are carved out of slabs holding blocks of a single size class. Slabs are aligned to their size, so that the slab of a block can be found from its address. They are taken from arenas obtained through the realloc callback, and an arena is given back once all of its slabs are empty (unless it's the last one, or the GC is sweeping through the arenas)
+
+#define POOL_SLAB_SIZE 8192
+#define POOL_ARENA_SLABS 16
+#define POOL_SLAB_BITS (POOL_SLAB_SIZE / 16) // One bit per 16 bytes of the slab, indexed by the offset of the block
+
+#if defined(__SANITIZE_ADDRESS__)
+#include <sanitizer/asan_interface.h>
+#define POOL_POISON(p, n) ASAN_POISON_MEMORY_REGION(p, n)
+#define POOL_UNPOISON(p, n) ASAN_UNPOISON_MEMORY_REGION(p, n)
+#else
+#define POOL_POISON(p, n) ((void) (p), (void) (n))
+#define POOL_UNPOISON(p, n) ((void) (p), (void) (n))
+#endif
+
+typedef struct esh_slab {
+	struct esh_arena *arena;
+	struct esh_slab *next, *prev; // In the list of slabs of the size class that have free blocks
+	void *free; // Freed blocks, linked through their first word
+	char *bump; // Start of the blocks that were never handed out
+	size_t n_used;
+	size_t size_class; // 0 once the slab is empty and back in its arena
+	
+	// Old objects in the slab, the ones marked by the current major cycle (see esh_gc), and the ones it traced before they were written to (see gc_trace_claimed)
+	uint64_t old[POOL_SLAB_BITS / 64];
+	uint64_t mark[POOL_SLAB_BITS / 64];
+	uint64_t traced[POOL_SLAB_BITS / 64];
+	size_t swept_cycle;
+} esh_slab;
+
+typedef struct esh_arena {
+	void *mem;
+	struct esh_arena *next, *prev;
+	char *slabs; // First aligned slab within mem
+	size_t n_carved; // Number of slabs handed out from the start of the arena so far
+	esh_slab *free_slabs; // Empty slabs, linked through next
+	size_t n_used;
+} esh_arena;
+
+#define POOL_BLOCKS_OFFSET ((sizeof(esh_slab) + 15) / 16 * 16)
+
+#ifndef NO_THREADS
+typedef enum gc_job {
+	GC_JOB_NONE,
+	GC_JOB_MARK,
+	GC_JOB_SWEEP,
+	GC_JOB_QUIT
+} gc_job;
+
+// Helper thread of the concurrent major cycles, see gc_safepoint
+typedef struct esh_gc_worker {
+	pthread_t thread;
+	pthread_mutex_t lock; // Guards job and handoff
+	pthread_cond_t wake, done;
+	gc_job job;
+	bool stop; // Asks the worker to put its job down, see gc_worker_stop
+	
+	esh_obj_stack handoff; // Objects shaded by the main thread that are waiting to be traced by the worker
+	esh_obj_stack shaded; // Objects shaded by the main thread since the last hand over, only touched by the main thread
+	size_t swept_bytes, swept_objects;
+	
+	pthread_mutex_t pool_lock; // Guards the slab allocator while the worker sweeps
+} esh_gc_worker;
+#endif
+
+// Both threads free blocks while the worker sweeps
+static void pool_lock(esh_state *esh) {
+	#ifndef NO_THREADS
+	if(esh->gc_worker_sweeping) pthread_mutex_lock(&esh->gc_worker->pool_lock);
+	#else
+	(void) esh;
+	#endif
+}
+
+static void pool_unlock(esh_state *esh) {
+	#ifndef NO_THREADS
+	if(esh->gc_worker_sweeping) pthread_mutex_unlock(&esh->gc_worker->pool_lock);
+	#else
+	(void) esh;
+	#endif
+}
+
+// The worker sets bits of the bitmaps while it marks, so the other updates have to be atomic then. Returns false if the bits were already set
+static bool bitmap_set(esh_state *esh, uint64_t *word, uint64_t mask) {
+	#ifndef NO_THREADS
+	if(esh->gc_worker_marking) return (__atomic_fetch_or(word, mask, __ATOMIC_ACQ_REL) & mask) != mask;
+	#else
+	(void) esh;
+	#endif
+	
+	bool was_set = (*word & mask) == mask;
+	*word |= mask;
+	return !was_set;
+}
+
+static void bitmap_clear(esh_state *esh, uint64_t *word, uint64_t mask) {
+	#ifndef NO_THREADS
+	if(esh->gc_worker_marking) {
+		__atomic_fetch_and(word, ~mask, __ATOMIC_RELAXED);
+		return;
+	}
+	#else
+	(void) esh;
+	#endif
+	
+	*word &= ~mask;
+}
+
+static esh_slab *pool_slab_of(const void *p) {
+	return (esh_slab *) ((uintptr_t) p & ~(uintptr_t) (POOL_SLAB_SIZE - 1));
+}
+
+static size_t pool_slab_bit(const esh_slab *slab, const void *p) {
+	return ((uintptr_t) p - (uintptr_t) slab) / 16;
+}
+
+#define BIT_WORD(i) ((i) / 64)
+#define BIT_MASK(i) ((uint64_t) 1 << ((i) % 64))
+
+static size_t pool_class_of(size_t n) {
+	#ifdef NO_POOL
+	(void) n;
+	return 0;
+	#else
+	if(n == 0 || n > ESH_POOL_MAX) return 0;
+	return (n + 15) / 16;
+	#endif
+}
+
+static bool pool_slab_full(esh_slab *slab) {
+	return !slab->free && slab->bump + slab->size_class * 16 > (char *) slab + POOL_SLAB_SIZE;
+}
+
+static void pool_slab_link(esh_state *esh, esh_slab *slab) {
+	slab->prev = NULL;
+	slab->next = esh->pool_slabs[slab->size_class];
+	if(slab->next) slab->next->prev = slab;
+	esh->pool_slabs[slab->size_class] = slab;
+}
+
+static void pool_slab_unlink(esh_state *esh, esh_slab *slab) {
+	if(slab->prev) slab->prev->next = slab->next;
+	else esh->pool_slabs[slab->size_class] = slab->next;
+	if(slab->next) slab->next->prev = slab->prev;
+}
+
+static esh_arena *pool_new_arena(esh_state *esh) {
+	esh_arena *arena = esh->realloc(NULL, sizeof(esh_arena));
+	if(!arena) return NULL;
+	
+	// One slab more than needed, so that the aligned slabs fit whatever the alignment of the memory
+	arena->mem = esh->realloc(NULL, POOL_SLAB_SIZE * (POOL_ARENA_SLABS + 1));
+	if(!arena->mem) {
+		esh->realloc(arena, 0);
+		return NULL;
+	}
+	
+	uintptr_t start = ((uintptr_t) arena->mem + POOL_SLAB_SIZE - 1) & ~(uintptr_t) (POOL_SLAB_SIZE - 1);
+	arena->slabs = (char *) arena->mem + (start - (uintptr_t) arena->mem);
+	arena->n_carved = 0;
+	arena->free_slabs = NULL;
+	arena->n_used = 0;
+	
+	arena->prev = NULL;
+	arena->next = esh->pool_arenas;
+	if(arena->next) arena->next->prev = arena;
+	esh->pool_arenas = arena;
+	
+	return arena;
+}
+
+static esh_slab *pool_new_slab(esh_state *esh, size_t size_class) {
+	esh_arena *arena = esh->pool_arenas;
+	while(arena && !arena->free_slabs && arena->n_carved == POOL_ARENA_SLABS) arena = arena->next;
+	if(!arena && !(arena = pool_new_arena(esh))) return NULL;
+	
+	esh_slab *slab;
+	if(arena->free_slabs) {
+		slab = arena->free_slabs;
+		arena->free_slabs = slab->next;
+	} else {
+		slab = (esh_slab *) (arena->slabs + POOL_SLAB_SIZE * arena->n_carved++);
+	}
+	arena->n_used++;
+	
+	slab->arena = arena;
+	slab->free = NULL;
+	slab->bump = (char *) slab + POOL_BLOCKS_OFFSET;
+	slab->n_used = 0;
+	slab->size_class = size_class;
+	for(size_t i = 0; i < POOL_SLAB_BITS / 64; i++) {
+		slab->old[i] = 0;
+		slab->mark[i] = 0;
+		slab->traced[i] = 0;
+	}
+	slab->swept_cycle = esh->gc_cycle; // Holds nothing for the current sweep
+	POOL_POISON(slab->bump, POOL_SLAB_SIZE - POOL_BLOCKS_OFFSET);
+	
+	pool_slab_link(esh, slab);
+	return slab;
+}
+
+static void pool_free_arena(esh_state *esh, esh_arena *arena) {
+	if(arena->prev) arena->prev->next = arena->next;
+	else esh->pool_arenas = arena->next;
+	if(arena->next) arena->next->prev = arena->prev;
+	
+	esh->realloc(arena->mem, 0);
+	esh->realloc(arena, 0);
+}
+
+static void pool_release_slab(esh_state *esh, esh_slab *slab) {
+	esh_arena *arena = slab->arena;
+	slab->size_class = 0;
+	slab->next = arena->free_slabs;
+	arena->free_slabs = slab;
+	
+	if(--arena->n_used != 0 || (arena == esh->pool_arenas && !arena->next)) return;
+	if(esh->gc_phase == ESH_GC_SWEEPING) return; // The sweep holds on to its position in the arenas, see gc_end_sweep
+	
+	pool_free_arena(esh, arena);
+}
+
+static void *pool_alloc_class(esh_state *esh, size_t size_class) {
+	pool_lock(esh);
+	esh_slab *slab = esh->pool_slabs[size_class];
+	if(!slab && !(slab = pool_new_slab(esh, size_class))) {
+		pool_unlock(esh);
+		return NULL;
+	}
+	
+	void *p;
+	if(slab->free) {
+		p = slab->free;
+		POOL_UNPOISON(p, size_class * 16);
+		slab->free = *(void **) p;
+	} else {
+		p = slab->bump;
+		POOL_UNPOISON(p, size_class * 16);
+		slab->bump += size_class * 16;
+	}
+	
+	slab->n_used++;
+	if(pool_slab_full(slab)) pool_slab_unlink(esh, slab);
+	pool_unlock(esh);
+	return p;
+}
+
+static void pool_free_class(esh_state *esh, void *p, size_t size_class) {
+	pool_lock(esh);
+	esh_slab *slab = pool_slab_of(p);
+	assert(slab->size_class == size_class);
+	bool was_full = pool_slab_full(slab);
+	
+	size_t bit = pool_slab_bit(slab, p);
+	bitmap_clear(esh, &slab->old[BIT_WORD(bit)], BIT_MASK(bit));
+	bitmap_clear(esh, &slab->mark[BIT_WORD(bit)], BIT_MASK(bit));
+	bitmap_clear(esh, &slab->traced[BIT_WORD(bit)], BIT_MASK(bit));
+	
+	*(void **) p = slab->free;
+	slab->free = p;
+	POOL_POISON(p, size_class * 16);
+	
+	if(--slab->n_used == 0) {
+		if(!was_full) pool_slab_unlink(esh, slab);
+		pool_release_slab(esh, slab);
+	} else if(was_full) {
+		pool_slab_link(esh, slab);
+	}
+	pool_unlock(esh);
+}
+
+// Same as esh_alloc, but small blocks come from the slabs of the state. The block must be freed with esh_pool_free, given the same size
+void *esh_pool_alloc(esh_state *esh, size_t n) {
+	size_t size_class = pool_class_of(n);
+	if(size_class == 0) return esh_alloc(esh, n);
+	
+	inc_gc(esh, size_class * 16);
+	return pool_alloc_class(esh, size_class);
+}
+
+void *esh_pool_realloc(esh_state *esh, void *p, size_t old_n, size_t n) {
+	if(!p) return esh_pool_alloc(esh, n);
+	
+	size_t old_class = pool_class_of(old_n), new_class = pool_class_of(n);
+	if(old_class == 0 && new_class == 0) return esh_realloc(esh, p, n);
+	if(old_class != 0 && old_class == new_class) return p;
+	
+	void *new_p = esh_pool_alloc(esh, n);
+	if(!new_p) return NULL;
+	
+	memcpy(new_p, p, old_n < n? old_n : n);
+	esh_pool_free(esh, p, old_n);
+	return new_p;
+}
+
+void esh_pool_free(esh_state *esh, void *p, size_t n) {
+	if(!p) return;
+	
+	size_t size_class = pool_class_of(n);
+	if(size_class == 0) esh_free(esh, p);
+	else pool_free_class(esh, p, size_class);
+}
+
+// Frees a block of at most ESH_POOL_MAX bytes, whose size is recorded by its slab
+void esh_pool_free_small(esh_state *esh, void *p) {
+	if(!p) return;
+	
+	#ifdef NO_POOL
+	esh_free(esh, p);
+	#else
+	pool_free_class(esh, p, pool_slab_of(p)->size_class);
+	#endif
+}
+
 static int opt_req_stack(esh_state *esh, size_t n) {
 	assert(esh->current_thread->stack_len >= esh->current_thread->current_frame.stack_base);
 	size_t len = esh->current_thread->stack_len - esh->current_thread->current_frame.stack_base;
@@ -161,10 +492,10 @@ static void generate_stack_trace(esh_state *esh) {
 	
 	add_stack_trace_entry(esh, esh->current_thread->current_frame.fn, esh->current_thread->current_frame.instr_index, &buff);
 	
-	for(size_t i = esh->current_thread->stack_frames_len; i > 0; i--) {
+	for(size_t i = esh->current_thread->stack_frames_len; i > 0; i--) { // Callers resume after the call, and any UNPACK or POP folded into it, so trace the last of those instead
 		esh_stack_frame *frame = &esh->current_thread->stack_frames[i - 1];
 		stack_trace_buff_add(esh, &buff, "\n", 1);
-		add_stack_trace_entry(esh, frame->fn, frame->instr_index, &buff);
+		add_stack_trace_entry(esh, frame->fn, frame->instr_index != 0? frame->instr_index - 1 : 0, &buff);
 	}
 	
 	stack_trace_buff_add(esh, &buff, "\0", 1);
@@ -199,15 +530,49 @@ static void *default_realloc_callback(void *p, size_t n) {
 
 static void free_stack_frame(esh_state *esh, esh_stack_frame *frame);
 
-static void coroutine_free(esh_state *esh, void *p) {
-	esh_co_thread *c = p;
+// Buffers that grew larger than this are freed rather than kept for reuse
+#define CO_POOL_MAX_STACK 1024
+#define CO_POOL_MAX_FRAMES 64
+
+static void pooled_buff_give(esh_state *esh, esh_pooled_buff *pool, size_t *len, void *p, size_t cap, size_t max_cap) {
+	if(!p) return;
+	
+	if(*len == ESH_CO_POOL_MAX || cap > max_cap) esh_free(esh, p);
+	else pool[(*len)++] = (esh_pooled_buff) { p, cap };
+}
+
+static void *pooled_buff_take(esh_pooled_buff *pool, size_t *len, size_t min_cap, size_t *out_cap) {
+	for(size_t i = *len; i > 0; i--) {
+		if(pool[i - 1].cap < min_cap) continue;
+		
+		esh_pooled_buff buff = pool[i - 1];
+		pool[i - 1] = pool[--(*len)];
+		*out_cap = buff.cap;
+		return buff.p;
+	}
+	return NULL;
+}
+
+// Gives the stack and frames of a coroutine back to the state, once it's done or freed
+static void release_co_buffers(esh_state *esh, esh_co_thread *c) {
 	for(size_t i = 0; i < c->stack_frames_len; i++) {
 		free_stack_frame(esh, &c->stack_frames[i]);
 	}
 	free_stack_frame(esh, &c->current_frame);
+	c->current_frame.fn = NULL;
+	c->current_frame.env = NULL;
 	
-	esh_free(esh, c->stack);
-	esh_free(esh, c->stack_frames);
+	if(c->stack != c->inline_stack) pooled_buff_give(esh, esh->co_stacks, &esh->co_stacks_len, c->stack, c->stack_cap, CO_POOL_MAX_STACK);
+	pooled_buff_give(esh, esh->co_frames, &esh->co_frames_len, c->stack_frames, c->stack_frames_cap, CO_POOL_MAX_FRAMES);
+	
+	c->stack = NULL;
+	c->stack_len = c->stack_cap = 0;
+	c->stack_frames = NULL;
+	c->stack_frames_len = c->stack_frames_cap = 0;
+}
+
+static void coroutine_free(esh_state *esh, void *p) {
+	release_co_buffers(esh, p);
 }
 
 static esh_type string_type = { .name = "string", .on_free = NULL };
@@ -216,9 +581,15 @@ static esh_type closure_type = { .name = "function", .on_free = NULL };
 static esh_type env_type = { .name = "function environment", .on_free = NULL };
 static esh_type co_thread_type = { .name = "coroutine", .on_free = coroutine_free };
 
+static void shape_free(esh_state *esh, void *p);
+static esh_type shape_type = { .name = "shape", .on_free = shape_free };
+
 static void *alloc_object(esh_state *esh, size_t s, esh_type *type);
 static void free_object(esh_state *, esh_object *);
 
+#define GC_MIN_OLD_THRESHOLD (256 * 1024) // Size of the old generation below which no major cycle is started
+#define GC_DEFAULT_NURSERY (256 * 1024)
+
 #define DEFAULT_ERR_BUFF_CAP 512
 esh_state *esh_open(void *(*realloc)(void *, size_t)) {
 	#ifndef NO_MALLOC
@@ -228,6 +599,29 @@ esh_state *esh_open(void *(*realloc)(void *, size_t)) {
 	esh_state *esh = realloc(NULL, sizeof(esh_state));
 	if(!esh) goto ERR_ALLOC_STATE;
 	esh->realloc = realloc;
+	esh->gc_freq = 0; // Initially, the GC should be disabled
+	
+	for(size_t i = 0; i <= ESH_POOL_N_CLASSES; i++) esh->pool_slabs[i] = NULL;
+	esh->pool_arenas = NULL;
+	
+	esh->large = NULL;
+	esh->gc_phase = ESH_GC_IDLE;
+	esh->gray = (esh_obj_stack) { NULL, 0, 0, false };
+	esh->gc_cycle = 0;
+	esh->sweep_arena = NULL;
+	esh->sweep_slab = 0;
+	esh->old_bytes = 0;
+	esh->old_threshold = GC_MIN_OLD_THRESHOLD;
+	
+	esh->gc_worker = NULL;
+	esh->gc_satb = false;
+	esh->gc_safepoint = false;
+	esh->gc_worker_marking = false;
+	esh->gc_worker_sweeping = false;
+	
+	esh->young = NULL;
+	esh->young_gray = (esh_obj_stack) { NULL, 0, 0, false };
+	esh->remembered = (esh_obj_stack) { NULL, 0, 0, false };
 	
 	esh->err_buff_cap = DEFAULT_ERR_BUFF_CAP;
 	esh->err_buff = esh_alloc(esh, sizeof(char) * esh->err_buff_cap);
@@ -236,14 +630,19 @@ esh_state *esh_open(void *(*realloc)(void *, size_t)) {
 	esh->stack_trace = NULL;
 	esh->panic_caught = false;
 	
-	esh->objects = NULL;
-	esh->visited = NULL;
-	esh->to_visit = NULL;
+	esh->interned = NULL;
+	esh->interned_len = 0;
+	esh->interned_cap = 0;
+	
+	esh->root_shape = NULL;
 	
 	esh->threads = NULL;
 	esh->threads_len = 0;
 	esh->threads_cap = 0;
 	
+	esh->co_stacks_len = 0;
+	esh->co_frames_len = 0;
+	
 	esh->current_thread = alloc_object(esh, sizeof(esh_co_thread), &co_thread_type);
 	if(!esh->current_thread) goto ERR_ALLOC_COROUTINE;
 	esh->current_thread->stack = NULL;
@@ -275,17 +674,45 @@ esh_state *esh_open(void *(*realloc)(void *, size_t)) {
 	
 	esh->saved_stack_len = 0;
 	
-	esh->gc_freq = 0; // Initially, the GC should be disabled
+	esh->gc_mode = ESH_GC_MODE_BYTES;
 	esh->gc_step_size = 0;
 	esh->alloc_step = 0;
-	
-	esh->globals = alloc_object(esh, sizeof(esh_object), NULL);
+	esh->gc_debt = 0;
+	esh->gc_nursery = GC_DEFAULT_NURSERY;
+	esh->gc_pause = 200; // Start a major cycle once the old generation doubled
+	esh->gc_step_mul = 100;
+	esh->gc_cycle_start_bytes = 0;
+	
+	esh->gc_trace = false;
+	esh->gc_n_minor = 0;
+	esh->gc_pause_total = esh->gc_pause_max = 0;
+	esh->gc_freed_objects = esh->gc_freed_bytes = 0;
+	esh->gc_allocated = 0;
+	esh->gc_open_time = gc_now();
+	esh->gc_trace_minors = esh->gc_trace_freed = 0;
+	esh->gc_trace_pause = esh->gc_trace_max_pause = 0;
+	
+	esh->globals = alloc_object(esh, sizeof(esh_table), NULL);
 	if(!esh->globals) goto ERR_ALLOC_GLOBALS;
+	if(esh_object_make_dict(esh, esh->globals)) goto ERR_ALLOC_ROOT_SHAPE; // Inline caches of globals point into the entries table
+	
+	esh->root_shape = alloc_object(esh, sizeof(esh_shape), &shape_type);
+	if(!esh->root_shape) goto ERR_ALLOC_ROOT_SHAPE;
+	esh->root_shape->parent = NULL;
+	esh->root_shape->n_slots = 0;
+	esh->root_shape->keys = NULL;
+	esh->root_shape->children = NULL;
+	esh->root_shape->children_len = 0;
+	esh->root_shape->children_cap = 0;
+	
+	esh->globals_version = 1;
 	
 	esh->cmd = ESH_NULL;
 	
-	esh->gc_freq = 256; // Run the GC every 256 allocations
-	esh->gc_step_size = 64; // Run at most 64 steps at a time
+	esh->peephole = true;
+	
+	esh->gc_freq = 256; // In ESH_GC_MODE_COUNT, run the GC every 256 allocations
+	esh->gc_step_size = 64; // In ESH_GC_MODE_COUNT, run at most 64 steps at a time
 	
 	esh->str_buff = NULL;
 	esh->str_buff_len = 0;
@@ -293,6 +720,9 @@ esh_state *esh_open(void *(*realloc)(void *, size_t)) {
 	
 	return esh;
 	
+	ERR_ALLOC_ROOT_SHAPE:
+	free_object(esh, &esh->globals->obj);
+	
 	ERR_ALLOC_GLOBALS:
 	
 	ERR_ALLOC_STACK:
@@ -321,24 +751,13 @@ void esh_close(esh_state *esh) {
 	
 	esh_free(esh, esh->threads);
 	
-	// Free all objects
-	esh_object *next = esh->objects;
-	for(esh_object *obj = next; next != NULL; obj = next) {
-		next = obj->next;
-		free_object(esh, obj);
-	}
+	gc_free_all(esh);
 	
-	next = esh->visited;
-	for(esh_object *obj = next; next != NULL; obj = next) {
-		next = obj->next;
-		free_object(esh, obj);
-	}
+	for(size_t i = 0; i < esh->co_stacks_len; i++) esh_free(esh, esh->co_stacks[i].p);
+	for(size_t i = 0; i < esh->co_frames_len; i++) esh_free(esh, esh->co_frames[i].p);
 	
-	next = esh->to_visit;
-	for(esh_object *obj = next; next != NULL; obj = next) {
-		next = obj->next;
-		free_object(esh, obj);
-	}
+	assert(esh->interned_len == 0);
+	esh_free(esh, esh->interned);
 	
 	esh->realloc(esh, 0);
 }
@@ -351,7 +770,14 @@ void esh_pop(esh_state *esh, size_t n) {
 int esh_req_stack(esh_state *esh, size_t n) {
 	if(esh->current_thread->stack_cap - esh->current_thread->stack_len < n) {
 		size_t new_cap = esh->current_thread->stack_cap * 3 / 2 + n;
-		esh_val *new_stack = esh_realloc(esh, esh->current_thread->stack, sizeof(esh_val) * new_cap);
+		esh_val *new_stack;
+		if(esh->current_thread->stack == esh->current_thread->inline_stack) { // Moves out of the coroutine object, preferably into the stack of a finished one
+			new_stack = pooled_buff_take(esh->co_stacks, &esh->co_stacks_len, new_cap, &new_cap);
+			if(!new_stack) new_stack = esh_alloc(esh, sizeof(esh_val) * new_cap);
+			if(new_stack) memcpy(new_stack, esh->current_thread->stack, sizeof(esh_val) * esh->current_thread->stack_len);
+		} else {
+			new_stack = esh_realloc(esh, esh->current_thread->stack, sizeof(esh_val) * new_cap);
+		}
 		if(!new_stack) {
 			esh_err_printf(esh, "Unable to grow stack (out of memory?)");
 			return 1;
@@ -366,9 +792,9 @@ int esh_req_stack(esh_state *esh, size_t n) {
 
 static void *val_as_object(esh_val val, const esh_type *type) {
 	if(val == NULL) return NULL;
-	int bit_tag = ((uintptr_t) val) & 1;
+	int bit_tag = ((uintptr_t) val) & 3;
 	
-	if(bit_tag == 1) return NULL;
+	if(bit_tag != 0) return NULL; // Short strings and integers
 	
 	esh_object *obj = val;
 	if(type != NULL && obj->type != type) return NULL;
@@ -376,13 +802,28 @@ static void *val_as_object(esh_val val, const esh_type *type) {
 	return obj;
 }
 
+// Only plain objects hold entries
+static esh_table *val_as_table(esh_val val) {
+	esh_object *obj = val_as_object(val, NULL);
+	if(!obj || obj->type) return NULL;
+	return (esh_table *) obj;
+}
+
 static const char *val_as_string(esh_val *val, size_t *opt_out_len) {
 	if(((uintptr_t) *val) & 1) {
 		char *s = (char *) val;
 		#ifndef BIG_ENDIAN
 		s++;
 		#endif
-		if(opt_out_len) *opt_out_len = strlen(s);
+		if(opt_out_len) *opt_out_len = esh_short_str_len(*val);
+		return s;
+	}
+	
+	if(esh_val_is_int(*val)) {
+		// Uses the static int_to_str buffer, so the result has to be consumed before the next conversion
+		size_t len;
+		const char *s = int_to_str(esh_val_to_int(*val), &len);
+		if(opt_out_len) *opt_out_len = len;
 		return s;
 	}
 	
@@ -393,6 +834,48 @@ static const char *val_as_string(esh_val *val, size_t *opt_out_len) {
 	return str->str;
 }
 
+// Non-negative integer keys go straight to the array part of objects, without a string conversion
+static bool val_as_index(esh_val val, size_t *out_index) {
+	if(!esh_val_is_int(val) || esh_val_to_int(val) < 0) return false;
+	*out_index = esh_val_to_int(val);
+	return true;
+}
+
+static int object_get_val(esh_state *esh, esh_table *obj, esh_val key, esh_val *out_val) {
+	size_t i;
+	if(val_as_index(key, &i)) {
+		esh_object_get_i(esh, obj, i, out_val);
+		return 0;
+	}
+	
+	size_t keylen;
+	const char *keystr = val_as_string(&key, &keylen);
+	if(!keystr) return 1;
+	
+	if(esh_val_is_int(key)) esh_object_get(esh, obj, keystr, keylen, out_val); // Negative integers
+	else esh_object_get_v(esh, obj, key, out_val);
+	return 0;
+}
+
+static int object_set_val(esh_state *esh, esh_table *obj, esh_val key, esh_val val) {
+	size_t i;
+	if(val_as_index(key, &i)) return esh_object_set_i(esh, obj, i, val);
+	
+	size_t keylen;
+	const char *keystr = val_as_string(&key, &keylen);
+	if(!keystr) {
+		esh_err_printf(esh, "Attempting to use non-string value as key");
+		return 1;
+	}
+	
+	if(esh_val_is_int(key)) {
+		char buff[32];
+		memcpy(buff, keystr, sizeof(char) * keylen);
+		return esh_object_set(esh, obj, buff, keylen, val);
+	}
+	return esh_object_set_v(esh, obj, key, val);
+}
+
 static int stack_offset(esh_state *esh, long long offset, size_t *out_index) {
 	size_t items_in_frame = esh->current_thread->stack_len - esh->current_thread->current_frame.stack_base;
 	if(offset < 0) {
@@ -410,11 +893,29 @@ static int stack_offset(esh_state *esh, long long offset, size_t *out_index) {
 	return 1;
 }
 
+static esh_val new_string_val(esh_state *esh, const char *str, size_t len);
+
+// Integers only become strings once a caller needs the text. The stack slot is replaced by the string, so that the returned pointer stays valid for as long as the value is on the stack
+static int stringify_int_val(esh_state *esh, esh_val *val) {
+	char buff[32];
+	size_t len;
+	const char *str = int_to_str(esh_val_to_int(*val), &len);
+	memcpy(buff, str, sizeof(char) * len);
+	
+	esh_val res = new_string_val(esh, buff, len);
+	if(res == ESH_NULL) return 1;
+	
+	*val = res;
+	return 0;
+}
+
 const char *esh_as_string(esh_state *esh, long long offset, size_t *opt_out_len) {
 	size_t index;
 	if(stack_offset(esh, offset, &index)) return NULL;
 	
 	esh_val *val = &esh->current_thread->stack[index];
+	if(esh_val_is_int(*val) && stringify_int_val(esh, val)) return NULL;
+	
 	const char *str = val_as_string(val, opt_out_len);
 	if(!str) esh_err_printf(esh, "Unable to implicitly convert object to string");
 	
@@ -422,6 +923,11 @@ const char *esh_as_string(esh_state *esh, long long offset, size_t *opt_out_len)
 }
 
 int val_as_int(esh_val *val, long long *out_int) {
+	if(esh_val_is_int(*val)) {
+		*out_int = esh_val_to_int(*val);
+		return 0;
+	}
+	
 	const char *str = val_as_string(val, NULL);
 	if(!str) return 1;
 	
@@ -466,19 +972,11 @@ bool esh_is_array(esh_state *esh, long long offset) {
 	size_t index;
 	if(stack_offset(esh, offset, &index)) return false;
 	
-	esh_object *obj = val_as_object(esh->current_thread->stack[index], NULL);
+	esh_table *obj = val_as_table(esh->current_thread->stack[index]);
 	if(!obj) return false;
 	
-	if(obj->len == 0) return false;
-	
-	for(size_t i = 0; i < obj->len; i++) {
-		size_t keylen;
-		const char *key = int_to_str(i, &keylen);
-		esh_val _;
-		if(!esh_object_get(esh, obj, key, keylen, &_)) return false;
-	}
-	
-	return true;
+	// The array part can have holes, in which case the entry count is lower than its length
+	return obj->len != 0 && obj->len == obj->array_len;
 }
 
 bool val_as_bool(esh_val *val) {
@@ -554,26 +1052,52 @@ const char *esh_val_as_str(esh_val *val, size_t *out_len) {
 }
 */
 
+// Objects too large for the slabs are preceded by their size, which the GC paces itself with
+typedef union large_prefix {
+	size_t size;
+	long double align_ld;
+	void *align_p;
+} large_prefix;
+
+static size_t object_size(esh_object *obj) {
+	if(obj->pool_class != 0) return obj->pool_class * 16;
+	return ((large_prefix *) obj - 1)->size;
+}
+
 static void *alloc_object(esh_state *esh, size_t s, esh_type *type) {
 	assert(s >= sizeof(esh_object));
 	
-	esh_object *obj = esh_alloc(esh, s);
+	esh_object *obj;
+	size_t size_class = pool_class_of(s);
+	if(size_class != 0) {
+		obj = esh_pool_alloc(esh, s);
+	} else {
+		large_prefix *prefix = esh_alloc(esh, sizeof(large_prefix) + s);
+		if(prefix) prefix->size = sizeof(large_prefix) + s;
+		obj = prefix? (esh_object *) (prefix + 1) : NULL;
+	}
 	if(!obj) {
 		esh_err_printf(esh, "Unable to create object (ouf of memory?)");
-		esh->current_thread->stack_len--;
 		return NULL;
 	}
 	
 	obj->type = type;
+	obj->pool_class = size_class;
 	
-	obj->next = esh->objects;
-	if(obj->next) obj->next->prev = obj;
-	obj->prev = NULL;
-	esh->objects = obj;
+	obj->next = esh->young;
+	esh->young = obj;
 	
 	obj->gc_tag = 0;
-	
-	esh_object_init_entries(esh, obj);
+	obj->gc_gen = 0;
+	obj->is_const = false;
+	
+	if(!type) {
+		assert(s >= sizeof(esh_table));
+		esh_object_init_entries(esh, (esh_table *) obj);
+	} else if(type->n_refs != 0) {
+		assert(s >= sizeof(esh_object) + sizeof(esh_val) * type->n_refs);
+		memset(obj + 1, 0, sizeof(esh_val) * type->n_refs);
+	}
 	
 	return obj;
 }
@@ -582,7 +1106,10 @@ void *esh_new_object(esh_state *esh, size_t s, esh_type *type) {
 	if(stack_push(esh, NULL)) return NULL;
 	
 	esh_object *obj = alloc_object(esh, s, type);
-	if(!obj) return NULL;
+	if(!obj) {
+		esh->current_thread->stack_len--;
+		return NULL;
+	}
 
 	esh->current_thread->stack[esh->current_thread->stack_len - 1] = obj;
 	
@@ -590,6 +1117,26 @@ void *esh_new_object(esh_state *esh, size_t s, esh_type *type) {
 }
 
 static void gc_obj_write_barrier(esh_state *esh, esh_object *obj);
+static void gc_shade(esh_state *esh, esh_val val);
+
+int esh_set_ref(esh_state *esh, void *obj, size_t i, long long offset) {
+	esh_object *o = obj;
+	assert(o->type && i < o->type->n_refs);
+	
+	size_t index;
+	if(stack_offset(esh, offset, &index)) return 1;
+	
+	gc_obj_write_barrier(esh, o);
+	((esh_val *) (o + 1))[i] = esh->current_thread->stack[index];
+	return 0;
+}
+
+int esh_push_ref(esh_state *esh, void *obj, size_t i) {
+	esh_object *o = obj;
+	assert(o->type && i < o->type->n_refs);
+	
+	return stack_push(esh, ((esh_val *) (o + 1))[i]);
+}
 
 int esh_new_array(esh_state *esh, size_t n) {
 	if(stack_size(esh) < n) {
@@ -597,15 +1144,12 @@ int esh_new_array(esh_state *esh, size_t n) {
 		return 1;
 	}
 	
-	esh_object *obj = esh_new_object(esh, sizeof(esh_object), NULL);
+	esh_table *obj = esh_new_object(esh, sizeof(esh_table), NULL);
 	if(!obj) return 1;
 	
 	for(size_t i = 0; i < n; i++) {
-		size_t keylen;
-		char *key = int_to_str(i, &keylen);
-		
-		gc_obj_write_barrier(esh, esh->globals);
-		if(esh_object_set(esh, obj, key, keylen, esh->current_thread->stack[esh->current_thread->stack_len - n - 1 + i])) {
+		gc_obj_write_barrier(esh, &obj->obj);
+		if(esh_object_set_i(esh, obj, i, esh->current_thread->stack[esh->current_thread->stack_len - n - 1 + i])) {
 			esh_err_printf(esh, "Unable to set array entry (out of memory?)");
 			esh->current_thread->stack_len--;
 			return 1;
@@ -619,6 +1163,8 @@ int esh_new_array(esh_state *esh, size_t n) {
 }
 
 int esh_push_int(esh_state *esh, long long i) {
+	if(i >= ESH_INT_MIN && i <= ESH_INT_MAX) return stack_push(esh, esh_val_from_int(i));
+	
 	size_t len;
 	char *str = int_to_str(i, &len);
 	
@@ -632,7 +1178,16 @@ int esh_push_bool(esh_state *esh, bool b) {
 
 bool vals_equal(esh_val *a, esh_val *b) {
 	if(*a == *b) return true;
+	if(esh_val_is_int(*a) && esh_val_is_int(*b)) return false;
+	
+	esh_string *astr_obj = val_as_object(*a, &string_type), *bstr_obj = val_as_object(*b, &string_type);
+	if(astr_obj && bstr_obj) {
+		if(astr_obj->interned && bstr_obj->interned) return false; // Equal interned strings are the same object
+		if(astr_obj->hash != bstr_obj->hash || astr_obj->len != bstr_obj->len) return false;
+		return memcmp(astr_obj->str, bstr_obj->str, sizeof(char) * astr_obj->len) == 0;
+	}
 	
+	// At most one of the values is an integer here, so the shared int_to_str buffer is only used once
 	size_t alen, blen;
 	const char *astr, *bstr;
 	
@@ -661,7 +1216,7 @@ int esh_new_array(esh_state *esh, size_t n) {
 		size_t len;
 		const char *key = int_to_str(i, &len);
 		
-		if(esh_object_set(esh, obj, key, len, esh->current_thread->stack[esh->current_thread->stack_len - n - 1 + i])) {
+		if(esh_object_set_v(esh, obj, key, len, esh->current_thread->stack[esh->current_thread->stack_len - n - 1 + i])) {
 			esh_pop(esh);
 			esh_err_printf(esh, "Unable to set array object members (out of memory?)");
 			return 1;
@@ -692,6 +1247,8 @@ int esh_new_fn(esh_state *esh, const char *name, size_t name_len) {
 	fn->opt_args = 0;
 	fn->n_locals = 0;
 	fn->upval_locals = false;
+	fn->captured = NULL;
+	fn->n_env_locals = 0;
 	
 	fn->instr = NULL;
 	fn->instr_len = 0;
@@ -701,7 +1258,17 @@ int esh_new_fn(esh_state *esh, const char *name, size_t name_len) {
 	fn->line_dirs_len = 0;
 	fn->line_dirs_cap = 0;
 	
+	fn->code = NULL;
+	fn->code_len = 0;
+	
+	fn->global_caches = NULL;
+	fn->n_global_caches = 0;
+	
+	fn->index_caches = NULL;
+	fn->n_index_caches = 0;
+	
 	fn->c_fn = NULL;
+	fn->is_leaf = false;
 	
 	fn->variadic = false;
 	
@@ -720,13 +1287,14 @@ int esh_new_fn(esh_state *esh, const char *name, size_t name_len) {
 	return 0;
 }
 
-int esh_new_c_fn(esh_state *esh, const char *name, esh_fn_result (*f)(esh_state *, size_t, size_t), size_t n_args, size_t opt_args, bool variadic) {
+static int new_c_fn(esh_state *esh, const char *name, esh_fn_result (*f)(esh_state *, size_t, size_t), size_t n_args, size_t opt_args, bool variadic, bool is_leaf) {
 	esh_closure *cl = esh_new_object(esh, sizeof(esh_closure), &closure_type);
 	if(!cl) return 1;
 	cl->env = NULL;
 	cl->fn = NULL;
 	cl->obj.is_const = true;
 	cl->is_coroutine = false;
+	cl->is_shared = false;
 	
 	if(esh_new_fn(esh, name, strlen(name))) {
 		esh_pop(esh, 1);
@@ -736,10 +1304,12 @@ int esh_new_c_fn(esh_state *esh, const char *name, esh_fn_result (*f)(esh_state
 	esh_function *fn = esh_as_type(esh, -1, &function_type);
 	fn->n_args = n_args;
 	fn->opt_args = opt_args;
+	gc_obj_write_barrier(esh, &cl->obj); // Creating the function may have promoted the closure
 	cl->fn = fn;
 	cl->env = NULL;
 	
 	fn->c_fn = f;
+	fn->is_leaf = is_leaf;
 	
 	fn->variadic = variadic;
 	
@@ -748,6 +1318,52 @@ int esh_new_c_fn(esh_state *esh, const char *name, esh_fn_result (*f)(esh_state
 	return 0;
 }
 
+int esh_new_c_fn(esh_state *esh, const char *name, esh_fn_result (*f)(esh_state *, size_t, size_t), size_t n_args, size_t opt_args, bool variadic) {
+	return new_c_fn(esh, name, f, n_args, opt_args, variadic, false);
+}
+
+int esh_new_c_leaf_fn(esh_state *esh, const char *name, esh_fn_result (*f)(esh_state *, size_t, size_t), size_t n_args, size_t opt_args, bool variadic) {
+	return new_c_fn(esh, name, f, n_args, opt_args, variadic, true);
+}
+
+// Inline caches point into the entries table of the globals, so they are invalidated whenever an entry may have moved or been removed
+static int set_global_val(esh_state *esh, const char *name, size_t len, esh_val val) {
+	esh_object_entry *entries = esh->globals->entries;
+	
+	gc_obj_write_barrier(esh, &esh->globals->obj);
+	if(esh_object_set(esh, esh->globals, name, len, val)) return 1;
+	
+	if(val == ESH_NULL || esh->globals->entries != entries) esh->globals_version++;
+	return 0;
+}
+
+static esh_global_cache *global_cache(esh_function *fn, const esh_instr *instr) {
+	assert(instr->ext < fn->n_global_caches);
+	return &fn->global_caches[instr->ext];
+}
+
+static void fill_global_cache(esh_state *esh, esh_global_cache *cache, esh_val key) {
+	if(!cache) return;
+	
+	esh_object_entry *entry = esh_object_get_entry(esh, esh->globals, key);
+	if(entry) *cache = (esh_global_cache) { esh->globals_version, key, entry };
+}
+
+// Looks up a global through the inline cache of an instruction. Returns false if there is no such global, or the key is not a string
+static bool get_global_cached(esh_state *esh, esh_global_cache *cache, esh_val key, esh_val *out_val) {
+	if(cache && cache->version == esh->globals_version && cache->key == key) {
+		*out_val = cache->entry->val;
+		return true;
+	}
+	
+	if(!val_as_string(&key, NULL)) return false;
+	
+	*out_val = ESH_NULL;
+	if(object_get_val(esh, esh->globals, key, out_val) || *out_val == ESH_NULL) return false;
+	if(!esh_val_is_int(key)) fill_global_cache(esh, cache, key);
+	return true;
+}
+
 int esh_set_global(esh_state *esh, const char *name) {
 	if(stack_size(esh) == 0) {
 		esh_err_printf(esh, "Not enough items on stack to set global");
@@ -755,8 +1371,7 @@ int esh_set_global(esh_state *esh, const char *name) {
 	}
 	
 	esh_val val = esh->current_thread->stack[esh->current_thread->stack_len - 1];
-	gc_obj_write_barrier(esh, esh->globals);
-	if(esh_object_set(esh, esh->globals, name, strlen(name), val)) {
+	if(set_global_val(esh, name, strlen(name), val)) {
 		esh->current_thread->stack_len--;
 		esh_err_printf(esh, "Unable to set global (out of memory?)");
 		return 1;
@@ -778,59 +1393,264 @@ int esh_get_global(esh_state *esh, const char *name) {
 	return 1;
 }
 
-int esh_new_string(esh_state *esh, const char *str, size_t len) {
+static esh_val new_string_val(esh_state *esh, const char *str, size_t len) {
 	if(len < sizeof(void *) - 2) {
-		uintptr_t short_str = 1;
+		uintptr_t short_str = 1 | (len << 1);
 		char *s = (char *) &short_str;
 		#ifndef BIG_ENDIAN
 		s++; 
 		#endif
 		if(len != 0) memcpy(s, str, sizeof(char) * len);
 		s[len] = '\0';
-		if(stack_push(esh, (esh_val) short_str)) return 1;
 		
-		return 0;
+		return (esh_val) short_str;
 	}
 	
-	esh_string *obj = esh_new_object(esh, sizeof(esh_string) + sizeof(char) * (len + 1), &string_type);
-	if(!obj) return 1;
+	esh_string *obj = alloc_object(esh, sizeof(esh_string) + sizeof(char) * (len + 1), &string_type);
+	if(!obj) return ESH_NULL;
 	
 	obj->obj.is_const = true;
 	
 	obj->len = len;
+	obj->hash = esh_strhash(str, len);
+	obj->interned = false;
 	memcpy(obj->str, str, sizeof(char) * len);
 	obj->str[len] = '\0';
 	
-	return 0;
+	return obj;
 }
 
-int esh_push_null(esh_state *esh) {
-	if(stack_push(esh, NULL)) return 1;
-	return 0;
+// INTERNING
+
+static esh_intern_entry *intern_slot(esh_state *esh, const char *str, size_t len, size_t hash) {
+	size_t mask = esh->interned_cap - 1;
+	for(size_t i = hash & mask;; i = (i + 1) & mask) {
+		esh_intern_entry *entry = &esh->interned[i];
+		if(entry->str == NULL) return entry;
+		if(entry->hash == hash && entry->str->len == len && memcmp(entry->str->str, str, sizeof(char) * len) == 0) return entry;
+	}
 }
 
-int esh_object_of(esh_state *esh, size_t n) {
-	if(stack_size(esh) < n * 2) {
-		esh_err_printf(esh, "Not enough items on stack for object creation (%zu/%zu)", (size_t) stack_size(esh), (size_t) n * 2);
+static void intern_put(esh_state *esh, esh_string *s) {
+	esh_intern_entry *entry = intern_slot(esh, s->str, s->len, s->hash);
+	entry->hash = s->hash;
+	entry->str = s;
+}
+
+// Grows the table ahead of an insertion. Interned strings are only removed by the GC, so the reserved slot stays free even if allocating the string runs the GC
+static int intern_reserve(esh_state *esh) {
+	if((esh->interned_len + 1) * 4 <= esh->interned_cap * 3) return 0;
+	
+	size_t new_cap = esh->interned_cap == 0? 64 : esh->interned_cap * 2;
+	esh_intern_entry *new_table = esh_alloc(esh, sizeof(esh_intern_entry) * new_cap);
+	if(!new_table) {
+		esh_err_printf(esh, "Unable to grow string intern table (out of memory?)");
 		return 1;
 	}
+	for(size_t i = 0; i < new_cap; i++) new_table[i].str = NULL;
 	
-	esh_object *obj = esh_new_object(esh, sizeof(esh_object), NULL);
+	esh_intern_entry *old_table = esh->interned;
+	size_t old_cap = esh->interned_cap;
+	esh->interned = new_table;
+	esh->interned_cap = new_cap;
+	
+	for(size_t i = 0; i < old_cap; i++) {
+		if(old_table[i].str) intern_put(esh, old_table[i].str);
+	}
+	
+	esh_free(esh, old_table);
+	return 0;
+}
+
+static void intern_remove(esh_state *esh, esh_string *str) {
+	size_t mask = esh->interned_cap - 1;
+	size_t i = str->hash & mask;
+	while(esh->interned[i].str != str) i = (i + 1) & mask;
+	
+	// Shift back the following entries of the probe sequence, so that no tombstones are needed
+	size_t j = i;
+	while(true) {
+		j = (j + 1) & mask;
+		esh_intern_entry entry = esh->interned[j];
+		if(entry.str == NULL) break;
+		
+		size_t home = entry.hash & mask;
+		if(((j - home) & mask) >= ((j - i) & mask)) {
+			esh->interned[i] = entry;
+			i = j;
+		}
+	}
+	
+	esh->interned[i].str = NULL;
+	esh->interned_len--;
+}
+
+// Returns the interned string (or short string) with the given contents, or ESH_NULL if there is none. Never allocates
+esh_val esh_intern_find(esh_state *esh, const char *str, size_t len) {
+	if(len < sizeof(void *) - 2) return new_string_val(esh, str, len);
+	if(esh->interned_len == 0) return ESH_NULL;
+	
+	return intern_slot(esh, str, len, esh_strhash(str, len))->str;
+}
+
+// The results of esh_intern and esh_intern_val are about to be stored as keys, so they are shaded for the GC. An interned string may otherwise only be referenced by an object the GC has already traced
+esh_val esh_intern(esh_state *esh, const char *str, size_t len) {
+	esh_val found = esh_intern_find(esh, str, len);
+	if(found == ESH_NULL) {
+		if(intern_reserve(esh)) return ESH_NULL;
+		
+		esh_string *s = new_string_val(esh, str, len);
+		if(!s) return ESH_NULL;
+		
+		s->interned = true;
+		intern_put(esh, s);
+		esh->interned_len++;
+		found = s;
+	}
+	
+	gc_shade(esh, found);
+	return found;
+}
+
+// Returns the interned version of a string value, interning the string object itself if there is none yet
+esh_val esh_intern_val(esh_state *esh, esh_val val) {
+	if(esh_val_is_short_str(val)) return val;
+	
+	esh_string *s = val;
+	assert(s->obj.type == &string_type);
+	if(s->interned) return s;
+	
+	if(esh->interned_len != 0) {
+		esh_string *found = intern_slot(esh, s->str, s->len, s->hash)->str;
+		if(found) {
+			gc_shade(esh, found);
+			return found;
+		}
+	}
+	
+	if(intern_reserve(esh)) return ESH_NULL;
+	
+	s->interned = true;
+	intern_put(esh, s);
+	esh->interned_len++;
+	
+	gc_shade(esh, s);
+	return s;
+}
+
+// SHAPES
+
+// Transitions are weak in both directions, so whichever of a parent and a child shape is freed first unlinks itself from the other
+static void shape_free(esh_state *esh, void *p) {
+	esh_shape *shape = p;
+	
+	for(size_t i = 0; i < shape->children_len; i++) shape->children[i]->parent = NULL;
+	
+	esh_shape *parent = shape->parent;
+	if(parent) {
+		for(size_t i = 0; i < parent->children_len; i++) {
+			if(parent->children[i] == shape) {
+				parent->children[i] = parent->children[--parent->children_len];
+				break;
+			}
+		}
+	}
+	
+	esh_free(esh, shape->keys);
+	esh_free(esh, shape->children);
+}
+
+// Returns the shape that results from adding an interned key to a shape (or to the root shape if NULL). The result is shaded for the GC, like interned keys
+esh_shape *esh_shape_add(esh_state *esh, esh_shape *shape, esh_val key) {
+	if(!shape) shape = esh->root_shape;
+	
+	for(size_t i = 0; i < shape->children_len; i++) {
+		esh_shape *child = shape->children[i];
+		if(child->keys[child->n_slots - 1] == key) {
+			gc_shade(esh, child);
+			return child;
+		}
+	}
+	
+	if(shape->children_len == shape->children_cap) {
+		size_t new_cap = shape->children_cap * 2 + 2;
+		esh_shape **new_children = esh_realloc(esh, shape->children, sizeof(esh_shape *) * new_cap);
+		if(!new_children) {
+			esh_err_printf(esh, "Unable to add shape transition (out of memory?)");
+			return NULL;
+		}
+		
+		shape->children = new_children;
+		shape->children_cap = new_cap;
+	}
+	
+	esh_shape *child = alloc_object(esh, sizeof(esh_shape), &shape_type);
+	if(!child) return NULL;
+	
+	child->parent = NULL;
+	child->n_slots = 0;
+	child->keys = NULL;
+	child->children = NULL;
+	child->children_len = 0;
+	child->children_cap = 0;
+	gc_shade(esh, child); // Before allocating the keys, which may run the GC
+	
+	child->keys = esh_alloc(esh, sizeof(esh_val) * (shape->n_slots + 1));
+	if(!child->keys) {
+		esh_err_printf(esh, "Unable to allocate shape (out of memory?)");
+		return NULL;
+	}
+	
+	if(shape->n_slots != 0) memcpy(child->keys, shape->keys, sizeof(esh_val) * shape->n_slots);
+	child->keys[shape->n_slots] = key;
+	child->n_slots = shape->n_slots + 1;
+	
+	child->parent = shape;
+	shape->children[shape->children_len++] = child;
+	gc_obj_write_barrier(esh, &child->obj); // The child may have been promoted while allocating the keys
+	
+	return child;
+}
+
+int esh_new_string(esh_state *esh, const char *str, size_t len) {
+	if(stack_push(esh, ESH_NULL)) return 1;
+	
+	esh_val val = new_string_val(esh, str, len);
+	if(val == ESH_NULL) {
+		esh->current_thread->stack_len--;
+		return 1;
+	}
+	
+	esh->current_thread->stack[esh->current_thread->stack_len - 1] = val;
+	return 0;
+}
+
+int esh_push_null(esh_state *esh) {
+	if(stack_push(esh, NULL)) return 1;
+	return 0;
+}
+
+int esh_object_of(esh_state *esh, size_t n) {
+	if(stack_size(esh) < n * 2) {
+		esh_err_printf(esh, "Not enough items on stack for object creation (%zu/%zu)", (size_t) stack_size(esh), (size_t) n * 2);
+		return 1;
+	}
+	
+	esh_table *obj = esh_new_object(esh, sizeof(esh_table), NULL);
 	if(!obj) return 1;
 	
 	for(size_t i = 0; i < n; i++) {
 		size_t index = esh->current_thread->stack_len - (n - i) * 2 - 1;
-		size_t keylen;
-		const char *key = val_as_string(&esh->current_thread->stack[index], &keylen);
-		if(!key) {
+		esh_val key = esh->current_thread->stack[index];
+		if(!val_as_string(&key, NULL)) {
 			esh_err_printf(esh, "Key value is not string");
 			return 1;
 		}
 		
 		esh_val val = esh->current_thread->stack[index + 1];
 		
-		gc_obj_write_barrier(esh, obj);
-		if(esh_object_set(esh, obj, key, keylen, val)) {
+		gc_obj_write_barrier(esh, &obj->obj);
+		if(object_set_val(esh, obj, key, val)) {
 			esh_err_printf(esh, "Unable to add entry to object literal (out of memory?)");
 			return 1;
 		}
@@ -847,7 +1667,7 @@ size_t esh_object_len(esh_state *esh, long long offset) {
 	size_t index;
 	if(stack_offset(esh, offset, &index)) return 0;
 	
-	esh_object *obj = val_as_object(esh->current_thread->stack[index], NULL);
+	esh_table *obj = val_as_table(esh->current_thread->stack[index]);
 	if(!obj) return 0;
 	
 	return obj->len;
@@ -876,17 +1696,24 @@ int esh_swap(esh_state *esh, long long a, long long b) {
 static void free_object(esh_state *esh, esh_object *obj) {
 	if(obj->type && obj->type->on_free) obj->type->on_free(esh, obj);
 	
+	if(obj->type == &string_type && ((esh_string *) obj)->interned) intern_remove(esh, (esh_string *) obj);
+	
 	if(obj->type == &function_type) {
 		esh_function *fn = (esh_function *) obj;
 		esh_free(esh, fn->imms);
 		esh_free(esh, fn->jmps);
 		esh_free(esh, fn->instr);
 		esh_free(esh, fn->line_dirs);
+		esh_free(esh, fn->code);
+		esh_free(esh, fn->global_caches);
+		esh_free(esh, fn->index_caches);
+		esh_free(esh, fn->captured);
 		esh_free(esh, fn->name);
 	}
 	
-	esh_object_free_entries(esh, obj);
-	esh_free(esh, obj);
+	if(!obj->type) esh_object_free_entries(esh, (esh_table *) obj);
+	if(obj->pool_class != 0) pool_free_class(esh, obj, obj->pool_class);
+	else esh_free(esh, (large_prefix *) obj - 1);
 }
 
 #define INSTR_SIZE 4
@@ -919,7 +1746,7 @@ int esh_fn_append_instr(esh_state *esh, esh_opcode op, uint64_t arg, uint64_t l)
 	}
 	
 	if(fn->instr_len == fn->instr_cap) {
-		size_t new_cap = fn->instr_cap * 3 / 2 + 1;
+		size_t new_cap = fn->instr_cap * 2 + 16; // Instructions are appended one at a time while compiling, so grow quickly
 		uint8_t *new_buff = esh_realloc(esh, fn->instr, sizeof(uint8_t) * INSTR_SIZE * new_cap);
 		if(!new_buff) {
 			esh_err_printf(esh, "Unable to grow instruction buffer (out of memory?)");
@@ -936,7 +1763,402 @@ int esh_fn_append_instr(esh_state *esh, esh_opcode op, uint64_t arg, uint64_t l)
 	return 0;
 }
 
-int esh_fn_finalize(esh_state *esh, size_t n_args, size_t opt_args, size_t n_locals, bool upval_locals, bool make_closure) {
+typedef struct instr_regs {
+	esh_opcode op;
+	uint16_t arg;
+	uint8_t l;
+} instr_regs;
+
+#define X(op) + 1
+enum { N_OPCODES = 0 ESH_OPCODES };
+#undef X
+
+#if (defined(__GNUC__) || defined(__clang__)) && !defined(ESH_NO_THREADED_DISPATCH)
+#define ESH_THREADED_DISPATCH
+#endif
+
+#ifdef ESH_THREADED_DISPATCH
+static const void *const *vm_dispatch_table = NULL;
+#endif
+
+static int run_vm(esh_state *esh, esh_closure *entrypoint);
+
+static void decode_instr(uint8_t *p, instr_regs *out);
+
+// Whether the argument of the instruction is a jump label
+static bool is_jump_op(esh_opcode op) {
+	switch(op) {
+		case ESH_INSTR_JMP:
+		case ESH_INSTR_JMP_IF:
+		case ESH_INSTR_JMP_IFN:
+		case ESH_INSTR_JMP_IF_OR_POP:
+		case ESH_INSTR_JMP_IFN_OR_POP:
+		case ESH_INSTR_CMP_JMP:
+			return true;
+		default:
+			return false;
+	}
+}
+
+// CMP_JMP jumps if the comparison is true when this bit is set in l, otherwise if it is false
+#define CMP_JMP_IF 0x80
+// CMD keeps its flags in the lower two bits of l, and the number of values to unpack the result into in the rest
+#define CMD_UNPACK_SHIFT 2
+#define RET_TAIL_CALL 1 // Set in the l-argument of a RET that returns the result of the call right before it
+
+// Matches an IMM instruction loading a small integer, returning it through out_k
+static bool imm_small_int(esh_function *fn, instr_regs instr, long long *out_k) {
+	if(instr.op != ESH_INSTR_IMM || instr.arg >= fn->imms_len) return false;
+	esh_val val = fn->imms[instr.arg];
+	if(!esh_val_is_int(val)) return false;
+	
+	*out_k = esh_val_to_int(val);
+	return *out_k >= INT8_MIN && *out_k <= INT8_MAX;
+}
+
+// Fuses the instruction sequence starting at i into a superinstruction, returning the number of instructions replaced (or 0 if none matched)
+// Only the first instruction of a fused sequence may be a jump target
+static size_t fuse_instrs(esh_function *fn, instr_regs *code, size_t len, const bool *is_target, size_t i) {
+	size_t avail = 1;
+	while(avail < 4 && i + avail < len && !is_target[i + avail]) avail++;
+	
+	instr_regs a = code[i];
+	instr_regs b = avail > 1? code[i + 1] : (instr_regs) { ESH_INSTR_NULL, 0, 0 };
+	instr_regs c = avail > 2? code[i + 2] : (instr_regs) { ESH_INSTR_NULL, 0, 0 };
+	instr_regs d = avail > 3? code[i + 3] : (instr_regs) { ESH_INSTR_NULL, 0, 0 };
+	
+	long long k;
+	
+	// $x + k; x = ...
+	if(
+		a.op == ESH_INSTR_LOAD && a.l == 0 && imm_small_int(fn, b, &k) && (c.op == ESH_INSTR_ADD || c.op == ESH_INSTR_SUB) &&
+		d.op == ESH_INSTR_STORE && d.l == 0 && d.arg == a.arg
+	) {
+		if(c.op == ESH_INSTR_SUB) k = -k;
+		if(k >= INT8_MIN && k <= INT8_MAX) {
+			code[i] = (instr_regs) { ESH_INSTR_INC_LOCAL, a.arg, (uint8_t) (int8_t) k };
+			return 4;
+		}
+	}
+	
+	// $x:key
+	if(a.op == ESH_INSTR_LOAD && a.l == 0 && b.op == ESH_INSTR_IMM && b.arg <= UINT8_MAX && c.op == ESH_INSTR_INDEX) {
+		code[i] = (instr_regs) { ESH_INSTR_LOAD_INDEX_IMM, a.arg, b.arg };
+		return 3;
+	}
+	
+	// Short-circuiting 'and'/'or'
+	if(a.op == ESH_INSTR_DUP && (b.op == ESH_INSTR_JMP_IFN || b.op == ESH_INSTR_JMP_IF) && c.op == ESH_INSTR_POP) {
+		code[i] = (instr_regs) { b.op == ESH_INSTR_JMP_IFN? ESH_INSTR_JMP_IFN_OR_POP : ESH_INSTR_JMP_IF_OR_POP, b.arg, 0 };
+		return 3;
+	}
+	
+	switch(a.op) {
+		case ESH_INSTR_CALL:
+			if(b.op == ESH_INSTR_UNPACK && b.arg <= UINT8_MAX) {
+				code[i] = (instr_regs) { ESH_INSTR_CALL_UNPACK, a.arg, b.arg };
+				return 2;
+			} else if(b.op == ESH_INSTR_POP) { // The result is discarded, so the callee's values needn't be kept at all
+				code[i] = (instr_regs) { ESH_INSTR_CALL_UNPACK, a.arg, 0 };
+				return 2;
+			}
+			break;
+		
+		case ESH_INSTR_CMD:
+			if(b.op == ESH_INSTR_UNPACK && b.arg != 0 && b.arg <= (UINT8_MAX >> CMD_UNPACK_SHIFT) && (a.l >> CMD_UNPACK_SHIFT) == 0) {
+				code[i] = (instr_regs) { ESH_INSTR_CMD, a.arg, a.l | (b.arg << CMD_UNPACK_SHIFT) };
+				return 2;
+			}
+			break;
+		
+		case ESH_INSTR_EQ:
+		case ESH_INSTR_NEQ:
+		case ESH_INSTR_LESS:
+		case ESH_INSTR_GREATER:
+			if(b.op == ESH_INSTR_JMP_IFN || b.op == ESH_INSTR_JMP_IF) {
+				code[i] = (instr_regs) { ESH_INSTR_CMP_JMP, b.arg, a.op | (b.op == ESH_INSTR_JMP_IF? CMP_JMP_IF : 0) };
+				return 2;
+			}
+			break;
+		
+		case ESH_INSTR_NOT:
+			if(b.op == ESH_INSTR_JMP_IFN || b.op == ESH_INSTR_JMP_IF) {
+				code[i] = (instr_regs) { b.op == ESH_INSTR_JMP_IFN? ESH_INSTR_JMP_IF : ESH_INSTR_JMP_IFN, b.arg, 0 };
+				return 2;
+			}
+			break;
+		
+		case ESH_INSTR_IMM:
+			if(b.op == ESH_INSTR_SWAP) {
+				code[i] = (instr_regs) { ESH_INSTR_IMM_SWAP, a.arg, 0 };
+				return 2;
+			} else if(b.op == ESH_INSTR_INDEX) {
+				code[i] = (instr_regs) { ESH_INSTR_INDEX_IMM, a.arg, 0 };
+				return 2;
+			}
+			break;
+		
+		default:
+			break;
+	}
+	
+	return 0;
+}
+
+// Finds or adds a label pointing to the instruction, returns false if not possible
+static bool label_at(esh_state *esh, esh_function *fn, size_t dest, uint16_t *out_label) {
+	for(size_t i = 0; i < fn->jmps_len; i++) {
+		if(fn->jmps[i] == dest) {
+			*out_label = i;
+			return true;
+		}
+	}
+	if(fn->jmps_len > UINT16_MAX) return false;
+	
+	if(fn->jmps_len == fn->jmps_cap) {
+		size_t new_cap = fn->jmps_cap * 2 + 8;
+		size_t *new_buff = esh_realloc(esh, fn->jmps, sizeof(size_t) * new_cap);
+		if(!new_buff) return false;
+		
+		fn->jmps_cap = new_cap;
+		fn->jmps = new_buff;
+	}
+	
+	*out_label = fn->jmps_len;
+	fn->jmps[fn->jmps_len++] = dest;
+	return true;
+}
+
+// Redirects a jump whose destination is itself a jump with a known outcome
+static void thread_jump(esh_state *esh, esh_function *fn, instr_regs *code, const bool *removed, size_t len, instr_regs *instr) {
+	for(size_t n = 0; n < 16; n++) { // Bounded, in case of jump cycles
+		size_t dest = fn->jmps[instr->arg];
+		if(dest >= len) return;
+		instr_regs target = code[dest];
+		
+		if(target.op == ESH_INSTR_JMP) {
+			instr->arg = target.arg;
+			continue;
+		}
+		
+		// Otherwise, only the 'and'/'or' jumps know the truthiness of the value at the destination
+		bool truthy;
+		if(instr->op == ESH_INSTR_JMP_IF_OR_POP) truthy = true;
+		else if(instr->op == ESH_INSTR_JMP_IFN_OR_POP) truthy = false;
+		else return;
+		
+		bool target_if;
+		if(target.op == ESH_INSTR_JMP_IF || target.op == ESH_INSTR_JMP_IF_OR_POP) target_if = true;
+		else if(target.op == ESH_INSTR_JMP_IFN || target.op == ESH_INSTR_JMP_IFN_OR_POP) target_if = false;
+		else return;
+		
+		if(target_if == truthy) { // The target jumps as well
+			if(target.op == ESH_INSTR_JMP_IF || target.op == ESH_INSTR_JMP_IFN) instr->op = target.op; // Which pops the value
+			instr->arg = target.arg;
+		} else { // The target pops the value and continues with the following instruction
+			size_t next = dest + 1;
+			while(next < len && removed[next]) next++;
+			
+			uint16_t label;
+			if(!label_at(esh, fn, next, &label)) return;
+			instr->op = truthy? ESH_INSTR_JMP_IF : ESH_INSTR_JMP_IFN;
+			instr->arg = label;
+		}
+	}
+}
+
+// Rewrites the instructions in place, remapping the labels and line directives
+// The buffers are sized for the code before the first pass, as passes only ever shrink it
+static int optimize_pass(esh_state *esh, esh_function *fn, instr_regs *code, bool *is_target, bool *removed, size_t *new_index) {
+	size_t len = fn->instr_len;
+	if(len == 0) return 0;
+	
+	for(size_t i = 0; i < fn->jmps_len; i++) {
+		if(fn->jmps[i] > len) {
+			esh_err_printf(esh, "Jump label out of range");
+			return 1;
+		}
+	}
+	
+	for(size_t i = 0; i < len; i++) {
+		decode_instr(fn->instr + i * INSTR_SIZE, &code[i]);
+		if(is_jump_op(code[i].op) && code[i].arg >= fn->jmps_len) {
+			esh_err_printf(esh, "Jump label index out of range");
+			return 1;
+		}
+		removed[i] = false;
+	}
+	
+	for(size_t i = 0; i <= len; i++) is_target[i] = false;
+	for(size_t i = 0; i < len; i++) {
+		if(is_jump_op(code[i].op)) is_target[fn->jmps[code[i].arg]] = true;
+	}
+	
+	for(size_t i = 0; i < len;) {
+		size_t n = fuse_instrs(fn, code, len, is_target, i);
+		if(n == 0) n = 1;
+		for(size_t j = 1; j < n; j++) removed[i + j] = true;
+		i += n;
+	}
+	
+	for(size_t i = 0; i < len; i++) {
+		if(removed[i] || !is_jump_op(code[i].op)) continue;
+		thread_jump(esh, fn, code, removed, len, &code[i]);
+		
+		// Drop unconditional jumps to the following instruction
+		if(code[i].op == ESH_INSTR_JMP) {
+			size_t next = i + 1;
+			while(next < len && removed[next]) next++;
+			if(fn->jmps[code[i].arg] == next) removed[i] = true;
+		}
+	}
+	
+	size_t n = 0;
+	for(size_t i = 0; i < len; i++) {
+		new_index[i] = n;
+		if(removed[i]) continue;
+		encode_instr(esh, fn->instr + n * INSTR_SIZE, code[i].op, code[i].arg, code[i].l);
+		n++;
+	}
+	new_index[len] = n;
+	
+	for(size_t i = 0; i < fn->jmps_len; i++) fn->jmps[i] = new_index[fn->jmps[i]];
+	for(size_t i = 0; i < fn->line_dirs_len; i++) {
+		if(fn->line_dirs[i].instr_index <= len) fn->line_dirs[i].instr_index = new_index[fn->line_dirs[i].instr_index];
+	}
+	fn->instr_len = n;
+	
+	return 0;
+}
+
+// Peephole optimizer; fuses common instruction sequences into superinstructions and threads jumps
+// Threading can expose new sequences to fuse (e.g 'if a < b and c'), so passes are repeated while the code shrinks
+static int optimize_fn(esh_state *esh, esh_function *fn) {
+	size_t len = fn->instr_len;
+	if(len == 0) return 0;
+	
+	instr_regs *code = esh_alloc(esh, sizeof(instr_regs) * len);
+	bool *is_target = esh_alloc(esh, sizeof(bool) * (len + 1));
+	bool *removed = esh_alloc(esh, sizeof(bool) * len);
+	size_t *new_index = esh_alloc(esh, sizeof(size_t) * (len + 1));
+	int err = 0;
+	if(!code || !is_target || !removed || !new_index) {
+		esh_err_printf(esh, "Unable to allocate buffers for optimizer (out of memory?)");
+		err = 1;
+		goto END;
+	}
+	
+	do {
+		len = fn->instr_len;
+		if(optimize_pass(esh, fn, code, is_target, removed, new_index)) {
+			err = 1;
+			goto END;
+		}
+	} while(fn->instr_len < len);
+	
+	END:
+	esh_free(esh, code);
+	esh_free(esh, is_target);
+	esh_free(esh, removed);
+	esh_free(esh, new_index);
+	return err;
+}
+
+// Decodes the instructions of the function into the form executed by the VM; resolving jump labels, handler addresses and inline cache slots
+static int decode_fn(esh_state *esh, esh_function *fn) {
+	#ifdef ESH_THREADED_DISPATCH
+	if(!vm_dispatch_table) run_vm(esh, NULL); // Only fetches the handler addresses
+	#endif
+	
+	esh_free(esh, fn->code);
+	fn->code = NULL;
+	fn->code_len = 0;
+	esh_free(esh, fn->global_caches);
+	fn->global_caches = NULL;
+	fn->n_global_caches = 0;
+	esh_free(esh, fn->index_caches);
+	fn->index_caches = NULL;
+	fn->n_index_caches = 0;
+	
+	if(fn->instr_len == 0) return 0;
+	
+	esh_instr *code = esh_alloc(esh, sizeof(esh_instr) * fn->instr_len);
+	if(!code) {
+		esh_err_printf(esh, "Unable to allocate decoded instructions (out of memory?)");
+		return 1;
+	}
+	
+	size_t n_caches = 0, n_index_caches = 0;
+	for(size_t i = 0; i < fn->instr_len; i++) {
+		instr_regs instr;
+		decode_instr(fn->instr + i * INSTR_SIZE, &instr);
+		if((unsigned) instr.op >= N_OPCODES) {
+			esh_err_printf(esh, "Unknown instruction (%u)", (unsigned) instr.op);
+			esh_free(esh, code);
+			return 1;
+		}
+		
+		code[i] = (esh_instr) { .handler = NULL, .arg = instr.arg, .l = instr.l, .op = instr.op, .ext = 0 };
+		#ifdef ESH_THREADED_DISPATCH
+		code[i].handler = vm_dispatch_table[instr.op];
+		#endif
+		
+		if(is_jump_op(instr.op)) {
+			if(instr.arg >= fn->jmps_len) {
+				esh_err_printf(esh, "Jump label index out of range");
+				esh_free(esh, code);
+				return 1;
+			}
+			code[i].ext = fn->jmps[instr.arg];
+		}
+		
+		switch(instr.op) {
+			case ESH_INSTR_LOAD_G:
+			case ESH_INSTR_STORE_G:
+			case ESH_INSTR_CMD:
+				code[i].ext = n_caches++;
+				break;
+			
+			case ESH_INSTR_INDEX:
+			case ESH_INSTR_INDEX_IMM:
+			case ESH_INSTR_LOAD_INDEX_IMM:
+			case ESH_INSTR_SET_INDEX:
+				code[i].ext = n_index_caches++;
+				break;
+			
+			default:
+				break;
+		}
+	}
+	
+	if(n_caches != 0) {
+		fn->global_caches = esh_alloc(esh, sizeof(esh_global_cache) * n_caches);
+		if(!fn->global_caches) {
+			esh_err_printf(esh, "Unable to allocate inline caches for function (out of memory?)");
+			esh_free(esh, code);
+			return 1;
+		}
+		for(size_t i = 0; i < n_caches; i++) fn->global_caches[i] = (esh_global_cache) { 0, ESH_NULL, NULL };
+		fn->n_global_caches = n_caches;
+	}
+	
+	if(n_index_caches != 0) {
+		fn->index_caches = esh_alloc(esh, sizeof(esh_index_cache) * n_index_caches);
+		if(!fn->index_caches) {
+			esh_err_printf(esh, "Unable to allocate inline caches for function (out of memory?)");
+			esh_free(esh, code);
+			return 1;
+		}
+		for(size_t i = 0; i < n_index_caches; i++) fn->index_caches[i] = (esh_index_cache) { NULL, ESH_NULL, 0 };
+		fn->n_index_caches = n_index_caches;
+	}
+	
+	fn->code = code;
+	fn->code_len = fn->instr_len;
+	return 0;
+}
+
+int esh_fn_finalize(esh_state *esh, size_t n_args, size_t opt_args, size_t n_locals, bool upval_locals, const bool *captured, bool make_closure) {
 	esh_function *fn = esh_as_type(esh, -1, &function_type);
 	if(!fn) {
 		esh_err_printf(esh, "Attempting to set locals count of non-function object");
@@ -951,6 +2173,7 @@ int esh_fn_finalize(esh_state *esh, size_t n_args, size_t opt_args, size_t n_loc
 		cl->env = NULL;
 		cl->obj.is_const = true;
 		cl->is_coroutine = false;
+		cl->is_shared = true;
 		esh->current_thread->stack[esh->current_thread->stack_len - 2] = esh->current_thread->stack[esh->current_thread->stack_len - 1];
 		esh->current_thread->stack_len--;
 	}
@@ -960,7 +2183,28 @@ int esh_fn_finalize(esh_state *esh, size_t n_args, size_t opt_args, size_t n_loc
 	fn->n_locals = n_locals;
 	fn->upval_locals = upval_locals;
 	
-	return 0;
+	if(upval_locals && n_locals != 0) {
+		fn->captured = esh_alloc(esh, sizeof(bool) * n_locals);
+		if(!fn->captured) {
+			esh_err_printf(esh, "Unable to allocate captured locals map (out of memory?)");
+			return 1;
+		}
+		for(size_t i = 0; i < n_locals; i++) {
+			fn->captured[i] = captured != NULL && captured[i];
+			if(fn->captured[i]) fn->n_env_locals = i + 1;
+		}
+	}
+	
+	if(esh->peephole && optimize_fn(esh, fn)) return 1;
+	return decode_fn(esh, fn);
+}
+
+static bool is_identifier(const char *str, size_t len) {
+	for(size_t i = 0; i < len; i++) {
+		char c = str[i];
+		if(!((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') || c == '_' || c == '-')) return false;
+	}
+	return true;
 }
 
 int esh_fn_add_imm(esh_state *esh, uint64_t *out_ref) {
@@ -974,9 +2218,16 @@ int esh_fn_add_imm(esh_state *esh, uint64_t *out_ref) {
 	
 	assert(esh->current_thread->stack_len >= 2);
 	esh_val val = esh->current_thread->stack[esh->current_thread->stack_len - 1];
+	
+	// Names of globals, commands and members are interned, so that they can be used as keys without hashing
+	esh_string *str = val_as_object(val, &string_type);
+	if(str && !str->interned && is_identifier(str->str, str->len)) {
+		val = esh_intern_val(esh, val);
+		if(val == ESH_NULL) return 1;
+	}
 
 	if(fn->imms_len == fn->imms_cap) {
-		size_t new_cap = fn->imms_cap * 3 / 2 + 1;
+		size_t new_cap = fn->imms_cap * 2 + 8;
 		esh_val *new_buff = esh_realloc(esh, fn->imms, sizeof(esh_val) * new_cap);
 		if(!new_buff) {
 			esh_err_printf(esh, "Unable to grow immediate buffer (out of memory?)");
@@ -1002,7 +2253,7 @@ int esh_fn_new_label(esh_state *esh, uint64_t *out_ref) {
 	}
 	
 	if(fn->jmps_len == fn->jmps_cap) {
-		size_t new_cap = fn->jmps_cap * 3 / 2 + 1;
+		size_t new_cap = fn->jmps_cap * 2 + 8;
 		size_t *new_buff = esh_realloc(esh, fn->jmps, sizeof(size_t) * new_cap);
 		if(!new_buff) {
 			esh_err_printf(esh, "Unable to grow label buffer (out of memory?)");
@@ -1044,7 +2295,7 @@ int esh_fn_line_directive(esh_state *esh, size_t line) {
 	if(fn->line_dirs_len != 0 && fn->line_dirs[fn->line_dirs_len - 1].line == line) return 0;
 	
 	if(fn->line_dirs_len == fn->line_dirs_cap) {
-		size_t new_cap = fn->line_dirs_cap * 3 / 2 + 1;
+		size_t new_cap = fn->line_dirs_cap * 2 + 8;
 		esh_fn_line_dir *new_buff = esh_realloc(esh, fn->line_dirs, sizeof(esh_fn_line_dir) * new_cap);
 		if(!new_buff) {
 			esh_err_printf(esh, "Unable to grow function line directive buffer (out of memory?)");
@@ -1059,31 +2310,225 @@ int esh_fn_line_directive(esh_state *esh, size_t line) {
 	return 0;
 }
 
-/*
-int esh_fn_ref_instr(esh_state *esh, size_t *out_ref) {
-	esh_function *fn = as_object(esh, ESH_TAG_FUNCTION, 1);
-	if(!fn) {
-		esh_err_printf(esh, "Attempting to reference instruction of non-function object");
-		return 1;
-	}
-	
-	if(fn->instr_len == 0) {
-		esh_err_printf(esh, "Attempting to reference instruction in empty function");
-		return 1;
-	}
-	*out_ref = fn->instr_len - 1;
-	return 0;
-}
-
-int esh_fn_set_instr(esh_state *esh, size_t ref, esh_opcode op, uint64_t arg, uint64_t l) {
-	esh_function *fn = as_object(esh, ESH_TAG_FUNCTION, 1);
-	if(!fn) {
-		esh_err_printf(esh, "Attempting to set instruction in non-function object");
-		return 1;
-	}
+// Evaluates the operation on the operands on top of the stack, leaving the result in their place
+// Returns 1 on error, -1 if the operation can't be evaluated at compile time (e.g it would raise an error at runtime)
+static int fold_op(esh_state *esh, esh_opcode op, uint64_t arg, size_t n_operands) {
+	esh_val *operands = &esh->current_thread->stack[esh->current_thread->stack_len - n_operands];
 	
-	if(ref >= fn->instr_len) {
-		esh_err_printf(esh, "Instruction index out of bounds");
+	switch(op) {
+		case ESH_INSTR_ADD:
+		case ESH_INSTR_SUB:
+		case ESH_INSTR_MUL:
+		case ESH_INSTR_DIV:
+		case ESH_INSTR_LESS:
+		case ESH_INSTR_GREATER: {
+			if(!esh_val_is_int(operands[0]) || !esh_val_is_int(operands[1])) return -1; // Numeric strings, such as literals that don't fit in an int, are converted by the runtime
+			long long x = esh_val_to_int(operands[0]), y = esh_val_to_int(operands[1]);
+			
+			// Immediate ints are well within the range of long long, so only products can overflow
+			long long res = 0;
+			if(op == ESH_INSTR_ADD) res = x + y;
+			if(op == ESH_INSTR_SUB) res = x - y;
+			if(op == ESH_INSTR_MUL) {
+				long long limit = x == 0? LLONG_MAX : LLONG_MAX / (x < 0? -x : x);
+				if(y > limit || y < -limit) return -1;
+				res = x * y;
+			}
+			if(op == ESH_INSTR_DIV) {
+				if(y == 0) return -1; // Left to the runtime
+				res = x / y;
+			}
+			if(op == ESH_INSTR_LESS) res = x < y;
+			if(op == ESH_INSTR_GREATER) res = x > y;
+			
+			esh->current_thread->stack_len -= 2;
+			if(op == ESH_INSTR_LESS || op == ESH_INSTR_GREATER) return esh_push_bool(esh, res);
+			return esh_push_int(esh, res);
+		}
+		
+		case ESH_INSTR_EQ:
+		case ESH_INSTR_NEQ: {
+			bool equal = vals_equal(&operands[1], &operands[0]);
+			esh->current_thread->stack_len -= 2;
+			return esh_push_bool(esh, op == ESH_INSTR_EQ? equal : !equal);
+		}
+		
+		case ESH_INSTR_NOT: {
+			bool b = val_as_bool(&operands[0]);
+			esh->current_thread->stack_len--;
+			return esh_push_bool(esh, !b);
+		}
+		
+		case ESH_INSTR_CONCAT: {
+			esh_str_buff_begin(esh);
+			for(size_t i = 0; i < arg; i++) {
+				size_t len;
+				const char *str = val_as_string(&operands[i], &len);
+				if(!str) return -1;
+				if(esh_str_buff_appends(esh, str, len)) return 1;
+			}
+			esh->current_thread->stack_len -= arg;
+			
+			size_t len;
+			char *str = esh_str_buff(esh, &len);
+			return esh_new_string(esh, str, len);
+		}
+		
+		case ESH_INSTR_NEW_OBJ: { // Only folded for constant objects, as the object is shared by all executions
+			for(size_t i = 0; i < arg; i++) {
+				if(!val_as_string(&operands[i * 2], NULL)) return -1;
+			}
+			if(esh_object_of(esh, arg)) return 1;
+			
+			esh_table *obj = val_as_table(esh->current_thread->stack[esh->current_thread->stack_len - 1]);
+			assert(obj != NULL);
+			obj->obj.is_const = true;
+			return 0;
+		}
+		
+		default:
+			return -1;
+	}
+}
+
+int esh_fn_try_fold(esh_state *esh, esh_opcode op, uint64_t arg, bool *out_folded) {
+	*out_folded = false;
+	
+	esh_function *fn = esh_as_type(esh, -1, &function_type);
+	if(!fn) {
+		esh_err_printf(esh, "Attempting to fold instruction of non-function object");
+		return 1;
+	}
+	
+	size_t n_operands;
+	switch(op) {
+		case ESH_INSTR_ADD:
+		case ESH_INSTR_SUB:
+		case ESH_INSTR_MUL:
+		case ESH_INSTR_DIV:
+		case ESH_INSTR_LESS:
+		case ESH_INSTR_GREATER:
+		case ESH_INSTR_EQ:
+		case ESH_INSTR_NEQ:
+			n_operands = 2;
+			break;
+		case ESH_INSTR_NOT:
+			n_operands = 1;
+			break;
+		case ESH_INSTR_CONCAT:
+			n_operands = arg;
+			break;
+		case ESH_INSTR_NEW_OBJ:
+			n_operands = arg * 2;
+			break;
+		default:
+			return 0;
+	}
+	
+	// Find the instructions pushing the operands; only immediates (possibly swapped) are constant
+	size_t start = fn->instr_len;
+	for(size_t found = 0; found < n_operands; start--) {
+		if(start == 0) return 0;
+		
+		instr_regs instr;
+		decode_instr(fn->instr + (start - 1) * INSTR_SIZE, &instr);
+		if(instr.op == ESH_INSTR_IMM || instr.op == ESH_INSTR_PUSH_NULL) found++;
+		else if(instr.op != ESH_INSTR_SWAP) return 0;
+	}
+	
+	// A jump into the sequence would skip some of the operands
+	for(size_t i = 0; i < fn->jmps_len; i++) {
+		if(fn->jmps[i] > start && fn->jmps[i] <= fn->instr_len) return 0;
+	}
+	
+	if(esh_req_stack(esh, n_operands + 1)) return 1;
+	size_t stack_len = esh->current_thread->stack_len;
+	
+	for(size_t i = start; i < fn->instr_len; i++) {
+		instr_regs instr;
+		decode_instr(fn->instr + i * INSTR_SIZE, &instr);
+		
+		if(instr.op == ESH_INSTR_IMM) {
+			if(instr.arg >= fn->imms_len) goto NOT_FOLDED;
+			esh->current_thread->stack[esh->current_thread->stack_len++] = fn->imms[instr.arg];
+		} else if(instr.op == ESH_INSTR_PUSH_NULL) {
+			esh->current_thread->stack[esh->current_thread->stack_len++] = ESH_NULL;
+		} else {
+			if(esh->current_thread->stack_len - stack_len < 2) goto NOT_FOLDED;
+			esh_val *top = &esh->current_thread->stack[esh->current_thread->stack_len - 1];
+			esh_val tmp = top[0];
+			top[0] = top[-1];
+			top[-1] = tmp;
+		}
+	}
+	
+	int res = fold_op(esh, op, arg, n_operands);
+	if(res == 1) return 1;
+	if(res == -1) goto NOT_FOLDED;
+	
+	// Replace the operands with the result
+	fn->instr_len = start;
+	while(fn->line_dirs_len != 0 && fn->line_dirs[fn->line_dirs_len - 1].instr_index > start) fn->line_dirs_len--;
+	
+	if(esh->current_thread->stack[esh->current_thread->stack_len - 1] == ESH_NULL) {
+		esh->current_thread->stack_len--;
+		if(esh_fn_append_instr(esh, ESH_INSTR_PUSH_NULL, 0, 0)) return 1;
+	} else {
+		uint64_t ref;
+		if(esh_fn_add_imm(esh, &ref)) return 1;
+		if(esh_fn_append_instr(esh, ESH_INSTR_IMM, ref, 0)) return 1;
+	}
+	
+	*out_folded = true;
+	return 0;
+	
+	NOT_FOLDED:
+	esh->current_thread->stack_len = stack_len;
+	return 0;
+}
+
+int esh_fn_append_ret(esh_state *esh, uint64_t n) {
+	esh_function *fn = esh_as_type(esh, -1, &function_type);
+	if(!fn) {
+		esh_err_printf(esh, "Attempting to append instruction to non-function object");
+		return 1;
+	}
+	
+	bool tail_call = false;
+	if(n == 1 && fn->instr_len != 0) {
+		instr_regs instr;
+		decode_instr(fn->instr + (fn->instr_len - 1) * INSTR_SIZE, &instr);
+		tail_call = instr.op == ESH_INSTR_CALL || instr.op == ESH_INSTR_CMD;
+	}
+	
+	return esh_fn_append_instr(esh, ESH_INSTR_RET, n, tail_call? RET_TAIL_CALL : 0);
+}
+
+/*
+int esh_fn_ref_instr(esh_state *esh, size_t *out_ref) {
+	esh_function *fn = as_object(esh, ESH_TAG_FUNCTION, 1);
+	if(!fn) {
+		esh_err_printf(esh, "Attempting to reference instruction of non-function object");
+		return 1;
+	}
+	
+	if(fn->instr_len == 0) {
+		esh_err_printf(esh, "Attempting to reference instruction in empty function");
+		return 1;
+	}
+	*out_ref = fn->instr_len - 1;
+	return 0;
+}
+
+int esh_fn_set_instr(esh_state *esh, size_t ref, esh_opcode op, uint64_t arg, uint64_t l) {
+	esh_function *fn = as_object(esh, ESH_TAG_FUNCTION, 1);
+	if(!fn) {
+		esh_err_printf(esh, "Attempting to set instruction in non-function object");
+		return 1;
+	}
+	
+	if(ref >= fn->instr_len) {
+		esh_err_printf(esh, "Instruction index out of bounds");
 		return 1;
 	}
 	
@@ -1102,12 +2547,6 @@ const char *instr_name(esh_opcode op) {
 	return "";
 }
 
-typedef struct instr_regs {
-	esh_opcode op;
-	uint16_t arg;
-	uint8_t l;
-} instr_regs;
-
 static void decode_instr(uint8_t *p, instr_regs *out) {
 	out->op = p[0];
 	out->arg = p[1] | (p[2] << 8);
@@ -1120,6 +2559,11 @@ static void print_val(esh_val val, FILE *f) {
 		return;
 	}
 	
+	if(esh_val_is_int(val)) {
+		fprintf(f, "%lld", (long long) esh_val_to_int(val));
+		return;
+	}
+	
 	const char *str = val_as_string(&val, NULL);
 	if(str) {
 		fprintf(f, "\"%s\"", str);
@@ -1136,9 +2580,15 @@ static void print_val(esh_val val, FILE *f) {
 		return;
 	}
 	
+	esh_table *table = val_as_table(val);
+	if(table) {
+		fprintf(f, "Object [object] (%llu, %llu)", (unsigned long long) table->len, (unsigned long long) table->cap);
+		return;
+	}
+	
 	esh_object *obj = val_as_object(val, NULL);
 	if(obj) {
-		fprintf(f, "Object [%s] (%llu, %llu)", obj->type? obj->type->name : "object", (unsigned long long) obj->len, (unsigned long long) obj->cap);
+		fprintf(f, "Object [%s]", obj->type->name);
 		return;
 	}
 	
@@ -1173,10 +2623,16 @@ int esh_fndump(esh_state *esh, FILE *f) {
 		decode_instr(fn->instr + index, &instr);
 		
 		fprintf(f, "%s (%u:%u)", instr_name(instr.op), instr.arg, instr.l);
-		if((instr.op == ESH_INSTR_IMM || instr.op == ESH_INSTR_LOAD_G || instr.op == ESH_INSTR_STORE_G) && instr.arg < fn->imms_len) {
+		bool imm_arg = instr.op == ESH_INSTR_IMM || instr.op == ESH_INSTR_LOAD_G || instr.op == ESH_INSTR_STORE_G || instr.op == ESH_INSTR_IMM_SWAP || instr.op == ESH_INSTR_INDEX_IMM;
+		if(imm_arg && instr.arg < fn->imms_len) {
 			fputs(" # ", f);
 			print_val(fn->imms[instr.arg], f);
-		} else if(instr.op == ESH_INSTR_JMP || instr.op == ESH_INSTR_JMP_IFN || instr.op == ESH_INSTR_JMP_IF) {
+		} else if(instr.op == ESH_INSTR_LOAD_INDEX_IMM && instr.l < fn->imms_len) {
+			fputs(" # ", f);
+			print_val(fn->imms[instr.l], f);
+		} else if(instr.op == ESH_INSTR_INC_LOCAL) {
+			fprintf(f, " # %d", (int) (int8_t) instr.l);
+		} else if(is_jump_op(instr.op)) {
 			fprintf(f, " # %llu", (unsigned long long) instr.arg);
 		}
 		
@@ -1223,157 +2679,1091 @@ int esh_make_coroutine(esh_state *esh, long long fn) {
 		return 1;
 	}
 	
-	f->is_coroutine = true;
+	f->is_coroutine = true; // Shared closures too; later evaluations of their function expression get a new closure from then on, see CLOSURE
 	return 0;
 }
 
-static void obj_list_pop(esh_object **root, esh_object *obj) {	
-	if(obj->prev == NULL) {
-		assert(*root == obj);
-		*root = obj->next;
-		if(obj->next) obj->next->prev = NULL;
-	} else {
-		obj->prev->next = obj->next;
-		if(obj->next) obj->next->prev = obj->prev;
+// GARBAGE COLLECTION
+// Objects start out in the young generation. Minor collections trace the young objects reachable from the roots and from the remembered set, free the others, and promote the survivors to the old generation. Objects never move, since the C API holds raw pointers to them
+// The old generation is collected by incremental major cycles. Marking sets bits in the mark bitmaps of the slabs (or a tag bit of large objects) and traces objects through a gray stack, and ends with a minor collection, so that the objects young objects keep alive are marked too. The slabs are then swept a few at a time, only touching the objects that died
+
+#define GC_OLD 1 // Survived a minor collection
+#define GC_REMEMBERED 2 // In the remembered set
+
+// Pacing, see gc_paced_collect
+#define GC_STEP_BYTES 128 // Allocated bytes that make up one step of the major cycle, at a step multiplier of 100%
+#define GC_PAUSE_TARGET (CLOCKS_PER_SEC / 1000)
+#define GC_MIN_NURSERY (64 * 1024)
+#define GC_MAX_NURSERY (8 * 1024 * 1024)
+#define GC_HIGH_SURVIVAL 20 // Percentage of the nursery surviving a minor collection above which it is grown
+#define GC_MIN_STEP_MUL 100
+#define GC_MAX_STEP_MUL 1600
+#define GC_MIN_PAUSE 150
+#define GC_MAX_PAUSE 400
+
+#define GC_TAG_MARKED 1 // Young object found by the current minor collection, or large old object marked by the current major cycle
+#define GC_TAG_GRAY 2 // On the gray stack
+#define GC_TAG_TRACING 4 // Being traced by one of the threads, see gc_trace_claimed
+#define GC_TAG_TRACED 8 // Large old object traced by the current cycle, see gc_trace_claimed
+
+// Monotonic time in nanoseconds. clock() would count the time of the worker thread as well
+static uint64_t gc_now() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void gc_add_pause(esh_state *esh, uint64_t start) {
+	uint64_t pause = gc_now() - start;
+	esh->gc_pause_total += pause;
+	if(pause > esh->gc_pause_max) esh->gc_pause_max = pause;
+	if(pause > esh->gc_trace_max_pause) esh->gc_trace_max_pause = pause;
+}
+
+// Frees a dead object of the old generation
+static void gc_free_old(esh_state *esh, esh_object *obj) {
+	size_t size = object_size(obj);
+	esh->old_bytes -= size;
+	esh->gc_freed_bytes += size;
+	esh->gc_freed_objects++;
+	free_object(esh, obj);
+}
+
+// Returns true if the object was pushed. The stacks grow through the realloc callback, since running the GC in the middle of a collection or a barrier isn't possible
+static bool gc_stack_push(esh_state *esh, esh_obj_stack *stack, esh_object *obj) {
+	if(stack->len == stack->cap) {
+		size_t new_cap = stack->cap * 2 + 16;
+		esh_object **new_objs = esh->realloc(stack->objs, sizeof(esh_object *) * new_cap);
+		if(!new_objs) {
+			stack->overflow = true;
+			return false;
+		}
+		
+		stack->objs = new_objs;
+		stack->cap = new_cap;
 	}
 	
-	obj->next = NULL;
-	obj->prev = NULL;
+	stack->objs[stack->len++] = obj;
+	return true;
+}
+
+// The worker reads gc_gen of the objects it traces, so the remembered flag is updated atomically while it is marking
+static void gc_set_remembered(esh_state *esh, esh_object *obj, bool remembered) {
+	if(esh->gc_worker_marking) {
+		if(remembered) __atomic_fetch_or(&obj->gc_gen, GC_REMEMBERED, __ATOMIC_RELAXED);
+		else __atomic_fetch_and(&obj->gc_gen, (unsigned char) ~GC_REMEMBERED, __ATOMIC_RELAXED);
+	} else if(remembered) obj->gc_gen |= GC_REMEMBERED;
+	else obj->gc_gen &= ~GC_REMEMBERED;
+}
+
+static void gc_remember(esh_state *esh, esh_object *obj) {
+	if(obj->gc_gen & GC_REMEMBERED) return;
+	if(gc_stack_push(esh, &esh->remembered, obj)) gc_set_remembered(esh, obj, true); // Otherwise the next minor collection promotes all young objects
 }
 
-static void obj_list_add(esh_object **root, esh_object *obj) {
-	assert(obj->next == NULL);
-	assert(obj->prev == NULL);
+static bool gc_is_marked(esh_object *obj) {
+	if(obj->pool_class == 0) return obj->gc_tag & GC_TAG_MARKED;
 	
-	if(*root) {
-		assert((*root)->prev == NULL);
-		(*root)->prev = obj;
+	esh_slab *slab = pool_slab_of(obj);
+	size_t bit = pool_slab_bit(slab, obj);
+	return slab->mark[BIT_WORD(bit)] & BIT_MASK(bit);
+}
+
+// Returns false if the object was already marked
+static bool gc_set_marked(esh_state *esh, esh_object *obj) {
+	if(obj->pool_class == 0) {
+		#ifndef NO_THREADS
+		if(esh->gc_worker_marking) return !(__atomic_fetch_or(&obj->gc_tag, GC_TAG_MARKED, __ATOMIC_ACQ_REL) & GC_TAG_MARKED);
+		#endif
+		
+		if(obj->gc_tag & GC_TAG_MARKED) return false;
+		obj->gc_tag |= GC_TAG_MARKED;
+		return true;
+	}
+	
+	esh_slab *slab = pool_slab_of(obj);
+	size_t bit = pool_slab_bit(slab, obj);
+	return bitmap_set(esh, &slab->mark[BIT_WORD(bit)], BIT_MASK(bit));
+}
+
+// An object that can't be pushed stays marked without being traced, and is found again by gc_rescan_marked
+static void gc_push_gray(esh_state *esh, esh_object *obj) {
+	#ifndef NO_THREADS
+	if(esh->gc_worker_marking) { // The worker owns the gray stack, see gc_worker_hand_over
+		gc_stack_push(esh, &esh->gc_worker->shaded, obj);
+		return;
+	}
+	if(esh->gc_satb) { // The flag is only needed by the barrier of incremental cycles
+		gc_stack_push(esh, &esh->gray, obj);
+		return;
 	}
+	#endif
 	
-	obj->next = *root;
-	*root = obj;
+	if(gc_stack_push(esh, &esh->gray, obj)) obj->gc_tag |= GC_TAG_GRAY;
 }
 
 static void gc_mark_to_visit(esh_state *esh, esh_val val) {
 	esh_object *obj = val_as_object(val, NULL);
 	if(!obj) return; // Non heap allocated objects/values are ignored
 	
-	if(obj->gc_tag == 2 || obj->gc_tag == 1) return; // Visited
-	
-	obj_list_pop(&esh->objects, obj);
-	obj_list_add(&esh->to_visit, obj);
-	
-	obj->gc_tag = 1;
+	if(!(obj->gc_gen & GC_OLD)) return; // Young objects are marked by the minor collection at the end of the cycle
+	if(gc_set_marked(esh, obj)) gc_push_gray(esh, obj);
 }
 
-static void gc_mark_stack_frame(esh_state *esh, esh_stack_frame *frame) {
-	gc_mark_to_visit(esh, frame->fn);
-	gc_mark_to_visit(esh, frame->env);
+// Keeps a value alive that is about to be stored where the GC may not see it again, such as an inline cache of an already traced function
+static void gc_shade(esh_state *esh, esh_val val) {
+	esh_object *obj = val_as_object(val, NULL);
+	if(!obj) return;
+	
+	if(!(obj->gc_gen & GC_OLD)) gc_remember(esh, obj);
+	else if(esh->gc_phase == ESH_GC_MARKING) gc_mark_to_visit(esh, obj);
+	else if(esh->gc_phase == ESH_GC_SWEEPING && obj->pool_class != 0) {
+		pool_lock(esh);
+		if(pool_slab_of(obj)->swept_cycle != esh->gc_cycle) gc_set_marked(esh, obj); // Found through a weak reference, such as the interned strings, before the sweep reached it
+		pool_unlock(esh);
+	}
 }
 
-static void gc_trace_obj(esh_state *esh, esh_object *obj) {
-	assert(obj->gc_tag == 1); // Must be in the "to-visit" set
+static void gc_minor_mark(esh_state *esh, esh_val val) {
+	esh_object *obj = val_as_object(val, NULL);
+	if(!obj || (obj->gc_gen & GC_OLD) || (obj->gc_tag & GC_TAG_MARKED)) return;
+	
+	obj->gc_tag |= GC_TAG_MARKED;
+	gc_stack_push(esh, &esh->young_gray, obj); // On failure, all young objects are promoted
+}
 
-	for(size_t i = 0; i < obj->cap; i++) {
-		esh_object_entry *entry = &obj->entries[i];
-		if(entry->key == NULL || entry->deleted) continue;
-		
-		gc_mark_to_visit(esh, entry->val);
+static void gc_mark_stack_frame(esh_state *esh, esh_stack_frame *frame, void (*mark)(esh_state *, esh_val)) {
+	mark(esh, frame->fn);
+	mark(esh, frame->env);
+}
+
+static void gc_trace_obj(esh_state *esh, esh_object *obj, void (*mark)(esh_state *, esh_val)) {
+	if(!obj->type) {
+		esh_table *table = (esh_table *) obj;
+		for(size_t i = 0; i < table->cap; i++) {
+			esh_object_entry *entry = &table->entries[i];
+			if(entry->key == ESH_NULL) continue;
+			
+			mark(esh, entry->key);
+			mark(esh, entry->val);
+		}
+		for(size_t i = 0; i < table->array_len; i++) mark(esh, table->array[i]);
+		if(table->shape) {
+			mark(esh, table->shape);
+			for(size_t i = 0; i < table->shape->n_slots; i++) mark(esh, table->slots[i]);
+		}
+		return;
 	}
 	
 	if(obj->type == &function_type) {
 		esh_function *fn = (esh_function *) obj;
-		for(size_t i = 0; i < fn->imms_len; i++) gc_mark_to_visit(esh, fn->imms[i]);
+		for(size_t i = 0; i < fn->imms_len; i++) mark(esh, fn->imms[i]);
+		for(size_t i = 0; i < fn->n_global_caches; i++) mark(esh, fn->global_caches[i].key);
+		for(size_t i = 0; i < fn->n_index_caches; i++) {
+			mark(esh, fn->index_caches[i].shape);
+			mark(esh, fn->index_caches[i].key);
+		}
+	} else if(obj->type == &shape_type) {
+		esh_shape *shape = (esh_shape *) obj;
+		mark(esh, shape->parent);
+		if(shape->n_slots != 0) mark(esh, shape->keys[shape->n_slots - 1]); // The other keys are marked by the ancestors
 	} else if(obj->type == &closure_type) {
 		esh_closure *cl = (esh_closure *) obj;
-		gc_mark_to_visit(esh, cl->fn);
-		gc_mark_to_visit(esh, cl->env);
+		mark(esh, cl->fn);
+		mark(esh, cl->env);
 	} else if(obj->type == &env_type) {
 		esh_env *env = (esh_env *) obj;
-		for(size_t i = 0; i < env->n_locals; i++) gc_mark_to_visit(esh, env->locals[i]);
-		gc_mark_to_visit(esh, env->parent);
+		for(size_t i = 0; i < env->n_locals; i++) mark(esh, env->locals[i]);
+		mark(esh, env->parent);
 	} else if(obj->type == &co_thread_type) {
 		esh_co_thread *co = (esh_env *) obj;
-		for(size_t i = 0; i < co->stack_len; i++) gc_mark_to_visit(esh, co->stack[i]);
-		for(size_t i = 0; i < co->stack_frames_len; i++)  gc_mark_stack_frame(esh, &co->stack_frames[i]);
-		gc_mark_stack_frame(esh, &co->current_frame);
+		for(size_t i = 0; i < co->stack_len; i++) mark(esh, co->stack[i]);
+		for(size_t i = 0; i < co->stack_frames_len; i++)  gc_mark_stack_frame(esh, &co->stack_frames[i], mark);
+		gc_mark_stack_frame(esh, &co->current_frame, mark);
+	} else {
+		esh_val *refs = (esh_val *) (obj + 1);
+		for(size_t i = 0; i < obj->type->n_refs; i++) mark(esh, refs[i]);
 	}
 }
 
-void esh_gc(esh_state *esh, size_t n) {
-	bool do_full_sweep = n == 0;
+#ifndef NO_THREADS
+static bool gc_is_traced(esh_object *obj) {
+	if(obj->pool_class == 0) return __atomic_load_n(&obj->gc_tag, __ATOMIC_ACQUIRE) & GC_TAG_TRACED;
+	
+	esh_slab *slab = pool_slab_of(obj);
+	size_t bit = pool_slab_bit(slab, obj);
+	return __atomic_load_n(&slab->traced[BIT_WORD(bit)], __ATOMIC_ACQUIRE) & BIT_MASK(bit);
+}
+
+static void gc_set_traced(esh_object *obj) {
+	if(obj->pool_class == 0) {
+		__atomic_fetch_or(&obj->gc_tag, GC_TAG_TRACED, __ATOMIC_RELEASE);
+		return;
+	}
+	
+	esh_slab *slab = pool_slab_of(obj);
+	size_t bit = pool_slab_bit(slab, obj);
+	__atomic_fetch_or(&slab->traced[BIT_WORD(bit)], BIT_MASK(bit), __ATOMIC_RELEASE);
+}
+
+// Traces an object once per cycle, by whichever of the threads gets to it first. With wait set, only returns once the object was traced, even if by the other thread
+static void gc_trace_claimed(esh_state *esh, esh_object *obj, void (*mark)(esh_state *, esh_val), bool wait) {
+	while(!gc_is_traced(obj)) {
+		unsigned char tag = __atomic_load_n(&obj->gc_tag, __ATOMIC_ACQUIRE);
+		if(tag & GC_TAG_TRACING) {
+			if(!wait) return;
+			continue;
+		}
+		if(!__atomic_compare_exchange_n(&obj->gc_tag, &tag, tag | GC_TAG_TRACING, false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) continue;
+		
+		if(!gc_is_traced(obj)) { // The other thread may have finished in the meantime
+			gc_trace_obj(esh, obj, mark);
+			gc_set_traced(obj);
+		}
+		__atomic_fetch_and(&obj->gc_tag, (unsigned char) ~GC_TAG_TRACING, __ATOMIC_RELEASE);
+		return;
+	}
+}
+#endif
+
+static void gc_promote(esh_state *esh, esh_object *obj) {
+	obj->gc_tag = 0;
+	#ifndef NO_THREADS
+	__atomic_store_n(&obj->gc_gen, GC_OLD, __ATOMIC_RELEASE); // The worker may find the object from now on
+	#else
+	obj->gc_gen = GC_OLD;
+	#endif
+	esh->old_bytes += object_size(obj);
+	
+	// Old objects that were traced by the current major cycle may reference the promoted object, so it has to be traced as well
+	bool mark = esh->gc_phase == ESH_GC_MARKING;
 	
-	// Scan roots
+	if(obj->pool_class != 0) {
+		esh_slab *slab = pool_slab_of(obj);
+		size_t bit = pool_slab_bit(slab, obj);
+		pool_lock(esh);
+		bitmap_set(esh, &slab->old[BIT_WORD(bit)], BIT_MASK(bit));
+		
+		// A slab that is yet to be swept only keeps its marked objects
+		if(esh->gc_phase == ESH_GC_SWEEPING && slab->swept_cycle != esh->gc_cycle) slab->mark[BIT_WORD(bit)] |= BIT_MASK(bit);
+		pool_unlock(esh);
+	} else {
+		obj->next = esh->large;
+		esh->large = obj;
+	}
+	
+	if(mark) {
+		gc_set_marked(esh, obj);
+		
+		#ifndef NO_THREADS
+		if(esh->gc_satb) { // The object may be halfway through being written to, which the worker mustn't see
+			gc_trace_claimed(esh, obj, gc_mark_to_visit, true);
+			return;
+		}
+		#endif
+		gc_push_gray(esh, obj);
+	}
+}
+
+// Returns the number of bytes promoted
+static size_t gc_minor(esh_state *esh) {
+	// Without a complete remembered set, there's no telling which young objects are alive
+	bool promote_all = esh->remembered.overflow;
+	
+	if(!promote_all) {
+		// Threads are traced even when they are old, since their stacks are written to without barriers
+		gc_minor_mark(esh, esh->current_thread);
+		gc_trace_obj(esh, &esh->current_thread->obj, gc_minor_mark);
+		for(size_t i = 0; i < esh->threads_len; i++) {
+			gc_minor_mark(esh, esh->threads[i]);
+			gc_trace_obj(esh, &esh->threads[i]->obj, gc_minor_mark);
+		}
+		
+		gc_minor_mark(esh, esh->globals);
+		gc_minor_mark(esh, esh->root_shape);
+		gc_minor_mark(esh, esh->cmd);
+		
+		for(size_t i = 0; i < esh->remembered.len; i++) {
+			esh_object *obj = esh->remembered.objs[i];
+			if(obj->gc_gen & GC_OLD) gc_trace_obj(esh, obj, gc_minor_mark);
+			else gc_minor_mark(esh, obj);
+		}
+		
+		while(esh->young_gray.len != 0) {
+			esh_object *obj = esh->young_gray.objs[--esh->young_gray.len];
+			gc_trace_obj(esh, obj, gc_minor_mark);
+		}
+		
+		promote_all = esh->young_gray.overflow;
+	}
+	
+	for(size_t i = 0; i < esh->remembered.len; i++) gc_set_remembered(esh, esh->remembered.objs[i], false);
+	esh->remembered.len = 0;
+	esh->remembered.overflow = false;
+	esh->young_gray.len = 0;
+	esh->young_gray.overflow = false;
+	
+	size_t promoted = 0;
+	esh_object *next;
+	for(esh_object *i = esh->young; i != NULL; i = next) {
+		next = i->next;
+		i->next = NULL;
+		
+		if(promote_all || (i->gc_tag & GC_TAG_MARKED)) {
+			promoted += object_size(i);
+			gc_promote(esh, i);
+		} else {
+			esh->gc_freed_bytes += object_size(i);
+			esh->gc_freed_objects++;
+			free_object(esh, i);
+		}
+	}
+	esh->young = NULL;
+	esh->gc_n_minor++;
+	
+	return promoted;
+}
+
+// Calls f for every old object that is allocated from a slab, or only for the marked ones
+static void gc_each_slab_object(esh_state *esh, bool only_marked, void (*f)(esh_state *, esh_object *)) {
+	for(esh_arena *arena = esh->pool_arenas; arena != NULL; arena = arena->next) {
+		for(size_t i = 0; i < arena->n_carved; i++) {
+			esh_slab *slab = (esh_slab *) (arena->slabs + POOL_SLAB_SIZE * i);
+			if(slab->size_class == 0) continue;
+			
+			for(size_t w = 0; w < POOL_SLAB_BITS / 64; w++) {
+				uint64_t bits = slab->old[w] & (only_marked? slab->mark[w] : ~(uint64_t) 0);
+				for(size_t b = 0; bits != 0; b++, bits >>= 1) {
+					if(bits & 1) f(esh, (esh_object *) ((char *) slab + (w * 64 + b) * 16));
+				}
+			}
+		}
+	}
+}
+
+static void gc_retrace(esh_state *esh, esh_object *obj) {
+	gc_trace_obj(esh, obj, gc_mark_to_visit);
+}
+
+// Traces all marked objects again, once the gray stack overflowed
+static void gc_rescan_marked(esh_state *esh) {
+	gc_each_slab_object(esh, true, gc_retrace);
+	for(esh_object *obj = esh->large; obj != NULL; obj = obj->next) {
+		if(obj->gc_tag & GC_TAG_MARKED) gc_retrace(esh, obj);
+	}
+}
+
+static void gc_mark_roots(esh_state *esh) {
 	for(size_t i = 0; i < esh->current_thread->stack_len; i++) {
 		gc_mark_to_visit(esh, esh->current_thread->stack[i]);
 	}
 	for(size_t i = 0; i < esh->current_thread->stack_frames_len; i++) {
-		gc_mark_stack_frame(esh, &esh->current_thread->stack_frames[i]);
+		gc_mark_stack_frame(esh, &esh->current_thread->stack_frames[i], gc_mark_to_visit);
 	}
-	gc_mark_stack_frame(esh, &esh->current_thread->current_frame);
+	gc_mark_stack_frame(esh, &esh->current_thread->current_frame, gc_mark_to_visit);
 	
 	gc_mark_to_visit(esh, esh->globals);
+	gc_mark_to_visit(esh, esh->root_shape);
 	gc_mark_to_visit(esh, esh->cmd);
 	gc_mark_to_visit(esh, esh->current_thread);
 	
 	for(size_t i = 0; i < esh->threads_len; i++) {
 		gc_mark_to_visit(esh, esh->threads[i]);
 	}
+}
+
+// Scans the roots and works through the gray stack, taking at most *n steps unless full. Returns true once everything that is alive is marked
+static bool gc_mark(esh_state *esh, size_t *n, bool full) {
+	gc_mark_roots(esh);
 	
-	// Iterate over the to_visit set
-	while(esh->to_visit) {
-		if(!do_full_sweep) {
-			if(n == 0) return;
-			n--;
+	while(true) {
+		while(esh->gray.len != 0) {
+			if(!full) {
+				if(*n == 0) return false;
+				(*n)--;
+			}
+			
+			esh_object *obj = esh->gray.objs[--esh->gray.len];
+			obj->gc_tag &= ~GC_TAG_GRAY;
+			gc_trace_obj(esh, obj, gc_mark_to_visit);
+		}
+		
+		if(esh->gray.overflow) {
+			esh->gray.overflow = false;
+			gc_rescan_marked(esh);
+			continue;
+		}
+		
+		// Young objects that are alive get promoted onto the gray stack
+		gc_minor(esh);
+		if(esh->gray.len == 0 && !esh->gray.overflow) break;
+	}
+	
+	assert(esh->remembered.len == 0);
+	return true;
+}
+
+static void gc_begin_sweep(esh_state *esh) {
+	esh->gc_phase = ESH_GC_SWEEPING;
+	esh->gc_cycle++;
+	esh->gc_satb = false;
+	esh->sweep_arena = esh->pool_arenas;
+	esh->sweep_slab = 0;
+	
+	// Large objects are few, so they are swept at once
+	esh_object **link = &esh->large;
+	while(*link) {
+		esh_object *obj = *link;
+		if(obj->gc_tag & GC_TAG_MARKED) {
+			obj->gc_tag &= ~(GC_TAG_MARKED | GC_TAG_TRACED);
+			link = &obj->next;
+		} else {
+			*link = obj->next;
+			gc_free_old(esh, obj);
+		}
+	}
+}
+
+static void gc_end_sweep(esh_state *esh) {
+	esh->gc_phase = ESH_GC_IDLE;
+	
+	// Cycles that free little of the old generation are spaced out further, and the ones that free most of it brought closer
+	if(esh->gc_mode == ESH_GC_MODE_ADAPTIVE && esh->gc_cycle_start_bytes != 0) {
+		size_t survival = esh->old_bytes * 100 / esh->gc_cycle_start_bytes;
+		if(survival > 90 && esh->gc_pause < GC_MAX_PAUSE) esh->gc_pause += 50;
+		else if(survival < 50 && esh->gc_pause > GC_MIN_PAUSE) esh->gc_pause -= 25;
+	}
+	
+	size_t threshold = esh->old_bytes / 100 * esh->gc_pause;
+	esh->old_threshold = threshold > GC_MIN_OLD_THRESHOLD? threshold : GC_MIN_OLD_THRESHOLD;
+	
+	// Arenas emptied during the sweep were kept, so that the sweep could go on through them
+	esh_arena *next;
+	for(esh_arena *arena = esh->pool_arenas; arena != NULL; arena = next) {
+		next = arena->next;
+		if(arena->n_used == 0 && (arena != esh->pool_arenas || next)) pool_free_arena(esh, arena);
+	}
+	
+	// The pause that ends the cycle is counted towards the next line
+	if(esh->gc_trace) {
+		fprintf(stderr, "gc %zu: old generation %zu KB -> %zu KB (next cycle at %zu KB), %zu objects freed, %zu minor collections, %.3f ms paused (max %.3f ms)\n",
+			esh->gc_cycle, esh->gc_cycle_start_bytes / 1024, esh->old_bytes / 1024, esh->old_threshold / 1024,
+			esh->gc_freed_objects - esh->gc_trace_freed, esh->gc_n_minor - esh->gc_trace_minors,
+			(esh->gc_pause_total - esh->gc_trace_pause) / 1e6, esh->gc_trace_max_pause / 1e6);
+	}
+	esh->gc_trace_freed = esh->gc_freed_objects;
+	esh->gc_trace_minors = esh->gc_n_minor;
+	esh->gc_trace_pause = esh->gc_pause_total;
+	esh->gc_trace_max_pause = 0;
+}
+
+// Sweeps the next slab, and returns false once there are none left
+static bool gc_sweep_slab(esh_state *esh) {
+	esh_slab *slab = NULL;
+	while(esh->sweep_arena && !slab) {
+		if(esh->sweep_slab == esh->sweep_arena->n_carved) {
+			esh->sweep_arena = esh->sweep_arena->next;
+			esh->sweep_slab = 0;
+			continue;
 		}
 		
-		esh_object *obj = esh->to_visit;
-		obj_list_pop(&esh->to_visit, obj);
+		slab = (esh_slab *) (esh->sweep_arena->slabs + POOL_SLAB_SIZE * esh->sweep_slab++);
+		if(slab->size_class == 0 || slab->swept_cycle == esh->gc_cycle) slab = NULL;
+	}
+	if(!slab) return false;
+	
+	slab->swept_cycle = esh->gc_cycle;
+	for(size_t w = 0; w < POOL_SLAB_BITS / 64; w++) {
+		uint64_t dead = slab->old[w] & ~slab->mark[w];
+		slab->mark[w] = 0;
+		slab->traced[w] = 0;
 		
-		gc_trace_obj(esh, obj);
+		// Freeing the last object gives the slab back to its arena, but the arena is kept until the end of the sweep
+		for(size_t b = 0; dead != 0; b++, dead >>= 1) {
+			if(!(dead & 1)) continue;
+			
+			gc_free_old(esh, (esh_object *) ((char *) slab + (w * 64 + b) * 16));
+		}
+	}
+	return true;
+}
+
+#ifndef NO_THREADS
+// CONCURRENT MAJOR CYCLES
+// In ESH_GC_MODE_CONCURRENT, a cycle starts out like an incremental one, and is handed over to the worker thread at the next safepoint (see gc_safepoint). From there on, objects are traced before they are written to, by whichever thread gets to them first, so that the worker only ever sees objects that the main thread won't write to again in the cycle
+// The main thread keeps the roots: it traces the threads, whose stacks are written to without barriers, and the objects promoted during the cycle, which may be halfway through being written to. The objects it marks are handed over to the worker, and once the worker ran out of objects to trace, the main thread finishes the marking by itself. The worker then sweeps the slabs, freeing the dead objects that need nothing from the main thread
+
+static void gc_stack_move(esh_state *esh, esh_obj_stack *to, esh_obj_stack *from) {
+	while(from->len != 0) gc_stack_push(esh, to, from->objs[--from->len]);
+	if(from->overflow) to->overflow = true;
+	from->overflow = false;
+}
+
+static void gc_worker_visit(esh_state *esh, esh_val val) {
+	esh_object *obj = val_as_object(val, NULL);
+	if(!obj || !(__atomic_load_n(&obj->gc_gen, __ATOMIC_ACQUIRE) & GC_OLD)) return; // Young objects are left to the minor collections of the main thread
+	if(gc_set_marked(esh, obj)) gc_stack_push(esh, &esh->gray, obj);
+}
+
+static void gc_worker_mark(esh_state *esh) {
+	while(esh->gray.len != 0) {
+		if(__atomic_load_n(&esh->gc_worker->stop, __ATOMIC_RELAXED)) return;
 		
-		obj->gc_tag = 2; // Move to the "visited" set
-		obj_list_add(&esh->visited, obj);
+		esh_object *obj = esh->gray.objs[--esh->gray.len];
+		gc_trace_claimed(esh, obj, gc_worker_visit, false); // Objects being traced by the main thread are traced to the end by it
+	}
+}
+
+// Objects that the worker can free by itself. Freeing the others runs callbacks, or updates the weak sets of the state
+static bool gc_worker_can_free(esh_object *obj) {
+	if(obj->type && obj->type->on_free) return false;
+	return !(obj->type == &string_type && ((esh_string *) obj)->interned);
+}
+
+// Sweeps the slabs, except for the ones holding dead objects that the worker can't free, which are left to gc_sweep_slab. The slab allocator is shared with the main thread in the meantime
+static void gc_worker_sweep(esh_state *esh) {
+	esh_gc_worker *w = esh->gc_worker;
+	esh_object *dead[POOL_SLAB_BITS];
+	
+	pthread_mutex_lock(&w->pool_lock);
+	esh_arena *arena = esh->pool_arenas;
+	size_t i = 0;
+	while(arena && !__atomic_load_n(&w->stop, __ATOMIC_RELAXED)) {
+		if(i == arena->n_carved) {
+			arena = arena->next;
+			i = 0;
+			continue;
+		}
+		
+		esh_slab *slab = (esh_slab *) (arena->slabs + POOL_SLAB_SIZE * i++);
+		if(slab->size_class == 0 || slab->swept_cycle == esh->gc_cycle) continue;
+		
+		size_t n_dead = 0;
+		bool swept = true;
+		for(size_t j = 0; j < POOL_SLAB_BITS / 64; j++) {
+			uint64_t bits = slab->old[j] & ~slab->mark[j];
+			for(size_t b = 0; bits != 0; b++, bits >>= 1) {
+				if(!(bits & 1)) continue;
+				
+				esh_object *obj = (esh_object *) ((char *) slab + (j * 64 + b) * 16);
+				if(gc_worker_can_free(obj)) {
+					slab->old[j] &= ~BIT_MASK(b);
+					dead[n_dead++] = obj;
+				} else {
+					swept = false;
+				}
+			}
+		}
+		if(swept) {
+			for(size_t j = 0; j < POOL_SLAB_BITS / 64; j++) {
+				slab->mark[j] = 0;
+				slab->traced[j] = 0;
+			}
+			slab->swept_cycle = esh->gc_cycle;
+		}
+		
+		// The dead objects are out of the old bitmap, so nothing else will touch them
+		pthread_mutex_unlock(&w->pool_lock);
+		for(size_t j = 0; j < n_dead; j++) {
+			w->swept_bytes += object_size(dead[j]);
+			w->swept_objects++;
+			free_object(esh, dead[j]);
+		}
+		pthread_mutex_lock(&w->pool_lock);
+	}
+	pthread_mutex_unlock(&w->pool_lock);
+}
+
+static void *gc_worker_run(void *p) {
+	esh_state *esh = p;
+	esh_gc_worker *w = esh->gc_worker;
+	
+	pthread_mutex_lock(&w->lock);
+	while(w->job != GC_JOB_QUIT) {
+		if(w->job == GC_JOB_NONE) {
+			pthread_cond_wait(&w->wake, &w->lock);
+			continue;
+		}
+		
+		gc_job job = w->job;
+		if(job == GC_JOB_MARK) gc_stack_move(esh, &esh->gray, &w->handoff);
+		pthread_mutex_unlock(&w->lock);
+		
+		if(job == GC_JOB_MARK) gc_worker_mark(esh);
+		else gc_worker_sweep(esh);
+		
+		pthread_mutex_lock(&w->lock);
+		if(job == GC_JOB_MARK && !w->stop && (w->handoff.len != 0 || w->handoff.overflow)) continue;
+		w->job = GC_JOB_NONE;
+		pthread_cond_broadcast(&w->done);
+	}
+	pthread_mutex_unlock(&w->lock);
+	
+	return NULL;
+}
+
+static bool gc_worker_create(esh_state *esh) {
+	esh_gc_worker *w = esh->realloc(NULL, sizeof(esh_gc_worker));
+	if(!w) return false;
+	
+	w->job = GC_JOB_NONE;
+	w->stop = false;
+	w->handoff = (esh_obj_stack) { NULL, 0, 0, false };
+	w->shaded = (esh_obj_stack) { NULL, 0, 0, false };
+	w->swept_bytes = 0;
+	w->swept_objects = 0;
+	
+	if(pthread_mutex_init(&w->lock, NULL)) goto ERR_LOCK;
+	if(pthread_mutex_init(&w->pool_lock, NULL)) goto ERR_POOL_LOCK;
+	if(pthread_cond_init(&w->wake, NULL)) goto ERR_WAKE;
+	if(pthread_cond_init(&w->done, NULL)) goto ERR_DONE;
+	
+	esh->gc_worker = w;
+	if(pthread_create(&w->thread, NULL, gc_worker_run, esh)) goto ERR_THREAD;
+	return true;
+	
+	ERR_THREAD:
+	esh->gc_worker = NULL;
+	pthread_cond_destroy(&w->done);
+	ERR_DONE:
+	pthread_cond_destroy(&w->wake);
+	ERR_WAKE:
+	pthread_mutex_destroy(&w->pool_lock);
+	ERR_POOL_LOCK:
+	pthread_mutex_destroy(&w->lock);
+	ERR_LOCK:
+	esh->realloc(w, 0);
+	return false;
+}
+
+static void gc_worker_start(esh_state *esh, gc_job job) {
+	esh_gc_worker *w = esh->gc_worker;
+	if(job == GC_JOB_MARK) esh->gc_worker_marking = true;
+	else esh->gc_worker_sweeping = true;
+	
+	pthread_mutex_lock(&w->lock);
+	w->job = job;
+	pthread_cond_signal(&w->wake);
+	pthread_mutex_unlock(&w->lock);
+}
+
+// Waits for the worker to put its job down, so that the main thread can go on with it
+static void gc_worker_stop(esh_state *esh) {
+	if(!esh->gc_worker_marking && !esh->gc_worker_sweeping) return;
+	esh_gc_worker *w = esh->gc_worker;
+	
+	pthread_mutex_lock(&w->lock);
+	__atomic_store_n(&w->stop, true, __ATOMIC_RELAXED);
+	while(w->job != GC_JOB_NONE) pthread_cond_wait(&w->done, &w->lock);
+	w->stop = false;
+	pthread_mutex_unlock(&w->lock);
+	
+	if(esh->gc_worker_marking) {
+		esh->gc_worker_marking = false;
+		gc_stack_move(esh, &esh->gray, &w->handoff);
+		gc_stack_move(esh, &esh->gray, &w->shaded);
+	}
+	if(esh->gc_worker_sweeping) {
+		esh->gc_worker_sweeping = false;
+		esh->old_bytes -= w->swept_bytes;
+		esh->gc_freed_bytes += w->swept_bytes;
+		esh->gc_freed_objects += w->swept_objects;
+		w->swept_bytes = 0;
+		w->swept_objects = 0;
+	}
+}
+
+static void gc_worker_quit(esh_state *esh) {
+	esh_gc_worker *w = esh->gc_worker;
+	if(!w) return;
+	gc_worker_stop(esh);
+	
+	pthread_mutex_lock(&w->lock);
+	w->job = GC_JOB_QUIT;
+	pthread_cond_signal(&w->wake);
+	pthread_mutex_unlock(&w->lock);
+	pthread_join(w->thread, NULL);
+	
+	pthread_cond_destroy(&w->done);
+	pthread_cond_destroy(&w->wake);
+	pthread_mutex_destroy(&w->pool_lock);
+	pthread_mutex_destroy(&w->lock);
+	esh->realloc(w->handoff.objs, 0);
+	esh->realloc(w->shaded.objs, 0);
+	esh->realloc(w, 0);
+	esh->gc_worker = NULL;
+}
+
+// Passes the objects shaded by the main thread on to the worker. Returns true once the worker traced everything it was given
+static bool gc_worker_hand_over(esh_state *esh) {
+	esh_gc_worker *w = esh->gc_worker;
+	
+	pthread_mutex_lock(&w->lock);
+	if(w->handoff.len == 0 && !w->handoff.overflow) {
+		esh_obj_stack tmp = w->handoff;
+		w->handoff = w->shaded;
+		w->shaded = tmp;
+	} else {
+		gc_stack_move(esh, &w->handoff, &w->shaded);
+	}
+	
+	bool done = w->job == GC_JOB_NONE && w->handoff.len == 0 && !w->handoff.overflow;
+	if(!done && w->job == GC_JOB_NONE) {
+		w->job = GC_JOB_MARK;
+		pthread_cond_signal(&w->wake);
 	}
+	pthread_mutex_unlock(&w->lock);
+	
+	return done;
+}
+
+static void gc_trace_thread(esh_state *esh, esh_co_thread *co) {
+	if(!(co->obj.gc_gen & GC_OLD)) return; // Traced when promoted
+	
+	gc_set_marked(esh, &co->obj);
+	gc_trace_claimed(esh, &co->obj, gc_mark_to_visit, true);
+}
+
+// Hands the marking of the current cycle over to the worker. Called where the main thread isn't halfway through writing to an object, as the objects written to before the cycle was handed over weren't traced first
+static void gc_safepoint(esh_state *esh) {
+	esh->gc_safepoint = false;
+	if(esh->gc_phase != ESH_GC_MARKING || esh->gc_mode != ESH_GC_MODE_CONCURRENT || esh->gc_worker_marking) return;
+	
+	if(!esh->gc_worker && !gc_worker_create(esh)) {
+		esh->gc_mode = ESH_GC_MODE_BYTES;
+		return;
+	}
+	
+	if(!esh->gc_satb) {
+		// Incremental marking never leaves a marked object pointing to an unmarked one that isn't on the gray stack, so marking from the roots and the gray stack finds everything that is alive now (the snapshot)
+		esh->gc_satb = true;
+		for(size_t i = 0; i < esh->gray.len; i++) esh->gray.objs[i]->gc_tag &= ~GC_TAG_GRAY;
+		gc_mark_roots(esh);
+	}
+	
+	gc_trace_thread(esh, esh->current_thread);
+	for(size_t i = 0; i < esh->threads_len; i++) gc_trace_thread(esh, esh->threads[i]);
+	
+	gc_worker_start(esh, GC_JOB_MARK);
+}
+#endif
+
+#ifndef NO_THREADS
+#define GC_SAFEPOINT(esh) do { if((esh)->gc_safepoint) gc_safepoint(esh); } while(0)
+#else
+#define GC_SAFEPOINT(esh) do { } while(0)
+#endif
+
+// Runs n steps of the major cycle, or the whole of it if n is 0
+static void gc_major(esh_state *esh, size_t n) {
+	bool do_full_sweep = n == 0;
+	
+	#ifndef NO_THREADS
+	gc_worker_stop(esh); // The cycle goes on in this thread
+	#endif
+	
+	if(esh->gc_phase == ESH_GC_SWEEPING && do_full_sweep) { // Finish the previous cycle, so that the new one marks from scratch
+		while(gc_sweep_slab(esh));
+		gc_end_sweep(esh);
+	}
+	
+	if(esh->gc_phase == ESH_GC_IDLE) {
+		esh->gc_phase = ESH_GC_MARKING;
+		esh->gc_cycle_start_bytes = esh->old_bytes;
+		esh->gc_satb = false;
+	}
+	
+	if(esh->gc_phase == ESH_GC_MARKING) {
+		if(!gc_mark(esh, &n, do_full_sweep)) return;
+		gc_begin_sweep(esh);
+	}
+	
+	while(gc_sweep_slab(esh)) {
+		if(!do_full_sweep) {
+			if(n == 0) return;
+			n--;
+		}
+	}
+	gc_end_sweep(esh);
+}
+
+void esh_gc(esh_state *esh, size_t n) {
+	uint64_t start = gc_now();
+	gc_major(esh, n);
+	gc_add_pause(esh, start);
+}
+
+void esh_gc_minor(esh_state *esh) {
+	uint64_t start = gc_now();
+	gc_minor(esh);
+	gc_add_pause(esh, start);
+}
+
+static void gc_free_object(esh_state *esh, esh_object *obj) {
+	free_object(esh, obj);
+}
+
+// Frees every object, when closing the state
+static void gc_free_all(esh_state *esh) {
+	#ifndef NO_THREADS
+	gc_worker_quit(esh);
+	#endif
+	esh->gc_phase = ESH_GC_SWEEPING; // Keeps the arenas while they are walked
 	
-	size_t alive = 0, freed = 0;
 	esh_object *next;
-	for(esh_object *i = esh->objects; i != NULL; i = next) {
-		freed++;
-		next = i->next;
-		free_object(esh, i);
+	for(esh_object *obj = esh->young; obj != NULL; obj = next) {
+		next = obj->next;
+		free_object(esh, obj);
+	}
+	for(esh_object *obj = esh->large; obj != NULL; obj = next) {
+		next = obj->next;
+		free_object(esh, obj);
+	}
+	gc_each_slab_object(esh, false, gc_free_object);
+	
+	esh_arena *next_arena;
+	for(esh_arena *arena = esh->pool_arenas; arena != NULL; arena = next_arena) {
+		next_arena = arena->next;
+		assert(arena->n_used == 0);
+		pool_free_arena(esh, arena);
+	}
+	
+	esh->realloc(esh->gray.objs, 0);
+	esh->realloc(esh->young_gray.objs, 0);
+	esh->realloc(esh->remembered.objs, 0);
+}
+
+// Tunes the nursery size from the survival rate and the pause of the minor collection, and the step multiplier from the pause of the major step
+static void gc_adapt(esh_state *esh, size_t debt, size_t promoted, clock_t minor_pause, clock_t major_pause) {
+	if(minor_pause > GC_PAUSE_TARGET) {
+		if(esh->gc_nursery / 2 >= GC_MIN_NURSERY) esh->gc_nursery /= 2;
+	} else if(promoted > debt / 100 * GC_HIGH_SURVIVAL) { // Give objects more time to die before they are promoted
+		if(esh->gc_nursery * 2 <= GC_MAX_NURSERY) esh->gc_nursery *= 2;
+	}
+	
+	if(esh->gc_phase == ESH_GC_IDLE) return;
+	if(esh->old_bytes > esh->old_threshold / 2 * 3) { // The cycle is falling behind the allocations
+		if(esh->gc_step_mul * 2 <= GC_MAX_STEP_MUL) esh->gc_step_mul *= 2;
+	} else if(major_pause > GC_PAUSE_TARGET) {
+		esh->gc_step_mul = esh->gc_step_mul / 4 * 3 > GC_MIN_STEP_MUL? esh->gc_step_mul / 4 * 3 : GC_MIN_STEP_MUL;
+	}
+}
+
+#ifndef NO_THREADS
+// Step of a major cycle in ESH_GC_MODE_CONCURRENT, which goes on incrementally in the main thread until the worker takes over at a safepoint
+static void gc_concurrent_step(esh_state *esh, size_t steps) {
+	if(esh->gc_worker_marking) {
+		if(!gc_worker_hand_over(esh)) return;
+		
+		// The worker ran out of objects to trace, so the main thread finishes the marking with the roots and a minor collection
+		gc_worker_stop(esh);
+		size_t n = 0;
+		gc_mark(esh, &n, true);
+		gc_begin_sweep(esh);
+		gc_worker_start(esh, GC_JOB_SWEEP);
+		return;
 	}
 	
-	esh->objects = esh->visited;
-	esh->visited = NULL;
-	for(esh_object *i = esh->objects; i != NULL; i = i->next) {
-		alive++;
-		i->gc_tag = 0;
+	if(esh->gc_worker_sweeping) {
+		esh_gc_worker *w = esh->gc_worker;
+		pthread_mutex_lock(&w->lock);
+		bool done = w->job == GC_JOB_NONE;
+		pthread_mutex_unlock(&w->lock);
+		if(!done) return;
+		
+		gc_worker_stop(esh); // The slabs the worker left are swept by esh_gc
 	}
 	
-	assert(esh->visited == NULL);
-	assert(esh->to_visit == NULL);
-	assert(esh->objects == NULL || esh->objects->prev == NULL);
+	gc_major(esh, steps);
+	if(esh->gc_phase == ESH_GC_MARKING) esh->gc_safepoint = true;
+}
+#endif
+
+// Runs a minor collection, followed by a step of the major cycle if one is due. Unless in ESH_GC_MODE_COUNT, the step is sized by the bytes allocated since the last minor collection
+static void gc_paced_collect(esh_state *esh) {
+	uint64_t pause_start = gc_now();
+	size_t debt = esh->gc_debt;
+	esh->gc_debt = 0;
+	esh->gc_allocated += debt;
+	
+	bool adaptive = esh->gc_mode == ESH_GC_MODE_ADAPTIVE;
+	clock_t start = adaptive? clock() : 0;
+	size_t promoted = gc_minor(esh);
+	clock_t minor_end = adaptive? clock() : 0;
+	
+	if(esh->gc_phase != ESH_GC_IDLE || esh->old_bytes >= esh->old_threshold) {
+		size_t steps = esh->gc_step_size;
+		if(esh->gc_mode != ESH_GC_MODE_COUNT) steps = debt / 100 * esh->gc_step_mul / GC_STEP_BYTES + 1;
+		
+		#ifndef NO_THREADS
+		if(esh->gc_mode == ESH_GC_MODE_CONCURRENT) {
+			gc_concurrent_step(esh, steps);
+			gc_add_pause(esh, pause_start);
+			return;
+		}
+		#endif
+		gc_major(esh, steps);
+	}
 	
-	//printf("%zu objects left (%zu freed)\n", alive, freed);
+	if(adaptive) gc_adapt(esh, debt, promoted, minor_end - start, clock() - minor_end);
+	gc_add_pause(esh, pause_start);
 }
 
 void esh_gc_conf(esh_state *esh, int gc_freq, int gc_step_size) {
-	if(gc_freq != -1) esh->gc_freq = gc_freq;
+	if(gc_freq != -1) {
+		esh->gc_freq = gc_freq;
+		esh->gc_mode = ESH_GC_MODE_COUNT;
+	}
 	if(gc_step_size != -1) esh->gc_step_size = gc_step_size;
 }
 
+void esh_gc_pacing_conf(esh_state *esh, int mode, long long nursery_size, int pause, int step_mul) {
+	if(mode != -1) esh->gc_mode = mode;
+	if(nursery_size != -1) esh->gc_nursery = nursery_size;
+	if(pause != -1) esh->gc_pause = pause;
+	if(step_mul != -1) esh->gc_step_mul = step_mul;
+}
+
+void esh_gc_trace(esh_state *esh, bool trace) {
+	esh->gc_trace = trace;
+}
+
+typedef struct gc_type_count {
+	const char *name;
+	size_t n;
+} gc_type_count;
+
+typedef struct gc_live_count {
+	size_t objects, bytes;
+	gc_type_count *types;
+	size_t n_types, types_cap;
+	bool overflow; // The types could not be grown
+} gc_live_count;
+
+static void gc_count_live(esh_state *esh, gc_live_count *count, esh_object *obj) {
+	count->objects++;
+	count->bytes += object_size(obj);
+	
+	const char *name = obj->type? obj->type->name : "object";
+	for(size_t i = 0; i < count->n_types; i++) {
+		if(strcmp(count->types[i].name, name) == 0) {
+			count->types[i].n++;
+			return;
+		}
+	}
+	
+	if(count->n_types == count->types_cap) {
+		size_t new_cap = count->types_cap? count->types_cap * 2 : 16;
+		gc_type_count *new_types = esh->realloc(count->types, sizeof(gc_type_count) * new_cap); // Without running the GC in the middle of the count
+		if(!new_types) {
+			count->overflow = true;
+			return;
+		}
+		count->types = new_types;
+		count->types_cap = new_cap;
+	}
+	count->types[count->n_types++] = (gc_type_count) { name, 1 };
+}
+
+// Counts the objects that weren't freed yet, leaving out the dead ones in the slabs that are waiting for the sweep
+static void gc_count_all_live(esh_state *esh, gc_live_count *count) {
+	for(esh_object *obj = esh->young; obj != NULL; obj = obj->next) gc_count_live(esh, count, obj);
+	for(esh_object *obj = esh->large; obj != NULL; obj = obj->next) gc_count_live(esh, count, obj);
+	
+	for(esh_arena *arena = esh->pool_arenas; arena != NULL; arena = arena->next) {
+		for(size_t i = 0; i < arena->n_carved; i++) {
+			esh_slab *slab = (esh_slab *) (arena->slabs + POOL_SLAB_SIZE * i);
+			if(slab->size_class == 0) continue;
+			bool unswept = esh->gc_phase == ESH_GC_SWEEPING && slab->swept_cycle != esh->gc_cycle;
+			
+			for(size_t w = 0; w < POOL_SLAB_BITS / 64; w++) {
+				uint64_t bits = slab->old[w] & (unswept? slab->mark[w] : ~(uint64_t) 0);
+				for(size_t b = 0; bits != 0; b++, bits >>= 1) {
+					if(bits & 1) gc_count_live(esh, count, (esh_object *) ((char *) slab + (w * 64 + b) * 16));
+				}
+			}
+		}
+	}
+}
+
+int esh_gc_stats(esh_state *esh) {
+	#ifndef NO_THREADS
+	gc_worker_stop(esh); // The worker frees objects while it sweeps
+	#endif
+	
+	gc_live_count count = { 0, 0, NULL, 0, 0, false };
+	gc_count_all_live(esh, &count);
+	if(count.overflow) {
+		esh->realloc(count.types, 0);
+		esh_err_printf(esh, "Unable to count live objects (out of memory?)");
+		return 1;
+	}
+	
+	size_t allocated = esh->gc_allocated + esh->gc_debt;
+	uint64_t elapsed = gc_now() - esh->gc_open_time;
+	struct { const char *key; long long val; } counters[] = {
+		{ "minor-collections", esh->gc_n_minor },
+		{ "major-cycles", esh->gc_cycle },
+		{ "pause-total-us", esh->gc_pause_total / 1000 },
+		{ "pause-max-us", esh->gc_pause_max / 1000 },
+		{ "objects-freed", esh->gc_freed_objects },
+		{ "bytes-freed", esh->gc_freed_bytes },
+		{ "objects-alive", count.objects },
+		{ "bytes-alive", count.bytes },
+		{ "bytes-allocated", allocated },
+		{ "alloc-rate", elapsed == 0? 0 : (long long) (allocated / (elapsed / 1e9)) }, // Bytes per second since esh_open
+	};
+	
+	size_t stack_len = esh->current_thread->stack_len;
+	if(esh_object_of(esh, 0)) goto ERR;
+	for(size_t i = 0; i < sizeof(counters) / sizeof(counters[0]); i++) {
+		if(esh_push_int(esh, counters[i].val)) goto ERR;
+		if(esh_set_cs(esh, -2, counters[i].key, -1)) goto ERR;
+		esh_pop(esh, 1);
+	}
+	
+	if(esh_object_of(esh, 0)) goto ERR;
+	for(size_t i = 0; i < count.n_types; i++) {
+		if(esh_push_int(esh, count.types[i].n)) goto ERR;
+		if(esh_set_cs(esh, -2, count.types[i].name, -1)) goto ERR;
+		esh_pop(esh, 1);
+	}
+	if(esh_set_cs(esh, -2, "types", -1)) goto ERR;
+	esh_pop(esh, 1);
+	
+	esh->realloc(count.types, 0);
+	return 0;
+	
+	ERR:
+	esh->current_thread->stack_len = stack_len;
+	esh->realloc(count.types, 0);
+	return 1;
+}
+
+void esh_opt_conf(esh_state *esh, int peephole) {
+	if(peephole != -1) esh->peephole = peephole != 0;
+}
+
+// Called before an object is mutated. Marked objects of the current major cycle are traced again (or, once it was handed over to the worker, traced before the values they hold are overwritten), and old objects are remembered by the next minor collection
 static void gc_obj_write_barrier(esh_state *esh, esh_object *obj) {
-	if(obj->gc_tag == 2) {
-		obj->gc_tag = 1;
-		obj_list_pop(&esh->visited, obj);
-		obj_list_add(&esh->to_visit, obj);
+	if(!(obj->gc_gen & GC_OLD)) return;
+	
+	gc_remember(esh, obj);
+	if(esh->gc_phase != ESH_GC_MARKING) return;
+	
+	#ifndef NO_THREADS
+	if(esh->gc_satb) {
+		gc_set_marked(esh, obj);
+		gc_trace_claimed(esh, obj, gc_mark_to_visit, true);
+		return;
 	}
+	#endif
+	if(!(obj->gc_tag & GC_TAG_GRAY) && gc_is_marked(obj)) gc_push_gray(esh, obj);
 }
 
 esh_iterator esh_iter_begin(esh_state *esh) {
 	(void) esh;
-	return (esh_iterator) { false, -1, 0 };
+	return (esh_iterator) { false, -1, 0, false };
 }
 int esh_iter_next(esh_state *esh, long long offset, esh_iterator *iter) {
 	if(iter->done) {
@@ -1385,16 +3775,46 @@ int esh_iter_next(esh_state *esh, long long offset, esh_iterator *iter) {
 	
 	size_t index;
 	if(stack_offset(esh, offset, &index)) return 1;
-	esh_object *obj = val_as_object(esh->current_thread->stack[index], NULL);
-	if(!obj) { // Strings/inline values have no members
+	esh_table *obj = val_as_table(esh->current_thread->stack[index]);
+	if(!obj) { // Only plain objects have members
+		iter->done = true;
+		return 0;
+	}
+	
+	// The array part is iterated through first, followed by the slots or the entries table
+	if(!iter->in_table) {
+		while(iter->index < obj->array_len) {
+			esh_val val = obj->array[iter->index];
+			iter->index++;
+			
+			if(val != ESH_NULL) {
+				if(esh_push_int(esh, iter->index - 1)) return 1;
+				if(stack_push(esh, val)) return 1;
+				return 0;
+			}
+		}
+		
+		iter->in_table = true;
+		iter->index = 0;
+	}
+	
+	if(obj->shape) {
+		if(iter->index < obj->shape->n_slots) {
+			if(stack_push(esh, obj->shape->keys[iter->index])) return 1;
+			if(stack_push(esh, obj->slots[iter->index])) return 1;
+			
+			iter->index++;
+			return 0;
+		}
+		
 		iter->done = true;
 		return 0;
 	}
 	
 	while(iter->index < obj->cap) {
 		esh_object_entry *entry = &obj->entries[iter->index];
-		if(entry->key != NULL && !entry->deleted) {
-			if(esh_new_string(esh, entry->key, entry->keylen)) return 1;
+		if(entry->key != ESH_NULL && !entry->deleted) {
+			if(stack_push(esh, entry->key)) return 1;
 			if(stack_push(esh, entry->val)) return 1;
 			
 			iter->index++;
@@ -1412,6 +3832,9 @@ int esh_index(esh_state *esh, long long obj, long long key) {
 	size_t index;
 	if(stack_offset(esh, key, &index)) return 1;
 	
+	size_t i;
+	if(val_as_index(esh->current_thread->stack[index], &i)) return esh_index_i(esh, obj, i);
+	
 	size_t keylen;
 	const char *keystr = val_as_string(&esh->current_thread->stack[index], &keylen);
 	if(!keystr) {
@@ -1427,7 +3850,7 @@ int esh_index_s(esh_state *esh, long long object, const char *key, size_t keylen
 	if(stack_offset(esh, object, &index)) return 1;
 	
 	esh_val val = NULL;
-	esh_object *obj = val_as_object(esh->current_thread->stack[index], NULL);
+	esh_table *obj = val_as_table(esh->current_thread->stack[index]);
 	if(!obj) goto END;
 	
 	esh_val res;
@@ -1439,15 +3862,29 @@ int esh_index_s(esh_state *esh, long long object, const char *key, size_t keylen
 }
 
 int esh_index_i(esh_state *esh, long long object, long long i) {
-	size_t keylen;
-	char *key = int_to_str(i, &keylen);
-	return esh_index_s(esh, object, key, keylen);
+	if(i < 0) {
+		size_t keylen;
+		char *key = int_to_str(i, &keylen);
+		return esh_index_s(esh, object, key, keylen);
+	}
+	
+	size_t index;
+	if(stack_offset(esh, object, &index)) return 1;
+	
+	esh_val val = NULL;
+	esh_table *obj = val_as_table(esh->current_thread->stack[index]);
+	if(obj) esh_object_get_i(esh, obj, i, &val);
+	
+	return stack_push(esh, val);
 }
 
 int esh_set(esh_state *esh, long long obj, long long key, long long value) {
 	size_t key_index;
 	if(stack_offset(esh, key, &key_index)) return 1;
 	
+	size_t i;
+	if(val_as_index(esh->current_thread->stack[key_index], &i)) return esh_set_i(esh, obj, i, value);
+	
 	size_t strlen;
 	const char *str = val_as_string(&esh->current_thread->stack[key_index], &strlen);
 	if(!str) {
@@ -1462,13 +3899,13 @@ int esh_set_s(esh_state *esh, long long obj, const char *key, size_t keylen, lon
 	size_t obj_index, value_index;
 	if(stack_offset(esh, obj, &obj_index) || stack_offset(esh, value, &value_index)) return 1;
 	
-	esh_object *obj_p = val_as_object(esh->current_thread->stack[obj_index], NULL);
+	esh_table *obj_p = val_as_table(esh->current_thread->stack[obj_index]);
 	if(!obj_p) {
 		esh_err_printf(esh, "Attempting to set index of immutable object");
 		return 1;
 	}
 	
-	gc_obj_write_barrier(esh, obj_p);
+	gc_obj_write_barrier(esh, &obj_p->obj);
 	return esh_object_set(esh, obj_p, key, keylen, esh->current_thread->stack[value_index]);
 }
 
@@ -1477,9 +3914,23 @@ int esh_set_cs(esh_state *esh, long long obj, const char *key, long long value)
 }
 
 int esh_set_i(esh_state *esh, long long obj, long long i, long long value) { 
-	size_t strlen;
-	const char *str = int_to_str(i, &strlen);
-	return esh_set_s(esh, obj, str, strlen, value);
+	if(i < 0) {
+		size_t strlen;
+		const char *str = int_to_str(i, &strlen);
+		return esh_set_s(esh, obj, str, strlen, value);
+	}
+	
+	size_t obj_index, value_index;
+	if(stack_offset(esh, obj, &obj_index) || stack_offset(esh, value, &value_index)) return 1;
+	
+	esh_table *obj_p = val_as_table(esh->current_thread->stack[obj_index]);
+	if(!obj_p) {
+		esh_err_printf(esh, "Attempting to set index of immutable object");
+		return 1;
+	}
+	
+	gc_obj_write_barrier(esh, &obj_p->obj);
+	return esh_object_set_i(esh, obj_p, i, esh->current_thread->stack[value_index]);
 }
 
 void esh_save_stack(esh_state *esh) {
@@ -1546,22 +3997,17 @@ static esh_env *new_env_object(esh_state *esh, size_t n_locals) {
 static int create_coroutine(esh_state *esh, size_t n_args, size_t expected_returns, esh_closure *fn) {
 	assert(fn->is_coroutine);
 	
-	esh_val *args = &esh->current_thread->stack[esh->current_thread->stack_len - n_args];
-
 	bool is_c_fn = fn->fn->c_fn != NULL;
 	
 	size_t required_stack_space;
 	if(!is_c_fn) {
-		if(fn->fn->upval_locals) {
-			required_stack_space = ESH_FN_DEFAULT_STACK_CAP;
-		} else {
-			required_stack_space = ESH_FN_DEFAULT_STACK_CAP + fn->fn->n_locals;
-		}
+		required_stack_space = ESH_FN_DEFAULT_STACK_CAP + fn->fn->n_locals;
 	} else {
 		required_stack_space = C_FN_DEFAULT_STACK_CAP + n_args;
 	}
 	
-	esh_co_thread *coroutine = esh_new_object(esh, sizeof(esh_co_thread), &co_thread_type);
+	bool inline_stack = required_stack_space <= ESH_CO_INLINE_STACK;
+	esh_co_thread *coroutine = esh_new_object(esh, sizeof(esh_co_thread) + (inline_stack? sizeof(esh_val) * required_stack_space : 0), &co_thread_type);
 	if(!coroutine) return 1;
 	*coroutine = (esh_co_thread) {
 		.obj = coroutine->obj,
@@ -1588,27 +4034,38 @@ static int create_coroutine(esh_state *esh, size_t n_args, size_t expected_retur
 		.is_done = false
 	};
 	
-	coroutine->stack = esh_alloc(esh, sizeof(esh_val *) * required_stack_space);
-	if(!coroutine->stack) {
-		esh_err_printf(esh, "Unable to allocate coroutine's stack, out of memory?");
-		return 1;
+	size_t stack_cap = required_stack_space;
+	if(inline_stack) {
+		coroutine->stack = coroutine->inline_stack;
+	} else {
+		coroutine->stack = pooled_buff_take(esh->co_stacks, &esh->co_stacks_len, required_stack_space, &stack_cap);
+		if(!coroutine->stack) coroutine->stack = esh_alloc(esh, sizeof(esh_val) * stack_cap);
+		if(!coroutine->stack) {
+			esh_err_printf(esh, "Unable to allocate coroutine's stack, out of memory?");
+			return 1;
+		}
 	}
-	coroutine->stack_cap = required_stack_space;
+	coroutine->stack_cap = stack_cap;
 	
+	esh_env *env = fn->env;
 	if(!is_c_fn && fn->fn->upval_locals) { // The check for !is_c_fn might be redundant, as only interpreted functions should ever have upval_locals set
-		coroutine->current_frame.env = new_env_object(esh, fn->fn->n_locals);
-		gc_obj_write_barrier(esh, &coroutine->obj);
-		if(!coroutine->current_frame.env) return 1;
-		
-		for(size_t i = 0; i < n_args; i++) {
-			coroutine->current_frame.env->locals[i] = args[i];
+		env = new_env_object(esh, fn->fn->n_env_locals);
+		if(!env) return 1;
+		env->parent = fn->env;
+	}
+	gc_obj_write_barrier(esh, &coroutine->obj); // Allocating the stack or environment may have promoted the coroutine
+	coroutine->current_frame.env = env;
+	
+	// Locals stay on the coroutine's stack, only the captured arguments are copied into the environment
+	esh_val *args = &esh->current_thread->stack[esh->current_thread->stack_len - 1 - n_args]; // Below the coroutine
+	if(is_c_fn) coroutine->stack_len += n_args;
+	else coroutine->stack_len += fn->fn->n_locals;
+	for(size_t i = 0; i < n_args; i++) coroutine->stack[i] = args[i];
+	for(size_t i = n_args; i < fn->fn->n_locals; i++) coroutine->stack[i] = ESH_NULL;
+	if(!is_c_fn && fn->fn->upval_locals) {
+		for(size_t i = 0; i < n_args && i < fn->fn->n_env_locals; i++) {
+			if(fn->fn->captured[i]) env->locals[i] = args[i];
 		}
-		coroutine->current_frame.env->parent = fn->env;
-	} else {
-		if(is_c_fn) coroutine->stack_len += n_args;
-		else coroutine->stack_len += fn->fn->n_locals;
-		for(size_t i = 0; i < n_args; i++) coroutine->stack[i] = args[i];
-		for(size_t i = n_args; i < fn->fn->n_locals; i++) coroutine->stack[i] = ESH_NULL;
 	}
 	
 	esh_val tmp = stack_pop(esh, 1);
@@ -1623,7 +4080,74 @@ static int create_coroutine(esh_state *esh, size_t n_args, size_t expected_retur
 	return 0;
 }
 
+static int grow_stack_frames(esh_state *esh) {
+	if(esh->current_thread->stack_frames_cap == 0) {
+		size_t cap;
+		esh_stack_frame *frames = pooled_buff_take(esh->co_frames, &esh->co_frames_len, 1, &cap);
+		if(frames) {
+			esh->current_thread->stack_frames = frames;
+			esh->current_thread->stack_frames_cap = cap;
+		}
+	}
+	
+	if(esh->current_thread->stack_frames_len == esh->current_thread->stack_frames_cap) {
+		size_t new_cap = esh->current_thread->stack_frames_cap * 3 / 2 + 1;
+		esh_stack_frame *new_stack = esh_realloc(esh, esh->current_thread->stack_frames, sizeof(esh_stack_frame) * new_cap);
+		if(!new_stack) {
+			esh_err_printf(esh, "Unable to push stack frame (out of memory?)");
+			return 1;
+		}
+		
+		esh->current_thread->stack_frames = new_stack;
+		esh->current_thread->stack_frames_cap = new_cap;
+	}
+	return 0;
+}
+
+static int move_returns(esh_state *esh, size_t n, size_t expected_returns);
+
+// Leaf functions borrow the caller's frame, only the stack base is moved to their arguments for the duration of the call
+static int call_leaf_fn(esh_state *esh, esh_function *fn, size_t n_args, size_t expected_returns, bool catch_panic) {
+	size_t caller_stack_base = esh->current_thread->current_frame.stack_base;
+	size_t stack_base = esh->current_thread->stack_len - n_args;
+	
+	if(esh_req_stack(esh, C_FN_DEFAULT_STACK_CAP)) return 1;
+	
+	esh->current_thread->current_frame.stack_base = stack_base;
+	esh_fn_result res = fn->c_fn(esh, n_args, 0);
+	if(res.type == 0) {
+		if(!move_returns(esh, res.n_args, expected_returns)) {
+			esh->current_thread->current_frame.stack_base = caller_stack_base;
+			return 0;
+		}
+	} else if(res.type != -1) {
+		esh_err_printf(esh, "Leaf function %s attempted to call, yield or resume a coroutine", fn->name);
+	}
+	esh->current_thread->current_frame.stack_base = caller_stack_base;
+	
+	// Push the frame it would have had, so that the panic is unwound and traced as for any other function
+	if(grow_stack_frames(esh)) return 1;
+	esh->current_thread->stack_frames[esh->current_thread->stack_frames_len++] = esh->current_thread->current_frame;
+	esh->current_thread->stack_frames[esh->current_thread->stack_frames_len - 1].expected_returns = expected_returns;
+	esh->current_thread->stack_frames[esh->current_thread->stack_frames_len - 1].catch_panic = catch_panic;
+	
+	esh->current_thread->current_frame = (esh_stack_frame) {
+		.stack_base = stack_base,
+		.env = NULL,
+		.fn = fn,
+		.n_args = n_args,
+		.instr_index = 0,
+		.c_locals = NULL,
+		.c_locals_free = NULL,
+		.catch_panic = false
+	};
+	
+	return 1;
+}
+
 static int enter_fn(esh_state *esh, size_t n_args, size_t expected_returns, esh_val *opt_fn, bool catch_panic) {
+	GC_SAFEPOINT(esh);
+	
 	if(opt_req_stack(esh, n_args + 1u)) {
 		esh_err_printf(esh, "Not enough items on stack for call (%zu, %zu)\n", stack_size(esh), n_args + 1u);
 		return 1;
@@ -1646,43 +4170,30 @@ static int enter_fn(esh_state *esh, size_t n_args, size_t expected_returns, esh_
 	}
 	
 	if(fn->is_coroutine) return create_coroutine(esh, n_args, expected_returns, fn);
+	if(fn->fn->is_leaf) return call_leaf_fn(esh, fn->fn, n_args, expected_returns, catch_panic);
 	
-	if(esh->current_thread->stack_frames_len == esh->current_thread->stack_frames_cap) {
-		size_t new_cap = esh->current_thread->stack_frames_cap * 3 / 2 + 1;
-		esh_stack_frame *new_stack = esh_realloc(esh, esh->current_thread->stack_frames, sizeof(esh_stack_frame) * new_cap);
-		if(!new_stack) {
-			esh_err_printf(esh, "Unable to push stack frame (out of memory?)");
-			return 1;
-		}
-		
-		esh->current_thread->stack_frames = new_stack;
-		esh->current_thread->stack_frames_cap = new_cap;
-	}
+	if(grow_stack_frames(esh)) return 1;
 	
 	bool is_c_fn = fn->fn->c_fn != NULL;
 	
 	esh_env *new_env = NULL; 
 	size_t new_stack_base = esh->current_thread->stack_len - n_args;
 	if(!is_c_fn) {
-		if(fn->fn->upval_locals) {
-			if(esh_req_stack(esh, n_args + ESH_FN_DEFAULT_STACK_CAP)) return 1;
-			
-			new_env = new_env_object(esh, fn->fn->n_locals);
-			if(!new_env) return 1;
+		if(esh_req_stack(esh, fn->fn->n_locals + ESH_FN_DEFAULT_STACK_CAP)) return 1; // Locals take up some stack space, so make sure that there's n_locals + required space on the stack
 		
+		new_env = fn->env;
+		if(fn->fn->upval_locals) { // Only the locals captured by nested functions live in the environment, the rest stay on the stack
+			new_env = new_env_object(esh, fn->fn->n_env_locals);
+			if(!new_env) return 1;
+			
 			new_env->parent = fn->env;
-			for(size_t i = 0; i < n_args; i++) {
-				new_env->locals[i] = esh->current_thread->stack[esh->current_thread->stack_len - n_args + i];
+			for(size_t i = 0; i < n_args && i < fn->fn->n_env_locals; i++) {
+				if(fn->fn->captured[i]) new_env->locals[i] = esh->current_thread->stack[new_stack_base + i];
 			}
-			esh->current_thread->stack_len -= n_args; // Remove the arguments but *not* the function
-			new_stack_base = esh->current_thread->stack_len;
-		} else {
-			if(esh_req_stack(esh, fn->fn->n_locals + ESH_FN_DEFAULT_STACK_CAP)) return 1; // Locals take up some stack space, so make sure that there's n_locals + required space on the stack
-			
-			new_env = fn->env;
-			assert(fn->fn->n_locals >= n_args);
-			stack_resv(esh, fn->fn->n_locals - n_args);
 		}
+		
+		assert(fn->fn->n_locals >= n_args);
+		stack_resv(esh, fn->fn->n_locals - n_args);
 	} else {
 		if(esh_req_stack(esh, n_args + C_FN_DEFAULT_STACK_CAP)) return 1;
 	}
@@ -1723,13 +4234,10 @@ static int unpack_obj(esh_state *esh, size_t n) {
 	esh->current_thread->stack[obj_index] = esh->current_thread->stack[esh->current_thread->stack_len - 1];
 	esh->current_thread->stack[esh->current_thread->stack_len - 1] = obj_val;
 	
-	esh_object *obj = val_as_object(obj_val, NULL);
+	esh_table *obj = val_as_table(obj_val);
 	if(obj != NULL) {
 		for(size_t i = 0; i < n; i++) {
-			size_t keylen;
-			const char *key = int_to_str(i, &keylen);
-			esh_val val;
-			if(esh_object_get(esh, obj, key, keylen, &val)) esh->current_thread->stack[esh->current_thread->stack_len - n - 1 + i] = val;
+			esh_object_get_i(esh, obj, i, &esh->current_thread->stack[esh->current_thread->stack_len - n - 1 + i]);
 		}
 	}
 	
@@ -1745,48 +4253,57 @@ static void free_stack_frame(esh_state *esh, esh_stack_frame *frame) {
 	frame->c_locals_free = NULL;
 }
 
-static int leave_fn(esh_state *esh, size_t n) {
-	if(esh->current_thread->stack_frames_len == 0) {
-		assert(esh->threads_len != 0);
-		
-		esh->current_thread->is_done = true;
-		
-		esh->current_thread = esh->threads[--esh->threads_len];
-		if(stack_resv(esh, esh->current_thread->current_frame.expected_returns)) return 1;
-		return 0;
-	}
-	
-	assert(esh->current_thread->stack_frames_len != 0);
-	
+// Adapts the top n values to the number of values the caller expects, and moves them in place of the called function
+static int move_returns(esh_state *esh, size_t n, size_t expected_returns) {
 	if(opt_req_stack(esh, n)) {
 		esh_err_printf(esh, "Unable to execute return; not enough values on stack (%zu/%zu)", stack_size(esh), n);
 		return 1;
 	}
 	
-	esh_stack_frame prev_frame = esh->current_thread->stack_frames[esh->current_thread->stack_frames_len - 1];
-	
 	size_t ret_vals = n;
-	if(prev_frame.expected_returns == 1 && n != 1) {
+	if(expected_returns == 1 && n != 1) {
 		ret_vals = 1;
 		if(esh_new_array(esh, n)) return 1;
-	} else if(n == 1 && prev_frame.expected_returns > 1) {
-		ret_vals = prev_frame.expected_returns;
-		if(unpack_obj(esh, prev_frame.expected_returns)) return 1;
-	} else if(prev_frame.expected_returns > n) {
-		ret_vals = prev_frame.expected_returns;
-		if(stack_resv(esh, prev_frame.expected_returns - n)) return 1;
-	}
-	assert(ret_vals >= prev_frame.expected_returns);
+	} else if(n == 1 && expected_returns > 1) {
+		ret_vals = expected_returns;
+		if(unpack_obj(esh, expected_returns)) return 1;
+	} else if(expected_returns > n) {
+		ret_vals = expected_returns;
+		if(stack_resv(esh, expected_returns - n)) return 1;
+	}
+	assert(ret_vals >= expected_returns);
 	size_t ret_vals_begin = esh->current_thread->stack_len - ret_vals;
 	
 	esh->current_thread->stack_len = esh->current_thread->current_frame.stack_base;
 	esh->current_thread->stack_len--; // Remove the function
-	for(size_t i = 0; i < prev_frame.expected_returns; i++) {
+	for(size_t i = 0; i < expected_returns; i++) {
 		assert(esh->current_thread->stack_len < esh->current_thread->stack_cap);
 		assert(ret_vals_begin + i < esh->current_thread->stack_cap);
 		esh->current_thread->stack[esh->current_thread->stack_len++] = esh->current_thread->stack[ret_vals_begin + i];
 	}
 	
+	return 0;
+}
+
+static int leave_fn(esh_state *esh, size_t n) {
+	if(esh->current_thread->stack_frames_len == 0) {
+		assert(esh->threads_len != 0);
+		
+		esh_co_thread *co = esh->current_thread;
+		co->is_done = true;
+		
+		gc_obj_write_barrier(esh, &co->obj);
+		esh->current_thread = esh->threads[--esh->threads_len];
+		release_co_buffers(esh, co); // It can't be resumed anymore, so there's no need to wait for it to be collected
+		if(stack_resv(esh, esh->current_thread->current_frame.expected_returns)) return 1;
+		return 0;
+	}
+	
+	assert(esh->current_thread->stack_frames_len != 0);
+	
+	esh_stack_frame prev_frame = esh->current_thread->stack_frames[esh->current_thread->stack_frames_len - 1];
+	if(move_returns(esh, n, prev_frame.expected_returns)) return 1;
+	
 	free_stack_frame(esh, &esh->current_thread->current_frame);	
 	esh->current_thread->current_frame = prev_frame;
 	
@@ -1796,16 +4313,15 @@ static int leave_fn(esh_state *esh, size_t n) {
 }
 
 static esh_val *index_local_var(esh_state *esh, size_t index, size_t uplevel, bool write_barrier) {
-	if(!esh->current_thread->current_frame.fn->upval_locals) {
-		if(uplevel == 0) {
-			if(opt_req_stack(esh, index + 1)) {
-				esh_err_printf(esh, "Local stack variable out of bounds (%llu/%llu)", (size_t) index, stack_size(esh));
-				return NULL;
-			}
-			return &esh->current_thread->stack[esh->current_thread->current_frame.stack_base + index];
+	esh_function *fn = esh->current_thread->current_frame.fn;
+	if(uplevel == 0 && !(fn->upval_locals && index < fn->n_env_locals && fn->captured[index])) {
+		if(opt_req_stack(esh, index + 1)) {
+			esh_err_printf(esh, "Local stack variable out of bounds (%llu/%llu)", (size_t) index, stack_size(esh));
+			return NULL;
 		}
-		uplevel--;
+		return &esh->current_thread->stack[esh->current_thread->current_frame.stack_base + index];
 	}
+	if(!fn->upval_locals) uplevel--;
 	
 	esh_env *env = esh->current_thread->current_frame.env;
 	for(size_t i = 0; i < uplevel; i++) {
@@ -1845,29 +4361,62 @@ static int int_binop(esh_state *esh, long long *x, long long *y, const char *opn
 	return 0;
 }
 
-static int branch_instr(esh_state *esh, uint64_t jmp_index) {
-	if(jmp_index >= esh->current_thread->current_frame.fn->jmps_len) {
-		esh_err_printf(esh, "Jump label index out of range");
+// Indexes obj_val using key, as done by the INDEX instruction
+static int index_val(esh_state *esh, esh_val obj_val, esh_val key, esh_val *out) {
+	*out = ESH_NULL;
+	
+	esh_table *obj = val_as_table(obj_val);
+	if(obj) {
+		if(object_get_val(esh, obj, key, out)) {
+			esh_err_printf(esh, "Attempting to index object using non-key value");
+			return 1;
+		}
+	} else if(!val_as_string(&key, NULL)) {
+		esh_err_printf(esh, "Attempting to index object using non-key value");
 		return 1;
 	}
 	
-	size_t dest = esh->current_thread->current_frame.fn->jmps[jmp_index];
-	if(dest >= esh->current_thread->current_frame.fn->instr_len) {
-		esh_err_printf(esh, "Jump label address out of range");
-		return 1;
+	return 0;
+}
+
+static esh_index_cache *index_cache(esh_function *fn, const esh_instr *instr) {
+	assert(instr->ext < fn->n_index_caches);
+	return &fn->index_caches[instr->ext];
+}
+
+// Only remembers keys that compare by identity, so that the cache does not keep arbitrary strings alive
+static void fill_index_cache(esh_state *esh, esh_index_cache *cache, esh_table *obj, esh_val key) {
+	if(!obj->shape || !(esh_val_is_short_str(key) || (val_as_object(key, &string_type) && ((esh_string *) key)->interned))) return;
+	
+	for(size_t i = 0; i < obj->shape->n_slots; i++) {
+		if(obj->shape->keys[i] == key) {
+			gc_shade(esh, obj->shape); // The function holding the cache may already have been traced
+			*cache = (esh_index_cache) { obj->shape, key, i };
+			return;
+		}
+	}
+}
+
+// Same as index_val, through the inline cache of an instruction
+static int index_val_cached(esh_state *esh, esh_index_cache *cache, esh_val obj_val, esh_val key, esh_val *out) {
+	esh_table *obj = val_as_table(obj_val);
+	if(obj && obj->shape == cache->shape && obj->shape && key == cache->key) {
+		*out = obj->slots[cache->slot];
+		return 0;
 	}
 	
-	esh->current_thread->current_frame.instr_index = dest;
+	if(index_val(esh, obj_val, key, out)) return 1;
+	if(obj) fill_index_cache(esh, cache, obj, key);
 	return 0;
 }
 
-static bool fold_next_unpack_instr(esh_state *esh, uint64_t *out_n) {
-	if(esh->current_thread->current_frame.instr_index < esh->current_thread->current_frame.fn->instr_len) {
-		instr_regs instr;
-		decode_instr(esh->current_thread->current_frame.fn->instr + esh->current_thread->current_frame.instr_index * INSTR_SIZE, &instr);
-		if(instr.op == ESH_INSTR_UNPACK) {
+// An UNPACK or POP directly after a call gives the number of values the caller expects, so that multiple return values stay on the stack instead of being boxed into an array
+static bool fold_expected_returns(esh_state *esh, uint64_t *out_n) {
+	if(esh->current_thread->current_frame.instr_index < esh->current_thread->current_frame.fn->code_len) {
+		const esh_instr *instr = &esh->current_thread->current_frame.fn->code[esh->current_thread->current_frame.instr_index];
+		if(instr->op == ESH_INSTR_UNPACK || instr->op == ESH_INSTR_POP) {
 			esh->current_thread->current_frame.instr_index++;
-			*out_n = instr.arg;
+			*out_n = instr->op == ESH_INSTR_UNPACK? instr->arg : 0;
 			return true;
 		}
 	}
@@ -1875,15 +4424,99 @@ static bool fold_next_unpack_instr(esh_state *esh, uint64_t *out_n) {
 	return false;
 }
 
+// Whether the call that was just decoded is directly followed by a RET marked as a tail call. The bottom frame of a thread has no caller to return to, so it's never replaced
+static bool is_tail_call(esh_state *esh) {
+	if(esh->current_thread->stack_frames_len == 0) return false;
+	
+	esh_function *fn = esh->current_thread->current_frame.fn;
+	size_t i = esh->current_thread->current_frame.instr_index;
+	return i < fn->code_len && fn->code[i].op == ESH_INSTR_RET && (fn->code[i].l & RET_TAIL_CALL) != 0;
+}
+
+// Drops the current frame and calls the function from its caller instead, so that the callee returns straight to it
+static int tail_call(esh_state *esh, size_t n_args, esh_val *opt_fn) {
+	esh_co_thread *thread = esh->current_thread;
+	
+	size_t fn_index = thread->current_frame.stack_base - 1; // The slot of the returning function
+	memmove(&thread->stack[fn_index], &thread->stack[thread->stack_len - n_args - 1], sizeof(esh_val) * (n_args + 1));
+	thread->stack_len = fn_index + n_args + 1;
+	
+	free_stack_frame(esh, &thread->current_frame);
+	thread->current_frame = thread->stack_frames[--thread->stack_frames_len];
+	
+	return enter_fn(esh, n_args, thread->current_frame.expected_returns, opt_fn, thread->current_frame.catch_panic);
+}
+
+#ifdef ESH_THREADED_DISPATCH
+	#define VM_CASE(op) OP_##op:
+	#define VM_DEFAULT
+	// Each handler dispatches the next instruction by itself, so that the indirect branches are spread out over all handlers
+	#define VM_DISPATCH() \
+		do { \
+			VM_CHECK_INSTR_INDEX(); \
+			instr = &f->code[esh->current_thread->current_frame.instr_index]; \
+			goto *instr->handler; \
+		} while(0)
+#else
+	#define VM_CASE(op) case ESH_INSTR_##op:
+	#define VM_DEFAULT default:
+	#define VM_DISPATCH() continue
+#endif
+
+#ifndef NO_STACK_CHECK
+	#define VM_CHECK_INSTR_INDEX() \
+		if(esh->current_thread->current_frame.instr_index >= f->code_len) { \
+			esh_err_printf(esh, "Instruction index out of bounds"); \
+			goto PANIC; \
+		}
+#else
+	#define VM_CHECK_INSTR_INDEX()
+#endif
+
+// Continues with the next instruction in the current function
+// (plain blocks rather than do-while, since VM_DISPATCH may be a continue)
+#define VM_NEXT() \
+	{ \
+		esh->current_thread->current_frame.instr_index++; \
+		VM_DISPATCH(); \
+	}
+
+// Continues at the given instruction index in the current function. Jumps (and calls) are safepoints of concurrent GC cycles
+#define VM_JUMP(dest) \
+	{ \
+		esh->current_thread->current_frame.instr_index = (dest); \
+		GC_SAFEPOINT(esh); \
+		VM_DISPATCH(); \
+	}
+
+#ifdef ESH_THREADED_DISPATCH
+// Labels as values are a GNU extension
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wpedantic"
+#endif
+
 static int run_vm(esh_state *esh, esh_closure *entrypoint) {
+	#ifdef ESH_THREADED_DISPATCH
+	static const void *const dispatch_table[] = {
+		#define X(op) &&OP_##op,
+		ESH_OPCODES
+		#undef X
+	};
+	
+	if(!entrypoint) {
+		vm_dispatch_table = dispatch_table;
+		return 0;
+	}
+	#endif
+	
 	assert(esh->current_thread->current_frame.env == NULL);
 	
 	#define ESH_DEFAULT_EXEC_STACK_SIZE 64
 	if(esh_req_stack(esh, ESH_DEFAULT_EXEC_STACK_SIZE)) return 1;
 	
 	esh_env *new_env = NULL;
-	if(entrypoint->fn->upval_locals && (entrypoint->fn->n_locals != 0 || entrypoint->env != NULL)) {
-		new_env = new_env_object(esh, entrypoint->fn->n_locals);
+	if(entrypoint->fn->upval_locals && (entrypoint->fn->n_env_locals != 0 || entrypoint->env != NULL)) {
+		new_env = new_env_object(esh, entrypoint->fn->n_env_locals);
 		if(!new_env) return 1;
 		new_env->parent = entrypoint->env;
 	}
@@ -1900,9 +4533,7 @@ static int run_vm(esh_state *esh, esh_closure *entrypoint) {
 		.catch_panic = false
 	};
 	
-	if(!entrypoint->fn->upval_locals) {
-		if(stack_resv(esh, entrypoint->fn->n_locals)) return 1;
-	}
+	if(stack_resv(esh, entrypoint->fn->n_locals)) return 1;
 	
 	while(true) {
 		esh_function *f = esh->current_thread->current_frame.fn;
@@ -1932,10 +4563,12 @@ static int run_vm(esh_state *esh, esh_closure *entrypoint) {
 				
 				esh_val yield_val = stack_pop(esh, 1);
 				
-				if(res.type == 7) esh->current_thread->is_done = true; // If yield_last
+				esh_co_thread *co = esh->current_thread;
+				if(res.type == 7) co->is_done = true; // If yield_last
 				
-				gc_obj_write_barrier(esh, &esh->current_thread->obj); // The object might've updated whilst executing; e.g the stack might've changed
+				gc_obj_write_barrier(esh, &co->obj); // The object might've updated whilst executing; e.g the stack might've changed
 				esh->current_thread = esh->threads[--esh->threads_len];
+				if(co->is_done) release_co_buffers(esh, co);
 				
 				if(stack_push(esh, yield_val)) goto PANIC;
 			} else if(res.type == 4 || res.type == 6) { // Next or Next_S
@@ -1963,16 +4596,19 @@ static int run_vm(esh_state *esh, esh_closure *entrypoint) {
 				esh->current_thread->current_frame.expected_returns = res.n_res;
 				
 				stack_pop(esh, res.n_args);
-				esh_object *obj = val_as_object(stack_pop(esh, 1), NULL);
+				esh_object *obj = val_as_object(esh->current_thread->stack[esh->current_thread->stack_len - 1], NULL);
 				if(!obj || !obj->type || (!obj->type->next && obj->type != &co_thread_type)) {
 					esh_err_printf(esh, "Attempting to invoke non-coroutine object as coroutine");
 					goto PANIC;
 				}
-				if(obj->type->next) {
+				if(obj->type->next) { // The object stays on the stack until it's produced its value, so that the GC can't free it in the meantime
 					const size_t read_buff_size = 512;
 					if(obj->type->next(esh, obj, res.type == 4? 1 : read_buff_size)) goto PANIC;
+					esh->current_thread->stack[esh->current_thread->stack_len - 2] = esh->current_thread->stack[esh->current_thread->stack_len - 1];
+					esh->current_thread->stack_len--;
 					continue;
 				}
+				stack_pop(esh, 1);
 				esh_co_thread *co = (esh_co_thread *) obj;
 				
 				if(co->is_done) {
@@ -1981,6 +4617,7 @@ static int run_vm(esh_state *esh, esh_closure *entrypoint) {
 				}
 				
 				gc_obj_write_barrier(esh, &esh->current_thread->obj); // The object might've updated whilst executing; e.g the stack might've changed
+				gc_obj_write_barrier(esh, &co->obj); // Its stack is written to without barriers from now on
 				esh->threads[esh->threads_len++] = esh->current_thread;
 				esh->current_thread = co;
 			} else if(res.type == 5) { // Repeat; e.g just increment the instr_index and invoke the function again
@@ -1989,37 +4626,34 @@ static int run_vm(esh_state *esh, esh_closure *entrypoint) {
 			continue;
 		}
 		
-		#ifndef NO_STACK_CHECK
-		if(esh->current_thread->current_frame.instr_index >= f->instr_len) {
-			esh_err_printf(esh, "Instruction index out of bounds");
-			goto PANIC;
-		}
-		#endif
-		
-		uint8_t *instr_p = f->instr + esh->current_thread->current_frame.instr_index * INSTR_SIZE;
-		instr_regs instr;
-		decode_instr(instr_p, &instr);
+		const esh_instr *instr;
+		#ifdef ESH_THREADED_DISPATCH
+		VM_DISPATCH();
+		#else
+		VM_CHECK_INSTR_INDEX();
+		instr = &f->code[esh->current_thread->current_frame.instr_index];
 		
-		switch(instr.op) {
-			case ESH_INSTR_POP: {
+		switch(instr->op) {
+		#endif
+			VM_CASE(POP) {
 				if(opt_req_stack(esh, 1)) {
 					esh_err_printf(esh, "Missing value on stack for pop operation");
 					goto PANIC;
 				}
 				
 				esh->current_thread->stack_len--;
-			} break;
+			} VM_NEXT();
 			
-			case ESH_INSTR_DUP: {
+			VM_CASE(DUP) {
 				if(stack_size(esh) == 0) {
 					esh_err_printf(esh, "Missing value on stack for dup operation");
 					goto PANIC;
 				}
 				
 				if(stack_push(esh, esh->current_thread->stack[esh->current_thread->stack_len - 1])) goto PANIC;
-			} break;
+			} VM_NEXT();
 			
-			case ESH_INSTR_SWAP: {
+			VM_CASE(SWAP) {
 				if(opt_req_stack(esh, 2)) {
 					esh_err_printf(esh, "Missing values on stack for swap operation");
 					goto PANIC;
@@ -2028,32 +4662,39 @@ static int run_vm(esh_state *esh, esh_closure *entrypoint) {
 				esh_val tmp = esh->current_thread->stack[esh->current_thread->stack_len - 1];
 				esh->current_thread->stack[esh->current_thread->stack_len - 1] = esh->current_thread->stack[esh->current_thread->stack_len - 2];
 				esh->current_thread->stack[esh->current_thread->stack_len - 2] = tmp;
-			} break;
+			} VM_NEXT();
 			
-			case ESH_INSTR_IMM:
-				if(instr.arg >= f->imms_len) {
-					esh_err_printf(esh, "Immediate index out of bounds (%llu/%llu)", instr.arg, f->imms_len);
+			VM_CASE(IMM)
+				if(instr->arg >= f->imms_len) {
+					esh_err_printf(esh, "Immediate index out of bounds (%llu/%llu)", instr->arg, f->imms_len);
 					goto PANIC;
 				}
 				
-				if(stack_push(esh, f->imms[instr.arg])) goto PANIC;
+				if(stack_push(esh, f->imms[instr->arg])) goto PANIC;
 				
-				break;
+				VM_NEXT();
 			
-			case ESH_INSTR_PUSH_NULL:
-				if(stack_push(esh, NULL)) goto PANIC;
-				break;
-			
-			case ESH_INSTR_STORE_G: {
-				if(instr.arg >= f->imms_len) {
-					esh_err_printf(esh, "Immediate index for global store out of bounds (%llu/%llu)", instr.arg, f->imms_len);
+			VM_CASE(IMM_SWAP) { // Pushes the immediate below the top value
+				if(instr->arg >= f->imms_len) {
+					esh_err_printf(esh, "Immediate index out of bounds (%llu/%llu)", instr->arg, f->imms_len);
+					goto PANIC;
+				}
+				if(opt_req_stack(esh, 1)) {
+					esh_err_printf(esh, "Missing values on stack for swap operation");
 					goto PANIC;
 				}
 				
-				size_t len;
-				const char *name = val_as_string(&f->imms[instr.arg], &len);
-				if(!name) {
-					esh_err_printf(esh, "Global variable name not a string");
+				if(stack_push(esh, esh->current_thread->stack[esh->current_thread->stack_len - 1])) goto PANIC;
+				esh->current_thread->stack[esh->current_thread->stack_len - 2] = f->imms[instr->arg];
+			} VM_NEXT();
+			
+			VM_CASE(PUSH_NULL)
+				if(stack_push(esh, NULL)) goto PANIC;
+				VM_NEXT();
+			
+			VM_CASE(STORE_G) {
+				if(instr->arg >= f->imms_len) {
+					esh_err_printf(esh, "Immediate index for global store out of bounds (%llu/%llu)", instr->arg, f->imms_len);
 					goto PANIC;
 				}
 				
@@ -2063,105 +4704,154 @@ static int run_vm(esh_state *esh, esh_closure *entrypoint) {
 				}
 				
 				esh_val val = esh->current_thread->stack[esh->current_thread->stack_len - 1];
-				//esh_val val = esh->current_thread->stack[--esh->current_thread->stack_len];
-				gc_obj_write_barrier(esh, esh->globals);
-				if(esh_object_set(esh, esh->globals, name, len, val)) {
-					esh_err_printf(esh, "Unable to set global (out of memory?)");
-					goto PANIC;
+				esh_global_cache *cache = global_cache(f, instr);
+				if(val != ESH_NULL && cache && cache->version == esh->globals_version && cache->key == f->imms[instr->arg]) {
+					gc_obj_write_barrier(esh, &esh->globals->obj);
+					cache->entry->val = val;
+				} else {
+					size_t len;
+					const char *name = val_as_string(&f->imms[instr->arg], &len);
+					if(!name) {
+						esh_err_printf(esh, "Global variable name not a string");
+						goto PANIC;
+					}
+					
+					if(set_global_val(esh, name, len, val)) {
+						esh_err_printf(esh, "Unable to set global (out of memory?)");
+						goto PANIC;
+					}
+					if(val != ESH_NULL && !esh_val_is_int(f->imms[instr->arg])) fill_global_cache(esh, cache, f->imms[instr->arg]);
 				}
 				esh->current_thread->stack_len--;
-			} break;
+			} VM_NEXT();
 			
-			case ESH_INSTR_LOAD_G: {
-				if(instr.arg >= f->imms_len) {
-					esh_err_printf(esh, "Immediate index for global load out of bounds (%llu/%llu)", instr.arg, f->imms_len);
-					goto PANIC;
-				}
-				
-				size_t len;
-				const char *name = val_as_string(&f->imms[instr.arg], &len);
-				if(!name) {
-					esh_err_printf(esh, "Global variable name not a string");
+			VM_CASE(LOAD_G) {
+				if(instr->arg >= f->imms_len) {
+					esh_err_printf(esh, "Immediate index for global load out of bounds (%llu/%llu)", instr->arg, f->imms_len);
 					goto PANIC;
 				}
 				
 				esh_val val;
-				if(!esh_object_get(esh, esh->globals, name, len, &val)) {
-					esh_err_printf(esh, "Unknown global variable '%.*s'", (int) len, name);
+				if(!get_global_cached(esh, global_cache(f, instr), f->imms[instr->arg], &val)) {
+					size_t len;
+					const char *name = val_as_string(&f->imms[instr->arg], &len);
+					if(!name) esh_err_printf(esh, "Global variable name not a string");
+					else esh_err_printf(esh, "Unknown global variable '%.*s'", (int) len, name);
 					goto PANIC;
 				}
 				
 				if(stack_push(esh, val)) goto PANIC;
-			} break;
+			} VM_NEXT();
 			
-			case ESH_INSTR_LOAD: {
-				esh_val *local = index_local_var(esh, instr.arg, instr.l, false);
+			VM_CASE(LOAD) {
+				esh_val *local = index_local_var(esh, instr->arg, instr->l, false);
 				if(!local) goto PANIC;
 
 				if(stack_push(esh, *local)) goto PANIC;
-			} break;
+			} VM_NEXT();
 			
-			case ESH_INSTR_STORE: {
+			VM_CASE(STORE) {
 				if(opt_req_stack(esh, 1)) {
 					esh_err_printf(esh, "Missing value on stack for local store");
 					goto PANIC;
 				}
 				
-				esh_val *local = index_local_var(esh, instr.arg, instr.l, true);
+				esh_val *local = index_local_var(esh, instr->arg, instr->l, true);
 				if(!local) goto PANIC;
 				
 				*local = esh->current_thread->stack[--(esh->current_thread->stack_len)];
-			} break;
+			} VM_NEXT();
+			
+			VM_CASE(INC_LOCAL) { // Adds the signed l-argument to the local
+				esh_val *local = index_local_var(esh, instr->arg, 0, true);
+				if(!local) goto PANIC;
+				
+				long long x;
+				if(val_as_int(local, &x)) {
+					esh_err_printf(esh, "Unable to implicitly convert left value to integer for add operation");
+					goto PANIC;
+				}
+				x += (int8_t) instr->l;
+				
+				if(x >= ESH_INT_MIN && x <= ESH_INT_MAX) {
+					*local = esh_val_from_int(x);
+				} else {
+					if(esh_push_int(esh, x)) goto PANIC;
+					local = index_local_var(esh, instr->arg, 0, true); // The push may have moved the locals
+					if(!local) goto PANIC;
+					*local = esh->current_thread->stack[--(esh->current_thread->stack_len)];
+				}
+			} VM_NEXT();
 			
-			case ESH_INSTR_CMD: {
+			VM_CASE(CMD) {
+				esh_global_cache *cache = global_cache(f, instr);
 				esh->current_thread->current_frame.instr_index++;
 				
-				size_t expected_returns;
-				fold_next_unpack_instr(esh, &expected_returns);
+				bool tail = is_tail_call(esh);
+				size_t expected_returns = instr->l >> CMD_UNPACK_SHIFT;
+				if(expected_returns == 0 && !tail) fold_expected_returns(esh, &expected_returns);
 				
 				size_t stack_items = esh->current_thread->stack_len - esh->current_thread->current_frame.stack_base;
-				if(stack_items < instr.arg + 1u) {
-					esh_err_printf(esh, "Not enough arguments on stack to invoke command (%llu/%llu)", stack_items, instr.arg + 1u);
+				if(stack_items < instr->arg + 1u) {
+					esh_err_printf(esh, "Not enough arguments on stack to invoke command (%llu/%llu)", stack_items, instr->arg + 1u);
 					goto PANIC;
 				}
 				
-				size_t cmdlen;
-				const char *cmd = val_as_string(&esh->current_thread->stack[esh->current_thread->stack_len - instr.arg - 1u], &cmdlen);
+				esh_val global;
+				if(get_global_cached(esh, cache, esh->current_thread->stack[esh->current_thread->stack_len - instr->arg - 1u], &global)) {
+					if(tail) {
+						if(tail_call(esh, instr->arg, &global)) goto PANIC;
+					} else {
+						if(enter_fn(esh, instr->arg, expected_returns, &global, false)) goto PANIC;
+					}
+					continue; // Don't increment instr index
+				}
+				
+				const char *cmd = val_as_string(&esh->current_thread->stack[esh->current_thread->stack_len - instr->arg - 1u], NULL);
 				if(!cmd) {
 					esh_err_printf(esh, "Expected string as command");
 					goto PANIC;
 				}
 				
-				esh_val global;
-				if(esh_object_get(esh, esh->globals, cmd, cmdlen, &global)) {
-					if(enter_fn(esh, instr.arg, expected_returns, &global, false)) goto PANIC;
-					continue; // Don't increment instr index
-				}
-				
 				if(esh->cmd == ESH_NULL) {
 					esh_err_printf(esh, "Unknown command '%s' (no command handler set)", cmd);
 					goto PANIC;
 				}
 				
-				bool capture_output = (instr.l & 1) != 0;
-				bool pipe_in = (instr.l & 2) != 0;
-				if(stack_push(esh, esh->current_thread->stack[esh->current_thread->stack_len - instr.arg - 1u])) goto PANIC;
+				bool capture_output = (instr->l & 1) != 0;
+				bool pipe_in = (instr->l & 2) != 0;
+				if(stack_push(esh, esh->current_thread->stack[esh->current_thread->stack_len - instr->arg - 1u])) goto PANIC;
 				if(esh_push_bool(esh, pipe_in)) goto PANIC;
 				if(esh_push_bool(esh, capture_output)) goto PANIC;
 				
-				if(enter_fn(esh, instr.arg + 3, expected_returns, &esh->cmd, false)) goto PANIC;
+				if(tail) {
+					if(tail_call(esh, instr->arg + 3, &esh->cmd)) goto PANIC;
+				} else {
+					if(enter_fn(esh, instr->arg + 3, expected_returns, &esh->cmd, false)) goto PANIC;
+				}
 				continue; // Don't increment instr index
-			} break;
+			}
 			
-			case ESH_INSTR_CALL: {
+			VM_CASE(CALL) {
 				esh->current_thread->current_frame.instr_index++;
+				if(is_tail_call(esh)) {
+					if(tail_call(esh, instr->arg, NULL)) goto PANIC;
+					continue;
+				}
+				
 				size_t expected_returns;
-				fold_next_unpack_instr(esh, &expected_returns);
-				if(enter_fn(esh, instr.arg, expected_returns, NULL, false)) goto PANIC;
+				fold_expected_returns(esh, &expected_returns);
+				if(enter_fn(esh, instr->arg, expected_returns, NULL, false)) goto PANIC;
+				continue; // Don't increment the instr_index
+			}
+			
+			VM_CASE(CALL_UNPACK) {
+				esh->current_thread->current_frame.instr_index++;
+				if(enter_fn(esh, instr->arg, instr->l, NULL, false)) goto PANIC;
 				continue; // Don't increment the instr_index
-			} break;
+			}
 			
-			case ESH_INSTR_PROP: {
+			VM_CASE(PROP) {
 				if(opt_req_stack(esh, 1)) {
 					esh_err_printf(esh, "Missing value on stack for prop operation");
 					goto PANIC;
@@ -2174,10 +4864,10 @@ static int run_vm(esh_state *esh, esh_closure *entrypoint) {
 					if(leave_fn(esh, 1)) goto PANIC;
 					continue;
 				}
-			} break;
+			} VM_NEXT();
 			
-			case ESH_INSTR_RET: {
-				size_t n = instr.arg;
+			VM_CASE(RET) {
+				size_t n = instr->arg;
 				if(esh->current_thread->stack_frames_len == 0 && esh->threads_len == 0) {
 					if(opt_req_stack(esh, n)) {
 						esh_err_printf(esh, "Unable to execute return; not enough values on stack (%zu/%zu)", stack_size(esh), n);
@@ -2187,17 +4877,23 @@ static int run_vm(esh_state *esh, esh_closure *entrypoint) {
 					if(n != 1) if(esh_new_array(esh, n)) goto PANIC;
 					return 0;
 				}
-				if(leave_fn(esh, instr.arg)) goto PANIC;
+				if(leave_fn(esh, instr->arg)) goto PANIC;
 				continue; // Don't increment the instr_index
-			} break;
+			}
 			
-			case ESH_INSTR_CLOSURE: {
-				if(instr.arg >= f->imms_len) {
-					esh_err_printf(esh, "Immediate index for closure function out of bounds (%llu/%llu)", instr.arg, f->imms_len);
+			VM_CASE(CLOSURE) {
+				if(instr->arg >= f->imms_len) {
+					esh_err_printf(esh, "Immediate index for closure function out of bounds (%llu/%llu)", instr->arg, f->imms_len);
 					goto PANIC;
 				}
 				
-				esh_function *fn = val_as_object(f->imms[instr.arg], &function_type);
+				esh_closure *shared = val_as_object(f->imms[instr->arg], &closure_type);
+				if(shared && !shared->is_coroutine) { // Without free variables, every evaluation yields the same closure
+					if(stack_push(esh, shared)) goto PANIC;
+					VM_NEXT();
+				}
+				
+				esh_function *fn = shared? shared->fn : val_as_object(f->imms[instr->arg], &function_type);
 				if(!fn) {
 					esh_err_printf(esh, "Attempting to create closure from non-function object");
 					goto PANIC;
@@ -2206,13 +4902,14 @@ static int run_vm(esh_state *esh, esh_closure *entrypoint) {
 				esh_closure *closure = esh_new_object(esh, sizeof(esh_closure), &closure_type);
 				if(!closure) goto PANIC;
 				
-				closure->env = esh->current_thread->current_frame.env;
+				closure->env = shared? shared->env : esh->current_thread->current_frame.env;
 				closure->fn = fn;
 				closure->obj.is_const = true;
 				closure->is_coroutine = false;
-			} break;
+				closure->is_shared = false;
+			} VM_NEXT();
 			
-			case ESH_INSTR_JMP_IF: {
+			VM_CASE(JMP_IF) {
 				if(opt_req_stack(esh, 1)) {
 					esh_err_printf(esh, "Missing value on stack for conditional jump");
 					goto PANIC;
@@ -2220,50 +4917,97 @@ static int run_vm(esh_state *esh, esh_closure *entrypoint) {
 				
 				esh->current_thread->stack_len--;
 				
-				if(val_as_bool(&esh->current_thread->stack[esh->current_thread->stack_len - 1])) {
-					if(branch_instr(esh, instr.arg)) goto PANIC;
-					continue; // Don't increment the instr_index
+				if(val_as_bool(&esh->current_thread->stack[esh->current_thread->stack_len])) VM_JUMP(instr->ext);
+			} VM_NEXT();
+			
+			VM_CASE(JMP_IFN) {
+				if(opt_req_stack(esh, 1)) {
+					esh_err_printf(esh, "Missing value on stack for conditional jump");
+					goto PANIC;
 				}
-			} break;
+				
+				esh->current_thread->stack_len--;
+				
+				if(!val_as_bool(&esh->current_thread->stack[esh->current_thread->stack_len])) VM_JUMP(instr->ext);
+			} VM_NEXT();
 			
-			case ESH_INSTR_JMP_IFN: {
+			VM_CASE(JMP_IF_OR_POP) {
 				if(opt_req_stack(esh, 1)) {
 					esh_err_printf(esh, "Missing value on stack for conditional jump");
 					goto PANIC;
 				}
 				
+				if(val_as_bool(&esh->current_thread->stack[esh->current_thread->stack_len - 1])) VM_JUMP(instr->ext);
 				esh->current_thread->stack_len--;
+			} VM_NEXT();
+			
+			VM_CASE(JMP_IFN_OR_POP) {
+				if(opt_req_stack(esh, 1)) {
+					esh_err_printf(esh, "Missing value on stack for conditional jump");
+					goto PANIC;
+				}
 				
-				if(!val_as_bool(&esh->current_thread->stack[esh->current_thread->stack_len])) {
-					if(branch_instr(esh, instr.arg)) goto PANIC;
-					continue; // Don't increment the instr_index
+				if(!val_as_bool(&esh->current_thread->stack[esh->current_thread->stack_len - 1])) VM_JUMP(instr->ext);
+				esh->current_thread->stack_len--;
+			} VM_NEXT();
+			
+			VM_CASE(CMP_JMP) {
+				bool res;
+				switch(instr->l & ~CMP_JMP_IF) {
+					case ESH_INSTR_EQ:
+					case ESH_INSTR_NEQ:
+						if(opt_req_stack(esh, 2)) {
+							esh_err_printf(esh, "Missing values on stack for equality comparison");
+							goto PANIC;
+						}
+						res = vals_equal(&esh->current_thread->stack[esh->current_thread->stack_len - 1], &esh->current_thread->stack[esh->current_thread->stack_len - 2]);
+						if((instr->l & ~CMP_JMP_IF) == ESH_INSTR_NEQ) res = !res;
+						esh->current_thread->stack_len -= 2;
+						break;
+					
+					case ESH_INSTR_LESS: {
+						long long x, y;
+						if(int_binop(esh, &x, &y, "less")) goto PANIC;
+						res = x < y;
+					} break;
+					
+					case ESH_INSTR_GREATER: {
+						long long x, y;
+						if(int_binop(esh, &x, &y, "greater")) goto PANIC;
+						res = x > y;
+					} break;
+					
+					default:
+						esh_err_printf(esh, "Unknown comparison for conditional jump (%u)", (unsigned) instr->l);
+						goto PANIC;
 				}
-			} break;
+				
+				if(res == ((instr->l & CMP_JMP_IF) != 0)) VM_JUMP(instr->ext);
+			} VM_NEXT();
 			
-			case ESH_INSTR_JMP: {
-				if(branch_instr(esh, instr.arg)) goto PANIC;
-				continue; // Don't increment the instr_index
-			} break;
+			VM_CASE(JMP) {
+				VM_JUMP(instr->ext);
+			}
 			
-			case ESH_INSTR_ADD: {
+			VM_CASE(ADD) {
 				long long x, y;
 				if(int_binop(esh, &x, &y, "add")) goto PANIC;
 				if(esh_push_int(esh, x + y)) goto PANIC;
-			} break;
+			} VM_NEXT();
 			
-			case ESH_INSTR_SUB: {
+			VM_CASE(SUB) {
 				long long x, y;
 				if(int_binop(esh, &x, &y, "sub")) goto PANIC;
 				if(esh_push_int(esh, x - y)) goto PANIC;
-			} break;
+			} VM_NEXT();
 			
-			case ESH_INSTR_MUL: {
+			VM_CASE(MUL) {
 				long long x, y;
 				if(int_binop(esh, &x, &y, "mul")) goto PANIC;
 				if(esh_push_int(esh, x * y)) goto PANIC;
-			} break;
+			} VM_NEXT();
 			
-			case ESH_INSTR_DIV: {
+			VM_CASE(DIV) {
 				long long x, y;
 				if(int_binop(esh, &x, &y, "div")) goto PANIC;
 				
@@ -2272,9 +5016,9 @@ static int run_vm(esh_state *esh, esh_closure *entrypoint) {
 				else res = x / y;
 				
 				if(esh_push_int(esh, res)) goto PANIC;
-			} break;
+			} VM_NEXT();
 			
-			case ESH_INSTR_EQ: {
+			VM_CASE(EQ) {
 				if(opt_req_stack(esh, 2)) {
 					esh_err_printf(esh, "Missing values on stack for equality comparison");
 					goto PANIC;
@@ -2284,9 +5028,9 @@ static int run_vm(esh_state *esh, esh_closure *entrypoint) {
 				
 				esh->current_thread->stack_len -= 2;
 				if(esh_push_bool(esh, equal)) goto PANIC;
-			} break;
+			} VM_NEXT();
 			
-			case ESH_INSTR_NEQ: {
+			VM_CASE(NEQ) {
 				if(opt_req_stack(esh, 2)) {
 					esh_err_printf(esh, "Missing values on stack for equality comparison");
 					goto PANIC;
@@ -2296,105 +5040,133 @@ static int run_vm(esh_state *esh, esh_closure *entrypoint) {
 				
 				esh->current_thread->stack_len -= 2;
 				if(esh_push_bool(esh, !equal)) goto PANIC;
-			} break;
+			} VM_NEXT();
 			
-			case ESH_INSTR_LESS: {
+			VM_CASE(LESS) {
 				long long x, y;
 				if(int_binop(esh, &x, &y, "less")) goto PANIC;
 				if(esh_push_bool(esh, x < y)) goto PANIC;
-			} break;
+			} VM_NEXT();
 			
-			case ESH_INSTR_GREATER: {
+			VM_CASE(GREATER) {
 				long long x, y;
 				if(int_binop(esh, &x, &y, "greater")) goto PANIC;
 				if(esh_push_bool(esh, x > y)) goto PANIC;
-			} break;
+			} VM_NEXT();
 			
-			case ESH_INSTR_NOT: {
+			VM_CASE(NOT) {
 				if(opt_req_stack(esh, 1)) {
 					esh_err_printf(esh, "Missing value on stack for not operation");
 					goto PANIC;
 				}
 				bool b = val_as_bool(&esh->current_thread->stack[--esh->current_thread->stack_len]);
 				if(esh_push_bool(esh, !b)) goto PANIC;
-			} break;
+			} VM_NEXT();
 			
-			case ESH_INSTR_NEW_OBJ: {
-				if(esh_object_of(esh, instr.arg)) goto PANIC;
-			} break;
+			VM_CASE(NEW_OBJ) {
+				if(esh_object_of(esh, instr->arg)) goto PANIC;
+			} VM_NEXT();
 			
-			case ESH_INSTR_MAKE_CONST: {
+			VM_CASE(MAKE_CONST) {
 				if(opt_req_stack(esh, 1)) {
 					esh_err_printf(esh, "Missing value on stack for 'make const' operation");
 					goto PANIC;
 				}
 				esh_object *obj = val_as_object(esh->current_thread->stack[esh->current_thread->stack_len - 1], NULL);
 				if(obj) obj->is_const = true;
-			} break;
+			} VM_NEXT();
 			
-			case ESH_INSTR_INDEX: {
+			VM_CASE(INDEX) {
 				if(opt_req_stack(esh, 2)) {
 					esh_err_printf(esh, "Not enough items on stack for object index operation (%zu/2)", (size_t) stack_size(esh));
 					goto PANIC;
 				}
 				
-				size_t keylen;
-				const char *key = val_as_string(&esh->current_thread->stack[esh->current_thread->stack_len - 1], &keylen);
-				if(!key) {
-					esh_err_printf(esh, "Attempting to index object using non-key value");
+				esh_val res;
+				if(index_val_cached(esh, index_cache(f, instr), esh->current_thread->stack[esh->current_thread->stack_len - 2], esh->current_thread->stack[esh->current_thread->stack_len - 1], &res)) goto PANIC;
+				
+				esh->current_thread->stack_len -= 1;
+				esh->current_thread->stack[esh->current_thread->stack_len - 1] = res;
+			} VM_NEXT();
+			
+			VM_CASE(INDEX_IMM) {
+				if(opt_req_stack(esh, 1)) {
+					esh_err_printf(esh, "Missing value on stack for object index operation");
 					goto PANIC;
 				}
-				esh_object *obj = val_as_object(esh->current_thread->stack[esh->current_thread->stack_len - 2], NULL);
-				
-				esh_val res = NULL;
-				if(obj) {
-					esh_val val;
-					if(esh_object_get(esh, obj, key, keylen, &val)) res = val;
+				if(instr->arg >= f->imms_len) {
+					esh_err_printf(esh, "Immediate index out of bounds (%llu/%llu)", instr->arg, f->imms_len);
+					goto PANIC;
 				}
 				
-				esh->current_thread->stack_len -= 1;
+				esh_val res;
+				if(index_val_cached(esh, index_cache(f, instr), esh->current_thread->stack[esh->current_thread->stack_len - 1], f->imms[instr->arg], &res)) goto PANIC;
 				esh->current_thread->stack[esh->current_thread->stack_len - 1] = res;
-			} break;
+			} VM_NEXT();
 			
-			case ESH_INSTR_SET_INDEX: {
+			VM_CASE(LOAD_INDEX_IMM) {
+				if(instr->l >= f->imms_len) {
+					esh_err_printf(esh, "Immediate index out of bounds (%llu/%llu)", instr->l, f->imms_len);
+					goto PANIC;
+				}
+				
+				esh_val *local = index_local_var(esh, instr->arg, 0, false);
+				if(!local) goto PANIC;
+				
+				esh_val res;
+				if(index_val_cached(esh, index_cache(f, instr), *local, f->imms[instr->l], &res)) goto PANIC;
+				if(stack_push(esh, res)) goto PANIC;
+			} VM_NEXT();
+			
+			VM_CASE(SET_INDEX) {
 				if(opt_req_stack(esh, 3)) {
 					esh_err_printf(esh, "Not enough items on stack for object index operation (%zu/3)", (size_t) stack_size(esh));
 					goto PANIC;
 				}
 				
-				size_t keylen;
-				const char *key = val_as_string(&esh->current_thread->stack[esh->current_thread->stack_len - 2], &keylen);
-				if(!key) {
+				esh_val key = esh->current_thread->stack[esh->current_thread->stack_len - 2];
+				esh_table *obj = val_as_table(esh->current_thread->stack[esh->current_thread->stack_len - 3]);
+				esh_val val = esh->current_thread->stack[esh->current_thread->stack_len - 1];
+				esh_index_cache *cache = index_cache(f, instr);
+				
+				// Stores to existing slots keep the shape, so only those are cached
+				if(obj && obj->shape == cache->shape && obj->shape && key == cache->key && val != ESH_NULL && !obj->obj.is_const) {
+					gc_obj_write_barrier(esh, &obj->obj);
+					obj->slots[cache->slot] = val;
+					esh->current_thread->stack_len -= 3;
+					VM_NEXT();
+				}
+				
+				if(!val_as_string(&key, NULL)) {
 					esh_err_printf(esh, "Attempting to index object using non-key value");
 					goto PANIC;
 				}
-				esh_object *obj = val_as_object(esh->current_thread->stack[esh->current_thread->stack_len - 3], NULL);
 				if(!obj) {
 					esh_err_printf(esh, "Attempting to mutate immutable object");
 					goto PANIC;
 				}
-				esh_val val = esh->current_thread->stack[esh->current_thread->stack_len - 1];
 				
-				gc_obj_write_barrier(esh, obj);
-				if(esh_object_set(esh, obj, key, keylen, val)) goto PANIC;
+				gc_obj_write_barrier(esh, &obj->obj);
+				if(object_set_val(esh, obj, key, val)) goto PANIC;
+				if(val != ESH_NULL) fill_index_cache(esh, cache, obj, key);
 				
 				esh->current_thread->stack_len -= 3;
-			} break;
+			} VM_NEXT();
 			
-			case ESH_INSTR_UNPACK: {
-				if(unpack_obj(esh, instr.arg)) goto PANIC;
-			} break;
+			VM_CASE(UNPACK) {
+				if(unpack_obj(esh, instr->arg)) goto PANIC;
+			} VM_NEXT();
 			
-			case ESH_INSTR_CONCAT: {
-				if(opt_req_stack(esh, instr.arg)) {
-					esh_err_printf(esh, "Not enough items on stack for concat operation (%zu/%zu)", (size_t) stack_size(esh), (size_t) instr.arg);
+			VM_CASE(CONCAT) {
+				if(opt_req_stack(esh, instr->arg)) {
+					esh_err_printf(esh, "Not enough items on stack for concat operation (%zu/%zu)", (size_t) stack_size(esh), (size_t) instr->arg);
 					goto PANIC;
 				}
 				
 				esh_str_buff_begin(esh);
-				for(size_t i = 0; i < instr.arg; i++) {
+				for(size_t i = 0; i < instr->arg; i++) {
 					size_t len;
-					const char *str = val_as_string(&esh->current_thread->stack[esh->current_thread->stack_len - instr.arg + i], &len);
+					const char *str = val_as_string(&esh->current_thread->stack[esh->current_thread->stack_len - instr->arg + i], &len);
 					if(!str) {
 						esh_err_printf(esh, "Attempting to concatenate non-string value");
 						goto PANIC;
@@ -2402,20 +5174,22 @@ static int run_vm(esh_state *esh, esh_closure *entrypoint) {
 					if(esh_str_buff_appends(esh, str, len)) goto PANIC;
 				}
 				
-				esh->current_thread->stack_len -= instr.arg;
+				esh->current_thread->stack_len -= instr->arg;
 				
 				size_t len;
 				char *str = esh_str_buff(esh, &len);
 				if(esh_new_string(esh, str, len)) goto PANIC;
-			} break;
+			} VM_NEXT();
 			
-			default:
-				esh_err_printf(esh, "Unknown instruction (%u)", (unsigned) instr.op);
+			VM_CASE(NULL)
+			VM_CASE(LESS_EQ)
+			VM_CASE(GREATER_EQ)
+			VM_DEFAULT
+				esh_err_printf(esh, "Unknown instruction (%u)", (unsigned) instr->op);
 				goto PANIC;
+		#ifndef ESH_THREADED_DISPATCH
 		}
-		
-		esh->current_thread->current_frame.instr_index++;
-		continue;
+		#endif
 		
 		PANIC: {
 			free_stack_frame(esh, &esh->current_thread->current_frame);
@@ -2451,6 +5225,10 @@ static int run_vm(esh_state *esh, esh_closure *entrypoint) {
 	return 0;
 }
 
+#ifdef ESH_THREADED_DISPATCH
+#pragma GCC diagnostic pop
+#endif
+
 int esh_exec_fn(esh_state *esh) {
 	esh_free(esh, esh->stack_trace);
 	esh->stack_trace = NULL;
@@ -39,22 +39,43 @@ typedef struct esh_type {
 	const char *name;
 	void (*on_free)(esh_state *esh, void *obj);
 	int (*next)(esh_state *esh, void *obj, size_t size_hint);
+	size_t n_refs; // Number of values, laid out right after the object header, that the object keeps alive
 } esh_type;
 
 void *esh_as_type(esh_state *esh, long long offset, const esh_type *type);
+int esh_set_ref(esh_state *esh, void *obj, size_t i, long long offset);
+int esh_push_ref(esh_state *esh, void *obj, size_t i);
 
 typedef struct esh_object_entry esh_object_entry;
 
+// Header of every value on the heap
 typedef struct esh_object {
-	struct esh_object *next, *prev;
+	struct esh_object *next; // In the young generation, or in the list of large old objects
 	unsigned char gc_tag;
+	unsigned char gc_gen; // Generation flags, see esh_gc
+	unsigned char pool_class; // Size class of the slab holding the object, or 0 if it was allocated on its own
+	bool is_const;
 	
 	esh_type *type;
+} esh_object;
+
+// Plain objects (with a NULL type) are the only values that hold entries
+typedef struct esh_table {
+	esh_object obj;
 	
-	bool is_const;
-	size_t len, cap;
+	size_t len; // Total number of entries, including the array part
+	size_t entries_len, cap;
+	size_t entries_used; // Live entries and tombstones in the entries table
 	struct esh_object_entry *entries;
-} esh_object;
+	
+	// Dense array part, holding the values for the keys 0..array_len-1. Unset keys within it are ESH_NULL
+	void **array;
+	size_t array_len, array_cap;
+	
+	// Objects without an entries table hold their other entries in slots, laid out by a shared shape
+	struct esh_shape *shape;
+	void **slots;
+} esh_table;
 
 // VM
 
@@ -101,7 +122,17 @@ typedef struct esh_object {
 	X(UNPACK) \
 	X(PROP) \
 	\
-	X(CONCAT)
+	X(CONCAT) \
+	\
+	/* Superinstructions, only produced by the optimizer in esh_fn_finalize */ \
+	X(INC_LOCAL) \
+	X(CALL_UNPACK) \
+	X(CMP_JMP) \
+	X(JMP_IF_OR_POP) \
+	X(JMP_IFN_OR_POP) \
+	X(IMM_SWAP) \
+	X(INDEX_IMM) \
+	X(LOAD_INDEX_IMM)
 
 typedef enum esh_opcode {
 	#define X(op) ESH_INSTR_##op,
@@ -111,11 +142,13 @@ typedef enum esh_opcode {
 
 int esh_new_fn(esh_state *esh, const char *name, size_t name_len);
 int esh_fn_append_instr(esh_state *esh, esh_opcode op, uint64_t arg, uint64_t l);
-int esh_fn_finalize(esh_state *esh, size_t n_args, size_t opt_args, size_t n_locals, bool upval_locals, bool make_closure);
+int esh_fn_finalize(esh_state *esh, size_t n_args, size_t opt_args, size_t n_locals, bool upval_locals, const bool *captured, bool make_closure);
 int esh_fn_add_imm(esh_state *esh, uint64_t *out_ref);
 int esh_fn_new_label(esh_state *esh, uint64_t *out_ref);
 int esh_fn_put_label(esh_state *esh, uint64_t label);
 int esh_fn_line_directive(esh_state *esh, size_t line);
+int esh_fn_try_fold(esh_state *esh, esh_opcode op, uint64_t arg, bool *out_folded);
+int esh_fn_append_ret(esh_state *esh, uint64_t n); // Marks the return of a call's result as a tail call
 int esh_new_string(esh_state *esh, const char *str, size_t len);
 void *esh_new_object(esh_state *esh, size_t s, esh_type *type);
 int esh_object_of(esh_state *esh, size_t n);
@@ -154,18 +187,32 @@ typedef struct esh_fn_result {
 #define ESH_FN_YIELD_LAST(n_vals, n_res) (esh_fn_result) { 7, n_vals, n_res }
 
 int esh_new_c_fn(esh_state *esh, const char *name, esh_fn_result (*f)(esh_state *, size_t, size_t), size_t n_args, size_t opt_args, bool variadic);
+int esh_new_c_leaf_fn(esh_state *esh, const char *name, esh_fn_result (*f)(esh_state *, size_t, size_t), size_t n_args, size_t opt_args, bool variadic); // For functions that only ever return ESH_FN_RETURN or ESH_FN_ERR and don't use esh_locals; they're run directly on the caller's stack, without a stack frame of their own
 
 int esh_set_global(esh_state *esh, const char *name);
 int esh_get_global(esh_state *esh, const char *name);
 
+typedef enum esh_gc_mode {
+	ESH_GC_MODE_COUNT, // Collect every gc_freq allocations, and run gc_step_size steps of major cycles
+	ESH_GC_MODE_BYTES, // Collect every time the nursery size was allocated, and run steps in proportion to the allocated bytes
+	ESH_GC_MODE_ADAPTIVE, // Same as ESH_GC_MODE_BYTES, tuning the nursery size, step multiplier and pause from survival rates and pause times
+	ESH_GC_MODE_CONCURRENT, // Same as ESH_GC_MODE_BYTES, with major cycles marked and swept by a helper thread (unless built with NO_THREADS)
+} esh_gc_mode;
+
 void esh_gc(esh_state *esh, size_t n);
-void esh_gc_conf(esh_state *esh, int gc_freq, int gc_step_size);
+void esh_gc_minor(esh_state *esh); // Only collects the young generation, which is far cheaper than a major cycle
+void esh_gc_conf(esh_state *esh, int gc_freq, int gc_step_size); // Also switches to ESH_GC_MODE_COUNT if gc_freq is given
+void esh_gc_pacing_conf(esh_state *esh, int mode, long long nursery_size, int pause, int step_mul);
+void esh_gc_trace(esh_state *esh, bool trace); // Logs a line to stderr at the end of every major cycle
+int esh_gc_stats(esh_state *esh); // Pushes an object with the GC counters and the live objects of each type
+void esh_opt_conf(esh_state *esh, int peephole);
 
 typedef struct esh_iterator {
 	bool done;
 	long long step;
 	
 	size_t index;
+	bool in_table;
 } esh_iterator;
 
 esh_iterator esh_iter_begin(esh_state *esh);
@@ -197,9 +244,22 @@ typedef void *esh_val;
 
 #define ESH_NULL (NULL)
 
+// Values with the lowest bit set are short strings stored inline, values tagged with 0b10 are immediate integers
+#define ESH_INT_TAG ((uintptr_t) 2)
+#define ESH_INT_MAX (INTPTR_MAX / 4)
+#define ESH_INT_MIN (INTPTR_MIN / 4)
+
+#define esh_val_is_int(val) (((uintptr_t) (val) & 3) == ESH_INT_TAG)
+#define esh_val_from_int(i) ((esh_val) (((uintptr_t) (intptr_t) (i) << 2) | ESH_INT_TAG))
+#define esh_val_to_int(val) ((intptr_t) ((uintptr_t) (val) & ~(uintptr_t) 3) / 4)
+
+// The tag byte of short strings also holds their length
+#define esh_val_is_short_str(val) (((uintptr_t) (val) & 1) != 0)
+#define esh_short_str_len(val) ((size_t) (((uintptr_t) (val) >> 1) & 0x7F))
+
+// Object keys are strings, either short strings or interned string objects, so that equal keys are always the same value
 struct esh_object_entry {
-	char *key;
-	size_t keylen;
+	esh_val key;
 	esh_val val;
 	bool deleted;
 };
@@ -217,6 +277,29 @@ typedef struct esh_fn_line_dir {
 	size_t line;
 } esh_fn_line_dir;
 
+// Inline cache for global lookups, used by LOAD_G, STORE_G and CMD. An entry is only valid while its version matches the globals version of the state
+typedef struct esh_global_cache {
+	size_t version;
+	esh_val key;
+	esh_object_entry *entry;
+} esh_global_cache;
+
+// Inline cache for INDEX, INDEX_IMM, LOAD_INDEX_IMM and SET_INDEX, valid for objects with the given shape when indexed by the same key
+typedef struct esh_index_cache {
+	struct esh_shape *shape;
+	esh_val key;
+	size_t slot;
+} esh_index_cache;
+
+// Instructions are decoded once, when the function is finalized
+typedef struct esh_instr {
+	const void *handler; // Address of the instruction handler, when built with threaded dispatch
+	uint16_t arg;
+	uint8_t l;
+	uint8_t op;
+	uint32_t ext; // Resolved jump destination, or the index of the inline cache of the instruction
+} esh_instr;
+
 typedef struct esh_function {
 	esh_object obj;
 	
@@ -234,23 +317,52 @@ typedef struct esh_function {
 	uint8_t *instr;
 	size_t instr_len, instr_cap;
 	
+	esh_instr *code;
+	size_t code_len;
+	
 	esh_fn_line_dir *line_dirs;
 	size_t line_dirs_len, line_dirs_cap;
 	
+	esh_global_cache *global_caches;
+	size_t n_global_caches;
+	
+	esh_index_cache *index_caches;
+	size_t n_index_caches;
+	
 	char *name;
 	
 	bool upval_locals;
+	bool *captured; // With upval_locals, which of the n_locals live in the environment instead of on the stack
+	size_t n_env_locals;
 	
 	esh_fn_result (*c_fn)(esh_state *, size_t, size_t);
+	bool is_leaf; // See esh_new_c_leaf_fn
 } esh_function;
 
 typedef struct esh_string {
 	esh_object obj;
 	
 	size_t len;
+	size_t hash;
+	bool interned;
 	char str[];
 } esh_string;
 
+// Objects that get the same keys in the same order share a shape, which maps each key to a slot. Shapes form a tree of transitions, starting at the root shape of the state
+#define ESH_SHAPE_MAX_SLOTS 32
+
+typedef struct esh_shape {
+	esh_object obj;
+	
+	struct esh_shape *parent;
+	
+	size_t n_slots;
+	esh_val *keys; // Key of each slot. The last one is the key added by this shape
+	
+	struct esh_shape **children; // Weak, children remove themselves when freed
+	size_t children_len, children_cap;
+} esh_shape;
+
 typedef struct esh_env {
 	esh_object obj;
 	
@@ -264,6 +376,7 @@ typedef struct esh_closure {
 	esh_object obj;
 	
 	bool is_coroutine;
+	bool is_shared; // Created once as an immediate of the enclosing function, and handed out by CLOSURE until it's turned into a coroutine
 	
 	esh_function *fn;
 	esh_env *env;
@@ -291,8 +404,41 @@ typedef struct esh_co_thread {
 	size_t stack_len, stack_cap;
 	
 	bool is_done;
+	
+	esh_val inline_stack[]; // Small coroutines start out with their stack in the object itself, see ESH_CO_INLINE_STACK
 } esh_co_thread;
 
+#define ESH_CO_INLINE_STACK 24 // Coroutines needing at most this many stack slots at creation keep them in the object
+#define ESH_CO_POOL_MAX 16 // Number of stacks and of frame arrays of finished coroutines kept for reuse
+
+typedef struct esh_pooled_buff {
+	void *p;
+	size_t cap;
+} esh_pooled_buff;
+
+// Allocations of up to ESH_POOL_MAX bytes are served from slabs, in size classes of 16 bytes
+#define ESH_POOL_MAX 512
+#define ESH_POOL_N_CLASSES (ESH_POOL_MAX / 16)
+
+typedef enum esh_gc_phase {
+	ESH_GC_IDLE,
+	ESH_GC_MARKING,
+	ESH_GC_SWEEPING
+} esh_gc_phase;
+
+// Stack of objects for the GC, grown without running the GC
+typedef struct esh_obj_stack {
+	esh_object **objs;
+	size_t len, cap;
+	bool overflow; // An object could not be pushed
+} esh_obj_stack;
+
+// The hash is kept next to the string pointer, so that probing doesn't have to load every string it passes
+typedef struct esh_intern_entry {
+	size_t hash;
+	esh_string *str;
+} esh_intern_entry;
+
 struct esh_state {
 	void *(*realloc)(void *, size_t);
 	
@@ -313,22 +459,87 @@ struct esh_state {
 	size_t threads_len, threads_cap;
 	esh_co_thread *current_thread;
 	
-	esh_object *objects;
-	esh_object *visited, *to_visit;
+	esh_pooled_buff co_stacks[ESH_CO_POOL_MAX];
+	size_t co_stacks_len;
+	esh_pooled_buff co_frames[ESH_CO_POOL_MAX];
+	size_t co_frames_len;
+	
+	// Old generation. Objects allocated from slabs are tracked by the bitmaps of their slab, larger ones are kept in a list
+	esh_object *large;
+	esh_gc_phase gc_phase;
+	esh_obj_stack gray;
+	size_t gc_cycle; // Number of major cycles that reached their sweep
+	struct esh_arena *sweep_arena;
+	size_t sweep_slab;
+	size_t old_bytes, old_threshold; // A major cycle is started once the old generation holds old_threshold bytes
 	
-	esh_object *globals;
+	// Concurrent major cycles, see gc_safepoint
+	struct esh_gc_worker *gc_worker; // Helper thread, started by the first concurrent cycle
+	bool gc_satb; // The current cycle traces objects before they are written to, rather than after
+	bool gc_safepoint; // A cycle is waiting to be handed over to the worker
+	bool gc_worker_marking, gc_worker_sweeping; // Jobs that the worker may be running, until gc_worker_stop
+	
+	// Young generation, which holds the objects allocated since the last minor collection
+	esh_object *young;
+	esh_obj_stack young_gray;
+	
+	// Objects that may reference young objects, and which are traced by the next minor collection
+	esh_obj_stack remembered;
+	
+	// Slab allocator, see esh_pool_alloc
+	struct esh_slab *pool_slabs[ESH_POOL_N_CLASSES + 1]; // Slabs of each size class that have free blocks
+	struct esh_arena *pool_arenas;
+	
+	// Weak set of interned strings (open addressing, the capacity is a power of two). Strings are removed from it when they are freed
+	esh_intern_entry *interned;
+	size_t interned_len, interned_cap;
+	
+	esh_shape *root_shape;
+	
+	esh_table *globals;
+	size_t globals_version; // Incremented whenever entries of the globals table may have moved or been deleted
 	
 	esh_val cmd;
 	
+	bool peephole; // Whether esh_fn_finalize runs the peephole optimizer
+	
+	// GC pacing, see inc_gc
+	esh_gc_mode gc_mode;
 	size_t alloc_step;
-	int gc_freq;
+	int gc_freq; // 0 disables the GC
 	unsigned gc_step_size;
+	size_t gc_debt; // Bytes allocated since the last minor collection
+	size_t gc_nursery;
+	unsigned gc_pause; // Percentage of the live old generation after a major cycle at which the next one starts
+	unsigned gc_step_mul; // Percentage of the allocated bytes the major cycle works through in each step
+	size_t gc_cycle_start_bytes;
+	
+	// GC statistics, see esh_gc_stats. Pauses are in nanoseconds of the main thread
+	bool gc_trace;
+	size_t gc_n_minor;
+	uint64_t gc_pause_total, gc_pause_max;
+	size_t gc_freed_objects, gc_freed_bytes;
+	size_t gc_allocated; // Bytes allocated up to the last paced collection, the ones since are in gc_debt
+	uint64_t gc_open_time;
+	size_t gc_trace_minors, gc_trace_freed; // Counters at the end of the last major cycle, the trace logs the difference
+	uint64_t gc_trace_pause, gc_trace_max_pause;
 	
 	char *str_buff;
 	size_t str_buff_len;
 	size_t str_buff_cap;
 };
 
+void *esh_pool_alloc(esh_state *esh, size_t n);
+void *esh_pool_realloc(esh_state *esh, void *p, size_t old_n, size_t n);
+void esh_pool_free(esh_state *esh, void *p, size_t n);
+void esh_pool_free_small(esh_state *esh, void *p);
+
+esh_val esh_intern(esh_state *esh, const char *str, size_t len);
+esh_val esh_intern_val(esh_state *esh, esh_val str);
+esh_val esh_intern_find(esh_state *esh, const char *str, size_t len);
+
+esh_shape *esh_shape_add(esh_state *esh, esh_shape *shape, esh_val key);
+
 #undef INCLUDE_PRIVATE_API
 
 #endif
@@ -45,6 +45,7 @@ typedef enum token_type {
 	TOK_COMMA,
 	
 	TOK_COLON,
+	TOK_RANGE,
 	
 	TOK_PIPE,
 	
@@ -129,6 +130,8 @@ static const char *tok_name(token_type type) {
 		
 		case TOK_COLON:
 			return "':'";
+		case TOK_RANGE:
+			return "'..'";
 		
 		case TOK_PIPE:
 			return "'|'";
@@ -167,16 +170,39 @@ typedef struct lex_token {
 	size_t line;
 } lex_token;
 
+// Immediates already added to a function, keyed by the string (or integer) they were compiled from
+typedef struct imm_entry {
+	const char *str; // NULL for integers and empty entries
+	size_t len;
+	long long i;
+	bool is_int;
+	uint64_t ref;
+} imm_entry;
+
 typedef struct fn_scope {
 	size_t block_scopes_base;
 	size_t n_locals;
 	bool upval_locals;
+	bool free_vars; // References locals of enclosing functions, so its closures need an environment
+	
+	imm_entry *imms; // Open addressing, at most half full
+	size_t imms_len, imms_cap;
 } fn_scope;
 
+typedef struct captured_local {
+	size_t fn_scope; // The function scope the local belongs to
+	uint64_t index;
+} captured_local;
+
 typedef struct block_scope {
 	size_t locals_base;
 } block_scope;
 
+typedef struct loop_scope {
+	size_t fn_scope; // The function scope the loop belongs to
+	uint64_t break_label, continue_label;
+} loop_scope;
+
 typedef struct local_var {
 	const char *name;
 	size_t name_len;
@@ -185,6 +211,19 @@ typedef struct local_var {
 	bool is_const;
 } local_var;
 
+// Memory of the compiler is taken from blocks that are all freed once compilation ends
+typedef struct arena_block {
+	struct arena_block *prev;
+	size_t size, used;
+	union {
+		long double align_ld;
+		void *align_p;
+	} data[];
+} arena_block;
+
+#define ARENA_BLOCK_SIZE 16384
+#define ARENA_ALIGN(n) (((n) + 15) & ~(size_t) 15)
+
 typedef struct compile_ctx {
 	const char *src, *src_name;
 	const char *at, *end;
@@ -193,15 +232,27 @@ typedef struct compile_ctx {
 	lex_token next_token;
 	lex_token pushed_token;
 	
+	arena_block *arena;
+	void *arena_last; // Most recent allocation, which can grow in place
+	
 	fn_scope *fn_scopes;
 	size_t fn_scopes_len, fn_scopes_cap;
 	
+	captured_local *captures; // Locals referenced from nested functions, of the function scopes that are still open
+	size_t captures_len, captures_cap;
+	
+	bool *captured; // Which locals of the function scope that was left last are captured
+	size_t captured_cap;
+	
 	block_scope *block_scopes;
 	size_t block_scopes_len, block_scopes_cap;
 	
 	local_var *locals;
 	size_t locals_len, locals_cap;
 	
+	loop_scope *loops;
+	size_t loops_len, loops_cap;
+	
 	lex_token *token_stack;
 	size_t token_stack_len, token_stack_cap;
 	
@@ -211,6 +262,7 @@ typedef struct compile_ctx {
 	size_t str_buff_len, str_buff_cap;
 	
 	bool lex_next_as_string;
+	bool lex_range; // Whether ".." is lexed as a separate token, rather than as part of a word
 } compile_ctx;
 
 static char err_buff[512];
@@ -288,15 +340,61 @@ static void compile_err(esh_state *esh, compile_ctx *ctx, const char *msg, const
 	throw_err(ctx);
 }
 
-static void str_buff_append(esh_state *esh, compile_ctx *ctx, char c) {
-	if(ctx->str_buff_len == ctx->str_buff_cap) {
-		size_t new_cap = ctx->str_buff_cap * 3 / 2 + 1;
-		char *new_buff = esh_realloc(esh, ctx->str_buff, sizeof(char) * new_cap);
-		if(!new_buff) {
-			esh_err_printf(esh, "Unable to grow compiler string buffer (out of memory?)");
+// ARENA
+
+static void *arena_alloc(esh_state *esh, compile_ctx *ctx, size_t n) {
+	n = ARENA_ALIGN(n);
+	
+	arena_block *block = ctx->arena;
+	if(!block || block->size - block->used < n) {
+		size_t size = n > ARENA_BLOCK_SIZE? n : ARENA_BLOCK_SIZE;
+		block = esh_alloc(esh, sizeof(arena_block) + size);
+		if(!block) {
+			esh_err_printf(esh, "Unable to allocate compiler memory (out of memory?)");
 			throw_err(ctx);
 		}
 		
+		block->prev = ctx->arena;
+		block->size = size;
+		block->used = 0;
+		ctx->arena = block;
+	}
+	
+	void *p = (char *) block->data + block->used;
+	block->used += n;
+	ctx->arena_last = p;
+	return p;
+}
+
+// The buffers of the compiler grow geometrically, so the copies left behind add up to at most a few times their final size
+static void *arena_grow(esh_state *esh, compile_ctx *ctx, void *p, size_t old_n, size_t n) {
+	arena_block *block = ctx->arena;
+	if(p != NULL && p == ctx->arena_last) {
+		size_t offset = (char *) p - (char *) block->data;
+		if(block->size - offset >= ARENA_ALIGN(n)) {
+			block->used = offset + ARENA_ALIGN(n);
+			return p;
+		}
+	}
+	
+	void *new_p = arena_alloc(esh, ctx, n);
+	if(old_n != 0) memcpy(new_p, p, old_n);
+	return new_p;
+}
+
+static void arena_free(esh_state *esh, compile_ctx *ctx) {
+	while(ctx->arena) {
+		arena_block *prev = ctx->arena->prev;
+		esh_free(esh, ctx->arena);
+		ctx->arena = prev;
+	}
+	ctx->arena_last = NULL;
+}
+
+static void str_buff_append(esh_state *esh, compile_ctx *ctx, char c) {
+	if(ctx->str_buff_len == ctx->str_buff_cap) {
+		size_t new_cap = ctx->str_buff_cap * 3 / 2 + 1;
+		char *new_buff = arena_grow(esh, ctx, ctx->str_buff, sizeof(char) * ctx->str_buff_cap, sizeof(char) * new_cap);
 		ctx->str_buff = new_buff;
 		ctx->str_buff_cap = new_cap;
 	}
@@ -517,7 +615,10 @@ static void next_token(esh_state *esh, compile_ctx *ctx) {
 
 	token_type char_tok = TOK_NULL;
 
-	if(c == '!') {
+	if(ctx->lex_range && c == '.' && peekc(ctx) == '.') {
+		popc(ctx);
+		char_tok = TOK_RANGE;
+	} else if(c == '!') {
 		if(peekc(ctx) == '=') {
 			popc(ctx);
 			char_tok = TOK_NEQUALS;
@@ -552,6 +653,7 @@ static void next_token(esh_state *esh, compile_ctx *ctx) {
 	}
 	
 	while(is_word_char(peekc(ctx))) {
+		if(ctx->lex_range && ctx->end - ctx->at >= 2 && ctx->at[0] == '.' && ctx->at[1] == '.') break;
 		popc(ctx);
 	}
 	
@@ -629,6 +731,32 @@ static bool next_is_newline(esh_state *esh, compile_ctx *ctx) {
 	return peek_token(esh, ctx).newline;
 }
 
+// Allows looking further ahead than the next token, by lexing ahead and restoring the lexer state afterwards
+typedef struct lex_state {
+	const char *at;
+	size_t line_counter;
+	lex_token next_token;
+	lex_token pushed_token;
+} lex_state;
+
+static lex_state lex_save(compile_ctx *ctx) {
+	assert(!ctx->lex_next_as_string);
+	return (lex_state) { .at = ctx->at, .line_counter = ctx->line_counter, .next_token = ctx->next_token, .pushed_token = ctx->pushed_token };
+}
+
+static void lex_restore(compile_ctx *ctx, lex_state state) {
+	ctx->at = state.at;
+	ctx->line_counter = state.line_counter;
+	ctx->next_token = state.next_token;
+	ctx->pushed_token = state.pushed_token;
+}
+
+// Matches words used as keywords only in certain positions (e.g 'while', 'for' and 'in'), so that they can still be used as command names elsewhere
+static bool is_ctx_keyword(lex_token tok, const char *keyword) {
+	size_t len = strlen(keyword);
+	return tok.type == TOK_WORD && tok.strlen == len && memcmp(tok.str, keyword, len) == 0;
+}
+
 // Compiler/parser
 
 /*
@@ -642,6 +770,9 @@ static bool next_is_newline(esh_state *esh, compile_ctx *ctx) {
 		'return' EXPR
 		'if' EXPR 'then' STATEMENT* ('else' 'if' EXPR 'then' STATEMENT*) ('else' STATEMENT*)? 'end'
 		'function' WORD with word* ('do' STATEMENT* 'end') | ('(' EXPR ')')
+		'while' EXPR 'do' STATEMENT* 'end'
+		'for' WORD 'in' EXPR '..' EXPR 'do' STATEMENT* 'end'
+		'break' | 'continue' # Only within loops
 	
 	DECLARATION =
 		'local' WORD '=' EXPR
@@ -702,12 +833,7 @@ static bool next_is_newline(esh_state *esh, compile_ctx *ctx) {
 static void token_stack_push(esh_state *esh, compile_ctx *ctx, lex_token token) {
 	if(ctx->token_stack_len == ctx->token_stack_cap) {
 		size_t new_cap = ctx->token_stack_cap * 3 / 2 + 1;
-		lex_token *new_buff = esh_realloc(esh, ctx->token_stack, sizeof(lex_token) * new_cap);
-		if(new_buff == NULL) {
-			esh_err_printf(esh, "Unable to reserve space on block scope stack (out of memory?)");
-			throw_err(ctx);
-		}
-		
+		lex_token *new_buff = arena_grow(esh, ctx, ctx->token_stack, sizeof(lex_token) * ctx->token_stack_cap, sizeof(lex_token) * new_cap);
 		ctx->token_stack_cap = new_cap;
 		ctx->token_stack = new_buff;
 	}
@@ -725,12 +851,7 @@ static lex_token *token_stack_pop(esh_state *esh, compile_ctx *ctx, size_t n) {
 static void new_block_scope(esh_state *esh, compile_ctx *ctx) {
 	if(ctx->block_scopes_len == ctx->block_scopes_cap) {
 		size_t new_cap = ctx->block_scopes_cap * 3 / 2 + 1;
-		block_scope *new_buff = esh_realloc(esh, ctx->block_scopes, sizeof(block_scope) * new_cap);
-		if(new_buff == NULL) {
-			esh_err_printf(esh, "Unable to reserve space on block scope stack (out of memory?)");
-			throw_err(ctx);
-		}
-		
+		block_scope *new_buff = arena_grow(esh, ctx, ctx->block_scopes, sizeof(block_scope) * ctx->block_scopes_cap, sizeof(block_scope) * new_cap);
 		ctx->block_scopes_cap = new_cap;
 		ctx->block_scopes = new_buff;
 	}
@@ -741,17 +862,12 @@ static void new_block_scope(esh_state *esh, compile_ctx *ctx) {
 static void new_fn_scope(esh_state *esh, compile_ctx *ctx) {
 	if(ctx->fn_scopes_len == ctx->fn_scopes_cap) {
 		size_t new_cap = ctx->fn_scopes_cap * 3 / 2 + 1;
-		fn_scope *new_buff = esh_realloc(esh, ctx->fn_scopes, sizeof(fn_scope) * new_cap);
-		if(new_buff == NULL) {
-			esh_err_printf(esh, "Unable to reserve space on function scope stack (out of memory?)");
-			throw_err(ctx);
-		}
-		
+		fn_scope *new_buff = arena_grow(esh, ctx, ctx->fn_scopes, sizeof(fn_scope) * ctx->fn_scopes_cap, sizeof(fn_scope) * new_cap);
 		ctx->fn_scopes_cap = new_cap;
 		ctx->fn_scopes = new_buff;
 	}
 	
-	ctx->fn_scopes[ctx->fn_scopes_len++] = (fn_scope) { .n_locals = 0, .upval_locals = false, .block_scopes_base = ctx->block_scopes_len };
+	ctx->fn_scopes[ctx->fn_scopes_len++] = (fn_scope) { .n_locals = 0, .upval_locals = false, .free_vars = false, .block_scopes_base = ctx->block_scopes_len, .imms = NULL, .imms_len = 0, .imms_cap = 0 };
 	new_block_scope(esh, ctx);
 }
 
@@ -797,12 +913,7 @@ static size_t new_local(esh_state *esh, compile_ctx *ctx, lex_token word, bool i
 	assert(ctx->fn_scopes_len != 0);
 	if(ctx->locals_len == ctx->locals_cap) {
 		size_t new_cap = ctx->locals_cap * 3 / 2 + 1;
-		local_var *new_buff = esh_realloc(esh, ctx->locals, sizeof(local_var) * new_cap);
-		if(new_buff == NULL) {
-			esh_err_printf(esh, "Unable to reserve space on locals stack (out of memory?)");
-			throw_err(ctx);
-		}
-		
+		local_var *new_buff = arena_grow(esh, ctx, ctx->locals, sizeof(local_var) * ctx->locals_cap, sizeof(local_var) * new_cap);
 		ctx->locals_cap = new_cap;
 		ctx->locals = new_buff;
 	}
@@ -812,14 +923,28 @@ static size_t new_local(esh_state *esh, compile_ctx *ctx, lex_token word, bool i
 	return index;
 }
 
-static void upval_locals(compile_ctx *ctx, size_t n) {
-	assert(n + 1 <= ctx->fn_scopes_len);
-	for(size_t i = 0; i < n; i++) {
+// Only captured locals are moved into the environment of the function that declares them; the functions in between still need an environment to link to it
+static void capture_local(esh_state *esh, compile_ctx *ctx, uint64_t index, size_t uplevel) {
+	if(uplevel == 0) return;
+	
+	assert(uplevel + 1 <= ctx->fn_scopes_len);
+	for(size_t i = 0; i < uplevel; i++) {
+		ctx->fn_scopes[ctx->fn_scopes_len - 1 - i].free_vars = true;
 		ctx->fn_scopes[ctx->fn_scopes_len - 2 - i].upval_locals = true;
 	}
+	
+	if(ctx->captures_len == ctx->captures_cap) {
+		size_t new_cap = ctx->captures_cap * 3 / 2 + 1;
+		captured_local *new_buff = arena_grow(esh, ctx, ctx->captures, sizeof(captured_local) * ctx->captures_cap, sizeof(captured_local) * new_cap);
+		ctx->captures_cap = new_cap;
+		ctx->captures = new_buff;
+	}
+	
+	ctx->captures[ctx->captures_len++] = (captured_local) { .fn_scope = ctx->fn_scopes_len - 1 - uplevel, .index = index };
 }
 
-static void leave_fn_scope(compile_ctx *ctx, size_t *n_locals, bool *upval_locals) {
+// The captured locals are left in ctx->captured
+static void leave_fn_scope(esh_state *esh, compile_ctx *ctx, size_t *n_locals, bool *upval_locals, bool *free_vars) {
 	assert(ctx->fn_scopes_len != 0);
 	assert(ctx->block_scopes_len != 0);
 	
@@ -833,6 +958,26 @@ static void leave_fn_scope(compile_ctx *ctx, size_t *n_locals, bool *upval_local
 	
 	*n_locals = scope.n_locals;
 	*upval_locals = scope.upval_locals;
+	*free_vars = scope.free_vars;
+	
+	if(ctx->captured_cap < scope.n_locals) {
+		bool *new_buff = arena_grow(esh, ctx, ctx->captured, sizeof(bool) * ctx->captured_cap, sizeof(bool) * scope.n_locals);
+		ctx->captured_cap = scope.n_locals;
+		ctx->captured = new_buff;
+	}
+	for(size_t i = 0; i < scope.n_locals; i++) ctx->captured[i] = false;
+	
+	size_t kept = 0;
+	for(size_t i = 0; i < ctx->captures_len; i++) {
+		captured_local capture = ctx->captures[i];
+		if(capture.fn_scope == ctx->fn_scopes_len) {
+			assert(capture.index < scope.n_locals);
+			ctx->captured[capture.index] = true;
+		} else {
+			ctx->captures[kept++] = capture;
+		}
+	}
+	ctx->captures_len = kept;
 }
 
 static void leave_block_scope(compile_ctx *ctx) {
@@ -862,6 +1007,63 @@ static bool is_start_of_term(token_type tok) {
 	}
 }
 
+// IMMEDIATES
+// The same name or literal shares a single immediate within a function, so only its first occurrence creates a value
+
+static size_t imm_hash(const imm_entry *key) {
+	uint64_t h = 14695981039346656037ull; // FNV-1a
+	if(key->is_int) {
+		h = (h ^ (uint64_t) key->i) * 1099511628211ull;
+	} else {
+		for(size_t i = 0; i < key->len; i++) h = (h ^ (unsigned char) key->str[i]) * 1099511628211ull;
+	}
+	return h ^ (h >> 32);
+}
+
+static imm_entry *imm_probe(imm_entry *imms, size_t cap, const imm_entry *key) {
+	size_t mask = cap - 1;
+	for(size_t i = imm_hash(key) & mask;; i = (i + 1) & mask) {
+		imm_entry *entry = &imms[i];
+		if(!entry->str && !entry->is_int) return entry;
+		if(entry->is_int != key->is_int) continue;
+		
+		if(key->is_int? entry->i == key->i : entry->len == key->len && memcmp(entry->str, key->str, sizeof(char) * key->len) == 0) return entry;
+	}
+}
+
+// Returns the entry of the key in the current function; if it's empty, the caller adds the immediate and fills it in
+static imm_entry *find_imm(esh_state *esh, compile_ctx *ctx, const imm_entry *key) {
+	fn_scope *scope = &ctx->fn_scopes[ctx->fn_scopes_len - 1];
+	if((scope->imms_len + 1) * 2 > scope->imms_cap) {
+		size_t new_cap = scope->imms_cap == 0? 16 : scope->imms_cap * 2;
+		imm_entry *new_imms = arena_alloc(esh, ctx, sizeof(imm_entry) * new_cap);
+		for(size_t i = 0; i < new_cap; i++) new_imms[i] = (imm_entry) { .str = NULL, .is_int = false };
+		
+		for(size_t i = 0; i < scope->imms_cap; i++) {
+			imm_entry *entry = &scope->imms[i];
+			if(entry->str || entry->is_int) *imm_probe(new_imms, new_cap, entry) = *entry;
+		}
+		
+		scope->imms = new_imms;
+		scope->imms_cap = new_cap;
+	}
+	
+	imm_entry *entry = imm_probe(scope->imms, scope->imms_cap, key);
+	if(!entry->str && !entry->is_int) scope->imms_len++;
+	return entry;
+}
+
+static uint64_t add_int_imm(esh_state *esh, compile_ctx *ctx, long long i) {
+	imm_entry key = { .str = NULL, .i = i, .is_int = true };
+	imm_entry *entry = find_imm(esh, ctx, &key);
+	if(entry->is_int) return entry->ref;
+	
+	if(esh_push_int(esh, i)) throw_err(ctx);
+	if(esh_fn_add_imm(esh, &key.ref)) throw_err(ctx);
+	*entry = key;
+	return key.ref;
+}
+
 static uint64_t add_str_imm(esh_state *esh, compile_ctx *ctx, lex_token word) {
 	assert(word.type == TOK_WORD || word.type == TOK_STR_INTERP);
 	
@@ -903,14 +1105,54 @@ static uint64_t add_str_imm(esh_state *esh, compile_ctx *ctx, lex_token word) {
 		}
 	}
 	
+	imm_entry key = { .str = ctx->str_buff_len != 0? ctx->str_buff : "", .len = ctx->str_buff_len, .is_int = false };
+	imm_entry *entry = find_imm(esh, ctx, &key);
+	if(entry->str) return entry->ref;
+	
 	if(esh_new_string(esh, ctx->str_buff, ctx->str_buff_len)) throw_err(ctx);
-	uint64_t ref;
-	if(esh_fn_add_imm(esh, &ref)) throw_err(ctx);
+	if(esh_fn_add_imm(esh, &key.ref)) throw_err(ctx);
+	
+	if(key.len != 0) {
+		char *str = arena_alloc(esh, ctx, sizeof(char) * key.len); // The string buffer is reused by the next immediate
+		memcpy(str, ctx->str_buff, sizeof(char) * key.len);
+		key.str = str;
+	}
+	*entry = key;
+	return key.ref;
+}
+
+// Only canonical decimal integers (no leading zeros, no '+' and no "-0") are compiled as integer immediates, so that converting them back to a string yields the original word
+static bool parse_int_literal(lex_token word, long long *out) {
+	const char *str = word.str;
+	size_t len = word.strlen;
+	
+	bool negative = len > 0 && *str == '-';
+	if(negative) {
+		str++;
+		len--;
+	}
+	
+	if(len == 0 || len > 18) return false;
+	if(*str == '0' && (len != 1 || negative)) return false;
 	
-	return ref;
+	long long n = 0;
+	for(size_t i = 0; i < len; i++) {
+		if(str[i] < '0' || str[i] > '9') return false;
+		n = n * 10 + (str[i] - '0');
+	}
+	
+	*out = negative? -n : n;
+	return true;
 }
 
 static void compile_word(esh_state *esh, compile_ctx *ctx, lex_token word) {
+	long long i;
+	if(word.type == TOK_WORD && parse_int_literal(word, &i)) {
+		uint64_t ref = add_int_imm(esh, ctx, i);
+		if(esh_fn_append_instr(esh, ESH_INSTR_IMM, ref, 0)) throw_err(ctx);
+		return;
+	}
+	
 	uint64_t ref = add_str_imm(esh, ctx, word);
 	if(esh_fn_append_instr(esh, ESH_INSTR_IMM, ref, 0)) throw_err(ctx);
 }
@@ -918,12 +1160,28 @@ static void compile_word(esh_state *esh, compile_ctx *ctx, lex_token word) {
 static bool compile_statement(esh_state *esh, compile_ctx *ctx, bool top_level);
 static void compile_expression(esh_state *esh, compile_ctx *ctx);
 
+// Appends the instruction, or evaluates it at compile time if all of its operands are constants
+static void compile_op(esh_state *esh, compile_ctx *ctx, esh_opcode op, uint64_t arg) {
+	bool folded;
+	if(esh_fn_try_fold(esh, op, arg, &folded)) throw_err(ctx);
+	if(!folded) if(esh_fn_append_instr(esh, op, arg, 0)) throw_err(ctx);
+}
+
+// Merges the last two parts of a string interpolation if both are constant
+static void fold_interp_parts(esh_state *esh, compile_ctx *ctx, size_t *n) {
+	if(*n < 2) return;
+	
+	bool folded;
+	if(esh_fn_try_fold(esh, ESH_INSTR_CONCAT, 2, &folded)) throw_err(ctx);
+	if(folded) (*n)--;
+}
+
 // Returns true if the variable is local
 static bool compile_local_var_load(esh_state *esh, compile_ctx *ctx, lex_token word) {
 	size_t local_index, local_uplevel;
 	bool ignore;
 	if(find_local(ctx, word, &local_index, &local_uplevel, &ignore)) {
-		upval_locals(ctx, local_uplevel);
+		capture_local(esh, ctx, local_index, local_uplevel);
 		if(esh_fn_append_instr(esh, ESH_INSTR_LOAD, local_index, local_uplevel)) throw_err(ctx);
 		return true;
 	}
@@ -975,9 +1233,11 @@ static void compile_function(esh_state *esh, compile_ctx *ctx, lex_token *opt_na
 	}
 	
 	size_t n_locals;
-	bool upval_locals;
-	leave_fn_scope(ctx, &n_locals, &upval_locals);
-	if(esh_fn_finalize(esh, n_args, opt_args, n_locals, upval_locals, false)) throw_err(ctx);
+	bool upval_locals, free_vars;
+	leave_fn_scope(esh, ctx, &n_locals, &upval_locals, &free_vars);
+	
+	// Without free variables, the closure doesn't depend on the enclosing environment, so it's created once and kept as the immediate
+	if(esh_fn_finalize(esh, n_args, opt_args, n_locals, upval_locals, ctx->captured, !free_vars)) throw_err(ctx);
 	
 	uint64_t imm;
 	if(esh_fn_add_imm(esh, &imm)) throw_err(ctx);
@@ -999,7 +1259,11 @@ static void compile_s_term(esh_state *esh, compile_ctx *ctx) {
 		case TOK_STR_INTERP: {
 			size_t n = 0;
 			do {
-				compile_word(esh, ctx, token);
+				if(token.strlen != 0) { // Empty literal parts are left out
+					compile_word(esh, ctx, token);
+					n++;
+					fold_interp_parts(esh, ctx, &n);
+				}
 				
 				if(peek_token(esh, ctx).type == TOK_WORD) {
 					lex_next_as_string(ctx);
@@ -1011,13 +1275,18 @@ static void compile_s_term(esh_state *esh, compile_ctx *ctx) {
 					lex_next_as_string(ctx);
 					expect_token(esh, ctx, TOK_CLOSE_BRACKET, "following expression");
 				}
-				n += 2;
+				n++;
+				fold_interp_parts(esh, ctx, &n);
 			} while(accept_token(esh, ctx, TOK_STR_INTERP, &token));
 			
-			compile_word(esh, ctx, expect_token(esh, ctx, TOK_WORD, "following string interpolation terms"));
-			n++;
+			lex_token word = expect_token(esh, ctx, TOK_WORD, "following string interpolation terms");
+			if(word.strlen != 0) {
+				compile_word(esh, ctx, word);
+				n++;
+				fold_interp_parts(esh, ctx, &n);
+			}
 			
-			if(esh_fn_append_instr(esh, ESH_INSTR_CONCAT, n, 0)) throw_err(ctx);
+			compile_op(esh, ctx, ESH_INSTR_CONCAT, n); // Also converts a single part to a string
 		} break;
 		
 		case TOK_WITH: {
@@ -1041,9 +1310,7 @@ static void compile_s_term(esh_state *esh, compile_ctx *ctx) {
 				if(accept_token(esh, ctx, TOK_ASSIGN, NULL)) {
 					compile_expression(esh, ctx);
 				} else {
-					if(esh_push_int(esh, index_counter)) throw_err(ctx);
-					uint64_t ref;
-					if(esh_fn_add_imm(esh, &ref)) throw_err(ctx);
+					uint64_t ref = add_int_imm(esh, ctx, index_counter);
 					if(esh_fn_append_instr(esh, ESH_INSTR_IMM, ref, 0)) throw_err(ctx);
 					if(esh_fn_append_instr(esh, ESH_INSTR_SWAP, 0, 0)) throw_err(ctx);
 					
@@ -1057,8 +1324,16 @@ static void compile_s_term(esh_state *esh, compile_ctx *ctx) {
 				}
 			}
 			
-			if(esh_fn_append_instr(esh, ESH_INSTR_NEW_OBJ, n, 0)) throw_err(ctx);
-			if(is_const) if(esh_fn_append_instr(esh, ESH_INSTR_MAKE_CONST, 0, 0)) throw_err(ctx);
+			if(is_const) { // Constant objects with literal keys and values are built once, at compile time
+				bool folded;
+				if(esh_fn_try_fold(esh, ESH_INSTR_NEW_OBJ, n, &folded)) throw_err(ctx);
+				if(!folded) {
+					if(esh_fn_append_instr(esh, ESH_INSTR_NEW_OBJ, n, 0)) throw_err(ctx);
+					if(esh_fn_append_instr(esh, ESH_INSTR_MAKE_CONST, 0, 0)) throw_err(ctx);
+				}
+			} else {
+				if(esh_fn_append_instr(esh, ESH_INSTR_NEW_OBJ, n, 0)) throw_err(ctx);
+			}
 		} break;
 		
 		case TOK_NULL_LITERAL: {
@@ -1167,7 +1442,7 @@ static void compile_unary_expression(esh_state *esh, compile_ctx *ctx) {
 	bool not = accept_token(esh, ctx, TOK_NOT, NULL);
 	compile_call_expression(esh, ctx, false);
 	
-	if(not) if(esh_fn_append_instr(esh, ESH_INSTR_NOT, 0, 0)) throw_err(ctx);
+	if(not) compile_op(esh, ctx, ESH_INSTR_NOT, 0);
 }
 
 static void compile_mul_expression(esh_state *esh, compile_ctx *ctx) {
@@ -1180,7 +1455,7 @@ static void compile_mul_expression(esh_state *esh, compile_ctx *ctx) {
 	) {
 		if(esh_fn_line_directive(esh, op.line)) throw_err(ctx);
 		compile_unary_expression(esh, ctx);
-		if(esh_fn_append_instr(esh, op.type == TOK_MUL? ESH_INSTR_MUL : ESH_INSTR_DIV, 0, 0)) throw_err(ctx);
+		compile_op(esh, ctx, op.type == TOK_MUL? ESH_INSTR_MUL : ESH_INSTR_DIV, 0);
 	}
 }
 
@@ -1194,7 +1469,7 @@ static void compile_add_expression(esh_state *esh, compile_ctx *ctx) {
 		if(esh_fn_line_directive(esh, op.line)) throw_err(ctx);
 		
 		compile_mul_expression(esh, ctx);
-		if(esh_fn_append_instr(esh, op.type == TOK_ADD? ESH_INSTR_ADD : ESH_INSTR_SUB, 0, 0)) throw_err(ctx);
+		compile_op(esh, ctx, op.type == TOK_ADD? ESH_INSTR_ADD : ESH_INSTR_SUB, 0);
 	}
 }
 
@@ -1231,7 +1506,7 @@ static void compile_cmp_expression(esh_state *esh, compile_ctx *ctx) {
 				assert(false);
 		}
 		
-		if(esh_fn_append_instr(esh, opcode, 0, 0)) throw_err(ctx);
+		compile_op(esh, ctx, opcode, 0);
 	}
 }
 
@@ -1259,6 +1534,114 @@ static void compile_expression(esh_state *esh, compile_ctx *ctx) {
 	compile_and_expression(esh, ctx);
 }
 
+static void push_loop(esh_state *esh, compile_ctx *ctx, uint64_t break_label, uint64_t continue_label) {
+	if(ctx->loops_len == ctx->loops_cap) {
+		size_t new_cap = ctx->loops_cap * 3 / 2 + 1;
+		loop_scope *new_buff = arena_grow(esh, ctx, ctx->loops, sizeof(loop_scope) * ctx->loops_cap, sizeof(loop_scope) * new_cap);
+		ctx->loops_cap = new_cap;
+		ctx->loops = new_buff;
+	}
+	
+	ctx->loops[ctx->loops_len++] = (loop_scope) { .fn_scope = ctx->fn_scopes_len - 1, .break_label = break_label, .continue_label = continue_label };
+}
+
+// Returns the innermost loop of the current function, if any
+static loop_scope *current_loop(compile_ctx *ctx) {
+	if(ctx->loops_len == 0) return NULL;
+	
+	loop_scope *loop = &ctx->loops[ctx->loops_len - 1];
+	if(loop->fn_scope != ctx->fn_scopes_len - 1) return NULL; // 'break' cannot leave a function
+	return loop;
+}
+
+static void compile_loop_body(esh_state *esh, compile_ctx *ctx, bool top_level, uint64_t break_label, uint64_t continue_label) {
+	push_loop(esh, ctx, break_label, continue_label);
+	new_block_scope(esh, ctx);
+	
+	while(!accept_token(esh, ctx, TOK_END, NULL)) {
+		bool value = compile_statement(esh, ctx, top_level);
+		if(value) if(esh_fn_append_instr(esh, ESH_INSTR_POP, 0, 0)) throw_err(ctx);
+	}
+	
+	leave_block_scope(ctx);
+	ctx->loops_len--;
+}
+
+static void compile_while(esh_state *esh, compile_ctx *ctx, bool top_level) {
+	uint64_t cond_label, end_label;
+	if(esh_fn_new_label(esh, &cond_label)) throw_err(ctx);
+	
+	compile_expression(esh, ctx);
+	expect_token(esh, ctx, TOK_DO, "following 'while' condition");
+	
+	if(esh_fn_new_label(esh, &end_label)) throw_err(ctx);
+	if(esh_fn_append_instr(esh, ESH_INSTR_JMP_IFN, end_label, 0)) throw_err(ctx);
+	
+	compile_loop_body(esh, ctx, top_level, end_label, cond_label);
+	
+	if(esh_fn_append_instr(esh, ESH_INSTR_JMP, cond_label, 0)) throw_err(ctx);
+	if(esh_fn_put_label(esh, end_label)) throw_err(ctx);
+}
+
+// Whether the upcoming tokens are 'for' WORD 'in'
+static bool is_for_in(esh_state *esh, compile_ctx *ctx) {
+	if(!is_ctx_keyword(peek_token(esh, ctx), "for")) return false;
+	
+	lex_state state = lex_save(ctx);
+	pop_token(esh, ctx);
+	bool res = accept_token(esh, ctx, TOK_WORD, NULL) && is_ctx_keyword(peek_token(esh, ctx), "in");
+	lex_restore(ctx, state);
+	
+	return res;
+}
+
+// Counts from the start (inclusive) to the end (exclusive) of the range, like the 'for' function
+static void compile_for(esh_state *esh, compile_ctx *ctx, bool top_level) {
+	pop_token(esh, ctx); // 'for'
+	lex_token var = expect_token(esh, ctx, TOK_WORD, "following 'for'");
+	
+	// The start of the range has to be lexed in range mode, which applies from the token following 'in'
+	assert(is_ctx_keyword(peek_token(esh, ctx), "in"));
+	ctx->lex_range = true;
+	pop_token(esh, ctx);
+	compile_expression(esh, ctx);
+	ctx->lex_range = false;
+	expect_token(esh, ctx, TOK_RANGE, "following start of 'for' range");
+	compile_expression(esh, ctx);
+	expect_token(esh, ctx, TOK_DO, "following 'for' range");
+	
+	new_block_scope(esh, ctx);
+	
+	// Not a valid word, so the range end can't be referenced by the loop body
+	lex_token end_var = { .type = TOK_WORD, .start = var.start, .end = var.end, .str = "(for end)", .strlen = strlen("(for end)"), .line = var.line };
+	size_t end_index = new_local(esh, ctx, end_var, true);
+	size_t var_index = new_local(esh, ctx, var, true);
+	if(esh_fn_append_instr(esh, ESH_INSTR_STORE, end_index, 0)) throw_err(ctx);
+	if(esh_fn_append_instr(esh, ESH_INSTR_STORE, var_index, 0)) throw_err(ctx);
+	
+	uint64_t cond_label, continue_label, end_label;
+	if(esh_fn_new_label(esh, &cond_label)) throw_err(ctx);
+	if(esh_fn_append_instr(esh, ESH_INSTR_LOAD, var_index, 0)) throw_err(ctx);
+	if(esh_fn_append_instr(esh, ESH_INSTR_LOAD, end_index, 0)) throw_err(ctx);
+	if(esh_fn_append_instr(esh, ESH_INSTR_LESS, 0, 0)) throw_err(ctx);
+	if(esh_fn_new_label(esh, &end_label)) throw_err(ctx);
+	if(esh_fn_append_instr(esh, ESH_INSTR_JMP_IFN, end_label, 0)) throw_err(ctx);
+	
+	if(esh_fn_new_label(esh, &continue_label)) throw_err(ctx);
+	compile_loop_body(esh, ctx, top_level, end_label, continue_label);
+	
+	if(esh_fn_put_label(esh, continue_label)) throw_err(ctx);
+	if(esh_fn_append_instr(esh, ESH_INSTR_LOAD, var_index, 0)) throw_err(ctx);
+	uint64_t one = add_int_imm(esh, ctx, 1);
+	if(esh_fn_append_instr(esh, ESH_INSTR_IMM, one, 0)) throw_err(ctx);
+	if(esh_fn_append_instr(esh, ESH_INSTR_ADD, 0, 0)) throw_err(ctx);
+	if(esh_fn_append_instr(esh, ESH_INSTR_STORE, var_index, 0)) throw_err(ctx);
+	if(esh_fn_append_instr(esh, ESH_INSTR_JMP, cond_label, 0)) throw_err(ctx);
+	
+	if(esh_fn_put_label(esh, end_label)) throw_err(ctx);
+	leave_block_scope(ctx);
+}
+
 // Returns true if the statement leaves a value on the stack
 static bool compile_statement(esh_state *esh, compile_ctx *ctx, bool top_level) {
 	(void) top_level;
@@ -1267,8 +1650,28 @@ static bool compile_statement(esh_state *esh, compile_ctx *ctx, bool top_level)
 	
 	switch(tok.type) {
 		case TOK_WORD: {
+			if(is_for_in(esh, ctx)) {
+				compile_for(esh, ctx, top_level);
+				return false;
+			}
+			
 			pop_token(esh, ctx);
 			
+			token_type next = peek_token(esh, ctx).type;
+			if(next != TOK_COLON && next != TOK_ASSIGN && next != TOK_COMMA) { // Otherwise an assignment to a variable with the same name
+				if(is_ctx_keyword(tok, "while")) {
+					compile_while(esh, ctx, top_level);
+					return false;
+				}
+				
+				loop_scope *loop = current_loop(ctx);
+				if(loop && (is_ctx_keyword(tok, "break") || is_ctx_keyword(tok, "continue"))) {
+					uint64_t label = is_ctx_keyword(tok, "break")? loop->break_label : loop->continue_label;
+					if(esh_fn_append_instr(esh, ESH_INSTR_JMP, label, 0)) throw_err(ctx);
+					return false;
+				}
+			}
+			
 			if(peek_token(esh, ctx).type == TOK_COLON) {
 				compile_var_load(esh, ctx, tok);
 				
@@ -1309,7 +1712,7 @@ static bool compile_statement(esh_state *esh, compile_ctx *ctx, bool top_level)
 					bool is_const;
 					if(find_local(ctx, var, &local_index, &local_uplevel, &is_const)) {
 						if(is_const) compile_err(esh, ctx, "Attempting to redefine constant variable", var.start, var.end);
-						upval_locals(ctx, local_uplevel);
+						capture_local(esh, ctx, local_index, local_uplevel);
 						if(esh_fn_append_instr(esh, ESH_INSTR_STORE, local_index, local_uplevel)) throw_err(ctx);
 					} else {
 						uint64_t ref = add_str_imm(esh, ctx, var);
@@ -1439,7 +1842,7 @@ static bool compile_statement(esh_state *esh, compile_ctx *ctx, bool top_level)
 				n++;
 			} while(accept_token(esh, ctx, TOK_COMMA, NULL));
 			
-			if(esh_fn_append_instr(esh, ESH_INSTR_RET, n, 0)) throw_err(ctx);
+			if(esh_fn_append_ret(esh, n)) throw_err(ctx);
 			
 			return false;
 		} break;
@@ -1472,12 +1875,12 @@ static void compile_program(esh_state *esh, compile_ctx *ctx, bool interactive)
 
 	if(esh_fn_append_instr(esh, ESH_INSTR_RET, 1, 0)) throw_err(ctx);
 	
-	bool upval_locals;
+	// Declaring locals at the top level is not allowed, but loops use hidden locals
+	bool upval_locals, free_vars;
 	size_t n_locals;
-	leave_fn_scope(ctx, &n_locals, &upval_locals);
-	assert(n_locals == 0 && !upval_locals);
+	leave_fn_scope(esh, ctx, &n_locals, &upval_locals, &free_vars);
 	
-	esh_fn_finalize(esh, 0, 0, 0, false, true);
+	if(esh_fn_finalize(esh, 0, 0, n_locals, upval_locals, ctx->captured, true)) throw_err(ctx);
 }
 
 int esh_compile_src(esh_state *esh, const char *name, const char *src, size_t len, bool interactive_mode) {
@@ -1494,10 +1897,20 @@ int esh_compile_src(esh_state *esh, const char *name, const char *src, size_t le
 		.token_stack_len = 0,
 		.token_stack_cap = 0,
 		
+		.arena = NULL,
+		.arena_last = NULL,
+		
 		.fn_scopes = NULL,
 		.fn_scopes_len = 0,
 		.fn_scopes_cap = 0,
 		
+		.captures = NULL,
+		.captures_len = 0,
+		.captures_cap = 0,
+		
+		.captured = NULL,
+		.captured_cap = 0,
+		
 		.block_scopes = NULL,
 		.block_scopes_len = 0,
 		.block_scopes_cap = 0,
@@ -1506,13 +1919,18 @@ int esh_compile_src(esh_state *esh, const char *name, const char *src, size_t le
 		.locals_len = 0,
 		.locals_cap = 0,
 		
+		.loops = NULL,
+		.loops_len = 0,
+		.loops_cap = 0,
+		
 		.pushed_token = { .type = TOK_NULL },
 		
 		.str_buff = NULL,
 		.str_buff_len = 0,
 		.str_buff_cap = 0,
 		
-		.lex_next_as_string = false
+		.lex_next_as_string = false,
+		.lex_range = false
 	};
 	
 	esh_save_stack(esh);
@@ -1526,11 +1944,7 @@ int esh_compile_src(esh_state *esh, const char *name, const char *src, size_t le
 		esh_restore_stack(esh);
 	}
 	
-	esh_free(esh, ctx.token_stack);
-	esh_free(esh, ctx.fn_scopes);
-	esh_free(esh, ctx.block_scopes);
-	esh_free(esh, ctx.locals);
-	esh_free(esh, ctx.str_buff);
+	arena_free(esh, &ctx);
 	
 	return err;
 }
@@ -3,146 +3,565 @@
 #include <assert.h>
 #include <string.h>
 
-static size_t strhash(const char *str, size_t len) {
-	size_t hash = 0;
-	for(size_t i = 0; i < len; i++) {
-		hash *= 76934959338;
-		hash += str[i];
-		hash = hash ^ str[i] * 2525329532587438u;
+static uint64_t mix64(uint64_t h) {
+	h ^= h >> 30;
+	h *= 0xbf58476d1ce4e5b9u;
+	h ^= h >> 27;
+	h *= 0x94d049bb133111ebu;
+	h ^= h >> 31;
+	return h;
+}
+
+// Hashes eight bytes at a time, and finishes with the splitmix64 finalizer so that all bits of the result are usable as a table index
+size_t esh_strhash(const char *str, size_t len) {
+	uint64_t h = 0x9e3779b97f4a7c15u ^ len;
+	
+	size_t i = 0;
+	for(; i + 8 <= len; i += 8) {
+		uint64_t w;
+		memcpy(&w, str + i, 8);
+		h = (h ^ w) * 0xff51afd7ed558ccdu;
+		h ^= h >> 32;
+	}
+	
+	uint64_t w = 0;
+	memcpy(&w, str + i, len - i);
+	h = (h ^ w) * 0xff51afd7ed558ccdu;
+	
+	return (size_t) mix64(h);
+}
+
+// Keys are either short strings, which are hashed by their value, or interned strings with a cached hash
+static size_t key_hash(esh_val key) {
+	if(esh_val_is_short_str(key)) return (size_t) mix64((uintptr_t) key);
+	return ((esh_string *) key)->hash;
+}
+
+static const char *key_str(esh_val *key, size_t *out_len) {
+	if(esh_val_is_short_str(*key)) {
+		char *s = (char *) key;
+		#ifndef BIG_ENDIAN
+		s++;
+		#endif
+		*out_len = esh_short_str_len(*key);
+		return s;
 	}
 	
-	return hash;
+	esh_string *str = *key;
+	*out_len = str->len;
+	return str->str;
 }
 
-static esh_object_entry *object_find(esh_object_entry *entries, size_t cap, const char *key, size_t keylen) {
-	assert(cap != 0);
+// Keys in canonical decimal form ("0", "1", ..., but not "01" or "-0") are array indices, and are stored in the array part while they are dense
+static bool key_as_index(const char *key, size_t keylen, size_t *out_index) {
+	if(keylen == 0 || keylen > 18) return false;
+	if(key[0] == '0' && keylen != 1) return false;
 	
-	size_t index = strhash(key, keylen) % cap;
-	for(size_t i = index; i < cap; i++) {
-		if(
-			entries[i].key == NULL ||
-			(entries[i].keylen == keylen && memcmp(entries[i].key, key, sizeof(char) * keylen) == 0)
-		) {
-			return &entries[i];
-		}
+	size_t i = 0;
+	for(size_t j = 0; j < keylen; j++) {
+		if(key[j] < '0' || key[j] > '9') return false;
+		i = i * 10 + (key[j] - '0');
 	}
-	for(size_t i = 0; i < index; i++) {
-		if(
-			entries[i].key == NULL ||
-			(entries[i].keylen == keylen && memcmp(entries[i].key, key, sizeof(char) * keylen) == 0)
-		) {
-			return &entries[i];
-		}
+	
+	*out_index = i;
+	return true;
+}
+
+// Writes the decimal form of i into buff (which must be at least 21 chars long), and returns the length
+static size_t index_as_key(size_t i, char *buff) {
+	char digits[20];
+	size_t len = 0;
+	do {
+		digits[len++] = '0' + (i % 10);
+		i /= 10;
+	} while(i != 0);
+	
+	for(size_t j = 0; j < len; j++) buff[j] = digits[len - j - 1];
+	return len;
+}
+
+// ENTRIES TABLE
+// Tables have a power of two capacity and use linear probing. Deleting an entry leaves a tombstone (an ESH_NULL key with deleted set), so that entries never move while the table is iterated. Tombstones are dropped whenever the table is rehashed, which also shrinks tables that have mostly been emptied
+
+#define TABLE_MIN_CAP 4
+
+// Rehashes once the live entries and tombstones would fill three quarters of the table
+#define TABLE_FULL(used, cap) ((used) * 4 >= (cap) * 3)
+
+// Capacity that leaves a table with n entries at most half full
+static size_t table_cap_for(size_t n) {
+	size_t cap = TABLE_MIN_CAP;
+	while(cap / 2 < n) cap *= 2;
+	return cap;
+}
+
+// Returns the entry holding the key, or NULL. There is always an empty entry to end the probe sequence
+static esh_object_entry *table_find(esh_table *obj, esh_val key) {
+	size_t mask = obj->cap - 1;
+	for(size_t i = key_hash(key) & mask;; i = (i + 1) & mask) {
+		esh_object_entry *entry = &obj->entries[i];
+		if(entry->key == key) return entry;
+		if(entry->key == ESH_NULL && !entry->deleted) return NULL;
 	}
-	return NULL;
 }
 
-bool esh_object_get(esh_state *esh, esh_object *obj, const char *key, size_t keylen, esh_val *out_val) {
-	(void) esh;
+// Returns the first free entry on the probe sequence of a key that is not in the table, which may be a tombstone
+static esh_object_entry *table_free_entry(esh_object_entry *entries, size_t cap, esh_val key) {
+	size_t mask = cap - 1;
+	for(size_t i = key_hash(key) & mask;; i = (i + 1) & mask) {
+		if(entries[i].key == ESH_NULL) return &entries[i];
+	}
+}
+
+static esh_object_entry *table_alloc(esh_state *esh, size_t cap) {
+	esh_object_entry *entries = esh_pool_alloc(esh, sizeof(esh_object_entry) * cap);
+	if(!entries) {
+		esh_err_printf(esh, "Unable to allocate object entries (out of memory?)");
+		return NULL;
+	}
 	
-	if(obj->len == 0) return false;
+	for(size_t i = 0; i < cap; i++) {
+		entries[i].key = ESH_NULL;
+		entries[i].deleted = false;
+	}
+	return entries;
+}
+
+static bool table_get(esh_table *obj, esh_val key, esh_val *out_val) {
+	if(obj->entries_len == 0) return false;
 	
-	esh_object_entry *entry = object_find(obj->entries, obj->cap, key, keylen);
-	if(!entry || entry->key == NULL || entry->deleted) return false;
+	esh_object_entry *entry = table_find(obj, key);
+	if(!entry) return false;
 	
 	*out_val = entry->val;
 	return true;
 }
 
-int esh_object_set(esh_state *esh, esh_object *obj, const char *key, size_t keylen, esh_val val) {
-	if(obj->is_const) {
-		esh_err_printf(esh, "Attempting to mutate constant object");
-		return 1;
+static bool table_delete(esh_table *obj, esh_val key) {
+	if(obj->entries_len == 0) return false;
+	
+	esh_object_entry *entry = table_find(obj, key);
+	if(!entry) return false;
+	
+	entry->key = ESH_NULL;
+	entry->deleted = true;
+	obj->entries_len--;
+	obj->len--;
+	
+	// Tables that are emptied, like sets of pending jobs, lose all of their tombstones at once
+	if(obj->entries_len == 0) {
+		for(size_t i = 0; i < obj->cap; i++) obj->entries[i].deleted = false;
+		obj->entries_used = 0;
 	}
+	return true;
+}
+
+// Makes room for one more entry in the entries table. The table is rehashed to fit its live entries when it is full or mostly empty, so it may grow, shrink or just drop its tombstones
+static int table_reserve(esh_state *esh, esh_table *obj) {
+	bool sparse = obj->cap > TABLE_MIN_CAP && obj->entries_len * 8 < obj->cap;
+	if(!TABLE_FULL(obj->entries_used + 1, obj->cap) && !sparse) return 0;
 	
-	if(val == ESH_NULL) {
-		esh_object_delete_entry(esh, obj, key, keylen);
-		return 0;
+	size_t new_cap = table_cap_for(obj->entries_len + 1);
+	esh_object_entry *new_entries = table_alloc(esh, new_cap);
+	if(!new_entries) return 1;
+	
+	for(size_t i = 0; i < obj->cap; i++) {
+		esh_object_entry *entry = &obj->entries[i];
+		if(entry->key != ESH_NULL) *table_free_entry(new_entries, new_cap, entry->key) = *entry;
 	}
 	
-	#define GROW_FACTOR(x) (x) * 2 + 1
-	#define GROW_THRESHOLD(x) (x) / 3 * 2
+	esh_pool_free(esh, obj->entries, sizeof(esh_object_entry) * obj->cap);
+	obj->entries = new_entries;
+	obj->cap = new_cap;
+	obj->entries_used = obj->entries_len;
+	return 0;
+}
+
+// The table must have been reserved, and the key must be interned and not in the table yet
+static void table_insert(esh_table *obj, esh_val key, esh_val val) {
+	assert(val != ESH_NULL);
+	
+	esh_object_entry *entry = table_free_entry(obj->entries, obj->cap, key);
+	if(!entry->deleted) obj->entries_used++;
 	
-	if(obj->len >= GROW_THRESHOLD(obj->cap)) {
-		size_t new_cap = GROW_FACTOR(obj->cap);
-		esh_object_entry *new_entries = esh_alloc(esh, sizeof(esh_object_entry) * new_cap);
-		if(!new_entries) return 1;
-		for(size_t i = 0; i < new_cap; i++) {
-			new_entries[i].key = NULL;
-			new_entries[i].deleted = false;
+	entry->key = key;
+	entry->val = val;
+	entry->deleted = false;
+	
+	obj->entries_len++;
+	obj->len++;
+}
+
+// SHAPES
+
+static bool shape_find(esh_shape *shape, esh_val key, size_t *out_slot) {
+	for(size_t i = 0; i < shape->n_slots; i++) {
+		if(shape->keys[i] == key) {
+			*out_slot = i;
+			return true;
 		}
+	}
+	return false;
+}
+
+// Slots arrays are always small enough to come from the slabs of the state
+static size_t slots_cap(size_t n_slots) {
+	size_t cap = 4;
+	while(cap < n_slots) cap *= 2;
+	assert(sizeof(esh_val) * cap <= ESH_POOL_MAX);
+	return cap;
+}
+
+// Moves the entries held in slots into an entries table. Objects stay in dictionary mode for the rest of their life
+static int to_dict(esh_state *esh, esh_table *obj) {
+	size_t n_slots = obj->shape? obj->shape->n_slots : 0;
+	
+	size_t cap = table_cap_for(n_slots);
+	esh_object_entry *entries = table_alloc(esh, cap);
+	if(!entries) return 1;
+	
+	assert(obj->cap == 0);
+	obj->entries = entries;
+	obj->cap = cap;
+	obj->entries_used = n_slots;
+	
+	for(size_t i = 0; i < n_slots; i++) {
+		esh_object_entry *entry = table_free_entry(entries, cap, obj->shape->keys[i]);
+		entry->key = obj->shape->keys[i];
+		entry->val = obj->slots[i];
+	}
+	
+	esh_pool_free(esh, obj->slots, sizeof(esh_val) * slots_cap(n_slots));
+	obj->slots = NULL;
+	obj->shape = NULL;
+	return 0;
+}
+
+int esh_object_make_dict(esh_state *esh, esh_table *obj) {
+	if(obj->cap != 0) return 0;
+	return to_dict(esh, obj);
+}
+
+// KEYED ENTRIES
+// Keys of entries are interned strings (or short strings). Objects hold them either in slots, or in an entries table once in dictionary mode
+
+static bool keyed_get(esh_table *obj, esh_val key, esh_val *out_val) {
+	if(obj->shape) {
+		size_t slot;
+		if(!shape_find(obj->shape, key, &slot)) return false;
+		
+		*out_val = obj->slots[slot];
+		return true;
+	}
+	
+	return table_get(obj, key, out_val);
+}
+
+// Overwrites the value of an existing entry. Returns false if there is none
+static bool keyed_update(esh_table *obj, esh_val key, esh_val val) {
+	assert(val != ESH_NULL);
+	
+	if(obj->shape) {
+		size_t slot;
+		if(!shape_find(obj->shape, key, &slot)) return false;
+		
+		obj->slots[slot] = val;
+		return true;
+	}
+	
+	if(obj->entries_len == 0) return false;
+	
+	esh_object_entry *entry = table_find(obj, key);
+	if(!entry) return false;
+	
+	entry->val = val;
+	return true;
+}
+
+// Adds an entry for a key that is not in the object yet. The key must have been interned
+static int keyed_insert(esh_state *esh, esh_table *obj, esh_val key, esh_val val) {
+	assert(val != ESH_NULL);
+	
+	size_t n_slots = obj->shape? obj->shape->n_slots : 0;
+	if(obj->cap == 0 && n_slots < ESH_SHAPE_MAX_SLOTS) {
+		esh_shape *shape = esh_shape_add(esh, obj->shape, key);
+		if(!shape) return 1;
 		
-		for(size_t i = 0; i < obj->cap; i++) {
-			esh_object_entry *entry = &obj->entries[i];
-			if(entry->key == NULL) continue;
-			if(entry->deleted) {
-				esh_free(esh, entry->key);
-				continue;
+		if(n_slots == 0 || shape->n_slots > slots_cap(n_slots)) {
+			esh_val *slots = esh_pool_realloc(esh, obj->slots, sizeof(esh_val) * slots_cap(n_slots), sizeof(esh_val) * slots_cap(shape->n_slots));
+			if(!slots) {
+				esh_err_printf(esh, "Unable to grow object slots (out of memory?)");
+				return 1;
 			}
-			
-			*(object_find(new_entries, new_cap, entry->key, entry->keylen)) = *entry;
+			obj->slots = slots;
 		}
 		
-		esh_free(esh, obj->entries);
-		obj->entries = new_entries;
-		obj->cap = new_cap;
+		obj->slots[n_slots] = val;
+		obj->shape = shape;
+		obj->entries_len++;
+		obj->len++;
+		return 0;
 	}
 	
-	assert(obj->len < obj->cap);
+	if(obj->cap == 0 && to_dict(esh, obj)) return 1;
+	if(table_reserve(esh, obj)) return 1;
+	
+	table_insert(obj, key, val);
+	return 0;
+}
+
+static int keyed_delete(esh_state *esh, esh_table *obj, esh_val key, bool *out_deleted) {
+	*out_deleted = false;
+	
+	if(obj->shape) {
+		size_t slot;
+		if(!shape_find(obj->shape, key, &slot)) return 0;
+		
+		// Shapes only ever grow, so the object leaves them
+		if(to_dict(esh, obj)) return 1;
+	}
 	
-	esh_object_entry *entry = object_find(obj->entries, obj->cap, key, keylen);
-	assert(entry != NULL);
+	*out_deleted = table_delete(obj, key);
+	return 0;
+}
+
+// Finds the interned form of a key for a lookup. Returns ESH_NULL if the string is not interned, in which case it can't be the key of any entry
+static esh_val lookup_key(esh_state *esh, esh_val key) {
+	if(esh_val_is_short_str(key) || ((esh_string *) key)->interned) return key;
 	
-	if(entry->key != NULL) {
-		entry->val = val;
-		if(entry->deleted) {
-			entry->deleted = false;
+	esh_string *str = key;
+	return esh_intern_find(esh, str->str, str->len);
+}
+
+// Returns the live entry for the key in the entries table, or NULL. Keys held by the array part or in slots have no entry. The entry stays valid until the table is rehashed or the key is deleted
+esh_object_entry *esh_object_get_entry(esh_state *esh, esh_table *obj, esh_val key) {
+	size_t keylen, i;
+	const char *keystr = key_str(&key, &keylen);
+	if(obj->cap == 0 || obj->entries_len == 0 || key_as_index(keystr, keylen, &i)) return NULL;
+	
+	key = lookup_key(esh, key);
+	if(key == ESH_NULL) return NULL;
+	
+	return table_find(obj, key);
+}
+
+bool esh_object_get_i(esh_state *esh, esh_table *obj, size_t i, esh_val *out_val) {
+	if(i < obj->array_len) {
+		if(obj->array[i] == ESH_NULL) return false;
+		*out_val = obj->array[i];
+		return true;
+	}
+	
+	if(obj->entries_len == 0) return false;
+	
+	char keystr[21];
+	size_t keylen = index_as_key(i, keystr);
+	esh_val key = esh_intern_find(esh, keystr, keylen);
+	return key != ESH_NULL && keyed_get(obj, key, out_val);
+}
+
+static int delete_i(esh_state *esh, esh_table *obj, size_t i) {
+	if(obj->entries_len == 0) return 0;
+	
+	char keystr[21];
+	size_t keylen = index_as_key(i, keystr);
+	esh_val key = esh_intern_find(esh, keystr, keylen);
+	
+	bool _;
+	return key != ESH_NULL? keyed_delete(esh, obj, key, &_) : 0;
+}
+
+// Keys that become adjacent to the array part are moved into it, so that no other entry has a key in 0..array_len
+static int array_append(esh_state *esh, esh_table *obj, esh_val val) {
+	while(true) {
+		if(obj->array_len == obj->array_cap) {
+			size_t new_cap = obj->array_cap * 2 + 4;
+			esh_val *new_array = esh_realloc(esh, obj->array, sizeof(esh_val) * new_cap);
+			if(!new_array) return 1;
+			
+			obj->array = new_array;
+			obj->array_cap = new_cap;
+		}
+		
+		obj->array[obj->array_len++] = val;
+		obj->len++;
+		
+		if(obj->entries_len == 0) return 0;
+		
+		if(!esh_object_get_i(esh, obj, obj->array_len, &val)) return 0;
+		if(delete_i(esh, obj, obj->array_len)) return 1;
+	}
+}
+
+static int array_set(esh_state *esh, esh_table *obj, size_t i, esh_val val) {
+	if(i < obj->array_len) {
+		if(obj->array[i] == ESH_NULL) {
+			if(val == ESH_NULL) return 0;
 			obj->len++;
+		} else if(val == ESH_NULL) {
+			obj->len--;
 		}
+		
+		obj->array[i] = val;
+		while(obj->array_len > 0 && obj->array[obj->array_len - 1] == ESH_NULL) obj->array_len--;
 		return 0;
 	}
 	
-	char *key_cpy = esh_alloc(esh, sizeof(char) * keylen);
-	if(!key_cpy) return 1;
+	if(i == obj->array_len && val != ESH_NULL) return array_append(esh, obj, val);
 	
-	memcpy(key_cpy, key, sizeof(char) * keylen);
-	entry->key = key_cpy;
-	entry->keylen = keylen;
-	entry->val = val;
+	if(val == ESH_NULL) return delete_i(esh, obj, i);
 	
-	obj->len++;
+	char keystr[21];
+	size_t keylen = index_as_key(i, keystr);
+	esh_val key = esh_intern_find(esh, keystr, keylen);
+	if(key != ESH_NULL && keyed_update(obj, key, val)) return 0;
 	
-	return 0;
+	key = esh_intern(esh, keystr, keylen);
+	if(key == ESH_NULL) return 1;
+	
+	return keyed_insert(esh, obj, key, val);
 }
 
-bool esh_object_delete_entry(esh_state *esh, esh_object *obj, const char *key, size_t keylen) {
-	(void) esh;
-	if(obj->cap == 0) return false;
+int esh_object_set_i(esh_state *esh, esh_table *obj, size_t i, esh_val val) {
+	if(obj->obj.is_const) {
+		esh_err_printf(esh, "Attempting to mutate constant object");
+		return 1;
+	}
+	
+	return array_set(esh, obj, i, val);
+}
+
+bool esh_object_get_v(esh_state *esh, esh_table *obj, esh_val key, esh_val *out_val) {
+	size_t keylen, i;
+	const char *keystr = key_str(&key, &keylen);
+	if(key_as_index(keystr, keylen, &i)) return esh_object_get_i(esh, obj, i, out_val);
+	
+	if(obj->entries_len == 0) return false;
+	
+	key = lookup_key(esh, key);
+	return key != ESH_NULL && keyed_get(obj, key, out_val);
+}
+
+int esh_object_set_v(esh_state *esh, esh_table *obj, esh_val key, esh_val val) {
+	if(obj->obj.is_const) {
+		esh_err_printf(esh, "Attempting to mutate constant object");
+		return 1;
+	}
 	
-	esh_object_entry *entry = object_find(obj->entries, obj->cap, key, keylen);	
-	if(entry != NULL && entry->key != NULL && !entry->deleted) {
-		entry->deleted = true;
-		obj->len--;
+	size_t keylen, i;
+	const char *keystr = key_str(&key, &keylen);
+	if(key_as_index(keystr, keylen, &i)) return array_set(esh, obj, i, val);
+	
+	esh_val found = lookup_key(esh, key);
+	if(val == ESH_NULL) {
+		bool _;
+		return found != ESH_NULL? keyed_delete(esh, obj, found, &_) : 0;
+	}
+	if(found != ESH_NULL && keyed_update(obj, found, val)) return 0;
+	
+	key = esh_intern_val(esh, key);
+	if(key == ESH_NULL) return 1;
+	
+	return keyed_insert(esh, obj, key, val);
+}
+
+bool esh_object_delete_entry_v(esh_state *esh, esh_table *obj, esh_val key) {
+	size_t keylen, i;
+	const char *keystr = key_str(&key, &keylen);
+	if(key_as_index(keystr, keylen, &i)) {
+		esh_val _;
+		if(!esh_object_get_i(esh, obj, i, &_)) return false;
+		
+		array_set(esh, obj, i, ESH_NULL);
 		return true;
 	}
-	return false;
+	
+	key = lookup_key(esh, key);
+	
+	bool deleted = false;
+	if(key != ESH_NULL) keyed_delete(esh, obj, key, &deleted);
+	return deleted;
 }
 
-void esh_object_init_entries(esh_state *esh, esh_object *obj) {
+bool esh_object_get(esh_state *esh, esh_table *obj, const char *key, size_t keylen, esh_val *out_val) {
+	size_t i;
+	if(key_as_index(key, keylen, &i)) return esh_object_get_i(esh, obj, i, out_val);
+	
+	if(obj->entries_len == 0) return false;
+	
+	esh_val key_val = esh_intern_find(esh, key, keylen);
+	return key_val != ESH_NULL && keyed_get(obj, key_val, out_val);
+}
+
+int esh_object_set(esh_state *esh, esh_table *obj, const char *key, size_t keylen, esh_val val) {
+	if(obj->obj.is_const) {
+		esh_err_printf(esh, "Attempting to mutate constant object");
+		return 1;
+	}
+	
+	size_t i;
+	if(key_as_index(key, keylen, &i)) return array_set(esh, obj, i, val);
+	
+	esh_val key_val = esh_intern_find(esh, key, keylen);
+	if(val == ESH_NULL) {
+		bool _;
+		return key_val != ESH_NULL? keyed_delete(esh, obj, key_val, &_) : 0;
+	}
+	if(key_val != ESH_NULL && keyed_update(obj, key_val, val)) return 0;
+	
+	key_val = esh_intern(esh, key, keylen);
+	if(key_val == ESH_NULL) return 1;
+	
+	return keyed_insert(esh, obj, key_val, val);
+}
+
+bool esh_object_delete_entry(esh_state *esh, esh_table *obj, const char *key, size_t keylen) {
+	size_t i;
+	if(key_as_index(key, keylen, &i)) {
+		esh_val _;
+		if(!esh_object_get_i(esh, obj, i, &_)) return false;
+		
+		array_set(esh, obj, i, ESH_NULL);
+		return true;
+	}
+	
+	esh_val key_val = esh_intern_find(esh, key, keylen);
+	
+	bool deleted = false;
+	if(key_val != ESH_NULL) keyed_delete(esh, obj, key_val, &deleted);
+	return deleted;
+}
+
+void esh_object_init_entries(esh_state *esh, esh_table *obj) {
 	(void) esh;
 	obj->entries = NULL;
 	obj->len = 0;
+	obj->entries_len = 0;
+	obj->entries_used = 0;
 	obj->cap = 0;
-	obj->is_const = false;
+	obj->array = NULL;
+	obj->array_len = 0;
+	obj->array_cap = 0;
+	obj->shape = NULL;
+	obj->slots = NULL;
+	obj->obj.is_const = false;
 }
 
-void esh_object_free_entries(esh_state *esh, esh_object *obj) {
-	for(size_t i = 0; i < obj->cap; i++) {
-		esh_free(esh, obj->entries[i].key);
-	}
+// The keys and shapes are owned by the GC, so only the tables are freed
+void esh_object_free_entries(esh_state *esh, esh_table *obj) {
+	esh_pool_free_small(esh, obj->slots); // The shape may already have been freed
+	obj->slots = NULL;
+	obj->shape = NULL;
 	
-	esh_free(esh, obj->entries);
+	esh_pool_free(esh, obj->entries, sizeof(esh_object_entry) * obj->cap);
 	obj->entries = NULL;
 	obj->len = 0;
+	obj->entries_len = 0;
+	obj->entries_used = 0;
 	obj->cap = 0;
+	
+	esh_free(esh, obj->array);
+	obj->array = NULL;
+	obj->array_len = 0;
+	obj->array_cap = 0;
 }
@@ -6,11 +6,24 @@
 
 #include <stdbool.h>
 
-bool esh_object_get(esh_state *esh, esh_object *obj, const char *key, size_t keylen, esh_val *out_val);
-int esh_object_set(esh_state *esh, esh_object *obj, const char *key, size_t keylen, esh_val val);
-bool esh_object_delete_entry(esh_state *esh, esh_object *obj, const char *key, size_t keylen);
+size_t esh_strhash(const char *str, size_t len);
 
-void esh_object_init_entries(esh_state *esh, esh_object *obj);
-void esh_object_free_entries(esh_state *esh, esh_object *obj);
+bool esh_object_get(esh_state *esh, esh_table *obj, const char *key, size_t keylen, esh_val *out_val);
+int esh_object_set(esh_state *esh, esh_table *obj, const char *key, size_t keylen, esh_val val);
+bool esh_object_delete_entry(esh_state *esh, esh_table *obj, const char *key, size_t keylen);
+
+// Same as above, but the key is a string value
+bool esh_object_get_v(esh_state *esh, esh_table *obj, esh_val key, esh_val *out_val);
+int esh_object_set_v(esh_state *esh, esh_table *obj, esh_val key, esh_val val);
+bool esh_object_delete_entry_v(esh_state *esh, esh_table *obj, esh_val key);
+
+esh_object_entry *esh_object_get_entry(esh_state *esh, esh_table *obj, esh_val key);
+int esh_object_make_dict(esh_state *esh, esh_table *obj);
+
+bool esh_object_get_i(esh_state *esh, esh_table *obj, size_t i, esh_val *out_val);
+int esh_object_set_i(esh_state *esh, esh_table *obj, size_t i, esh_val val);
+
+void esh_object_init_entries(esh_state *esh, esh_table *obj);
+void esh_object_free_entries(esh_state *esh, esh_table *obj);
 
 #endif
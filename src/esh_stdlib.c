@@ -184,24 +184,86 @@ static esh_fn_result gc(esh_state *esh, size_t n_args, size_t i) {
 	return ESH_FN_RETURN(1);
 }
 
+/*@
+	gc-conf mode [a] [b] [c]
+	mode        string
+	a           int
+	b           int
+	c           int
+	@returns    null
+	
+	Configures how the garbage collector is paced.
+	With the mode 'count', the GC runs every $a allocations (0 disables the GC, whatever the mode), and runs at most $b steps of a major cycle at a time.
+	With the modes 'bytes', 'adaptive' and 'concurrent', the GC runs every time $a bytes were allocated, starts a major cycle once the old generation grew to $b percent of its size after the last one, and works through $c percent of the allocated bytes in each step.
+	The mode 'adaptive' additionally tunes these from the observed survival rates and pause times.
+	The mode 'concurrent' leaves most of the work of major cycles to a helper thread.
+	Arguments that are not given are left unchanged.
+	A number as $mode is the same as the mode 'count' followed by $mode.
+	
+	--- Examples
+		gc-conf bytes 1048576
+		gc-conf count 256 64
+	---
+*/
 static esh_fn_result gc_conf(esh_state *esh, size_t n_args, size_t i) {
 	assert(i == 0);
-	assert(n_args == 2);
-	
-	long long freq, step_size;
-	if(esh_as_int(esh, 0, &freq)) return ESH_FN_ERR;
-	if(esh_as_int(esh, 1, &step_size)) return ESH_FN_ERR;
-	if(step_size < 0) {
-		esh_err_printf(esh, "GC step count must be positive");
-		return ESH_FN_ERR;
+	assert(n_args >= 1 && n_args <= 4);
+	
+	const char *mode_str = esh_as_string(esh, 0, NULL);
+	if(!mode_str) return ESH_FN_ERR;
+	
+	int mode;
+	if(strcmp(mode_str, "count") == 0) mode = ESH_GC_MODE_COUNT;
+	else if(strcmp(mode_str, "bytes") == 0) mode = ESH_GC_MODE_BYTES;
+	else if(strcmp(mode_str, "adaptive") == 0) mode = ESH_GC_MODE_ADAPTIVE;
+	else if(strcmp(mode_str, "concurrent") == 0) mode = ESH_GC_MODE_CONCURRENT;
+	else mode = -1;
+	
+	// Arguments following the mode, or following the frequency for a numeric mode
+	size_t from = mode == -1? 0 : 1;
+	long long args[3] = { -1, -1, -1 };
+	for(size_t j = from; j < n_args; j++) {
+		if(esh_as_int(esh, j, &args[j - from])) return ESH_FN_ERR;
+		if(args[j - from] < 0) {
+			esh_err_printf(esh, "GC configuration values must be positive");
+			return ESH_FN_ERR;
+		}
 	}
 	
-	esh_gc_conf(esh, freq, step_size);
+	if(mode == -1 || mode == ESH_GC_MODE_COUNT) {
+		if(n_args - from > 2) {
+			esh_err_printf(esh, "Too many arguments for the 'count' GC mode");
+			return ESH_FN_ERR;
+		}
+		esh_gc_pacing_conf(esh, ESH_GC_MODE_COUNT, -1, -1, -1);
+		esh_gc_conf(esh, args[0], args[1]);
+	} else {
+		esh_gc_pacing_conf(esh, mode, args[0], args[1], args[2]);
+	}
 	
 	if(esh_push_null(esh)) return ESH_FN_ERR;
 	return ESH_FN_RETURN(1);
 }
 
+/*@
+	gc-stats
+	@returns    object
+	
+	Returns the counters of the garbage collector: 'minor-collections', 'major-cycles', 'pause-total-us' and 'pause-max-us' (the time the script was stopped for, in microseconds), 'objects-freed', 'bytes-freed', 'objects-alive', 'bytes-alive', 'bytes-allocated' and 'alloc-rate' (bytes per second since the interpreter was started).
+	The object 'types' holds the number of live objects of each type.
+	
+	--- Examples
+		gc-stats!:types:string # Number of strings that weren't freed yet
+	---
+*/
+static esh_fn_result gc_stats(esh_state *esh, size_t n_args, size_t i) {
+	assert(i == 0);
+	assert(n_args == 0);
+	
+	if(esh_gc_stats(esh)) return ESH_FN_ERR;
+	return ESH_FN_RETURN(1);
+}
+
 /*@
 	foreach-in obj callback
 	obj         any
@@ -2007,25 +2069,57 @@ static esh_fn_result filter(esh_state *esh, size_t n_args, size_t i) {
 	}
 }
 
-static esh_fn_result chars(esh_state *esh, size_t n_args, size_t i) {
-	(void) i;
-	assert(n_args == 1);
+// Iterators keep their cursor in the object, and produce values through esh_type.next without a coroutine of their own
+
+struct chars_iter {
+	esh_object obj;
+	void *stream;
+	bool done;
+};
+
+static int chars_next(esh_state *esh, void *p, size_t size_hint) {
+	(void) size_hint;
+	struct chars_iter *it = p;
+	if(it->done) return esh_push_null(esh);
+	
+	if(esh_push_ref(esh, it, 0)) return 1;
 	// TODO: Should char stream buffering be handled by the caller, or the char_stream_read function?
 	char buff[4];
-	long long res = esh_char_stream_read(esh, 0, buff, 1);
-	if(res == -1) return ESH_FN_ERR;
-	if(res == 0) return ESH_FN_RETURN(1);
+	long long res = esh_char_stream_read(esh, -1, buff, 1);
+	if(res == -1) return 1;
+	
+	size_t clen = 0;
+	if(res != 0) {
+		clen = utf8_next(buff[0]);
+		assert(clen <= 4 && clen >= 1);
+		if(clen != 1) {
+			res = esh_char_stream_read(esh, -1, buff + 1, clen - 1);
+			if(res == -1) return 1;
+			if((size_t) res < clen - 1) clen = 0;
+		}
+	}
+	esh_pop(esh, 1);
 	
-	size_t clen = utf8_next(buff[0]);
-	assert(clen <= 4 && clen >= 1);
-	if(clen != 1) {
-		res = esh_char_stream_read(esh, 0, buff + 1, clen - 1);
-		if(res == -1) return ESH_FN_ERR;
-		if((size_t) res < clen - 1) return ESH_FN_RETURN(1);
+	if(clen == 0) {
+		it->done = true;
+		return esh_push_null(esh);
 	}
+	return esh_new_string(esh, buff, clen);
+}
+
+static esh_type chars_iter_type = { .name = "iterator", .next = chars_next, .n_refs = 1 };
+
+static esh_fn_result chars(esh_state *esh, size_t n_args, size_t i) {
+	(void) i;
+	assert(n_args == 1);
+	if(!esh_is_char_stream(esh, 0)) return ESH_FN_ERR;
+	
+	struct chars_iter *it = esh_new_object(esh, sizeof(struct chars_iter), &chars_iter_type);
+	if(!it) return ESH_FN_ERR;
+	it->done = false;
+	if(esh_set_ref(esh, it, 0, 0)) return ESH_FN_ERR;
 	
-	if(esh_new_string(esh, buff, clen)) return ESH_FN_ERR;
-	return ESH_FN_YIELD(1, 0);	
+	return ESH_FN_RETURN(1);
 }
 
 static esh_fn_result as_string(esh_state *esh, size_t n_args, size_t i) {
@@ -2058,7 +2152,8 @@ static void split_free_locals(esh_state *esh, void *p) {
 	esh_free(esh, locals->buff);
 }
 
-static esh_fn_result split(esh_state *esh, size_t n_args, size_t i) {
+// Splits values read from a coroutine
+static esh_fn_result split_co(esh_state *esh, size_t n_args, size_t i) {
 	struct split_locals *locals = esh_locals(esh, sizeof(*locals), split_free_locals);
 	if(!locals) return ESH_FN_ERR;
 	
@@ -2124,7 +2219,7 @@ static esh_fn_result split(esh_state *esh, size_t n_args, size_t i) {
 			else locals->match = 0;
 			
 			if(locals->match == pattern_len) split = true;
-		} else if(isspace(c)) {
+		} else if(isspace((unsigned char) c)) {
 			locals->match = 1;
 			split = true;
 		}
@@ -2155,6 +2250,156 @@ static esh_fn_result split(esh_state *esh, size_t n_args, size_t i) {
 	}
 }
 
+struct split_iter {
+	esh_object obj;
+	void *stream; // Null when splitting a string
+	
+	// The pattern, followed by the text read from the source that wasn't split off yet
+	char *buff;
+	size_t pattern_len, len, cap;
+	size_t start, at, match;
+	
+	bool has_pattern, at_end, done;
+};
+
+static void split_iter_free(esh_state *esh, void *p) {
+	struct split_iter *it = p;
+	esh_free(esh, it->buff);
+}
+
+static int split_iter_reserve(esh_state *esh, struct split_iter *it, size_t n) {
+	if(it->pattern_len + it->len + n <= it->cap) return 0;
+	
+	size_t new_cap = it->cap * 3 / 2 + n;
+	char *new_buff = esh_realloc(esh, it->buff, sizeof(char) * new_cap);
+	if(!new_buff) {
+		esh_err_printf(esh, "Unable to grow split buffer (out of memory?)");
+		return 1;
+	}
+	it->buff = new_buff;
+	it->cap = new_cap;
+	return 0;
+}
+
+// Reads more of the source char stream, dropping what was already split off
+static int split_iter_read(esh_state *esh, struct split_iter *it) {
+	char *text = it->buff + it->pattern_len;
+	if(it->start != 0) {
+		memmove(text, text + it->start, it->len - it->start);
+		it->len -= it->start;
+		it->at -= it->start;
+		it->start = 0;
+	}
+	
+	const size_t read_size = 512;
+	if(split_iter_reserve(esh, it, read_size)) return 1;
+	
+	if(esh_push_ref(esh, it, 0)) return 1;
+	long long n = esh_char_stream_read(esh, -1, it->buff + it->pattern_len + it->len, read_size);
+	if(n == -1) return 1;
+	esh_pop(esh, 1);
+	
+	if(n == 0) it->at_end = true;
+	it->len += n;
+	return 0;
+}
+
+static int split_next(esh_state *esh, void *p, size_t size_hint) {
+	(void) size_hint;
+	struct split_iter *it = p;
+	if(it->done) return esh_push_null(esh);
+	
+	while(true) {
+		if(it->at == it->len) {
+			if(it->at_end) break;
+			if(split_iter_read(esh, it)) return 1;
+			continue;
+		}
+		
+		const char *pattern = it->buff;
+		const char *text = it->buff + it->pattern_len;
+		char c = text[it->at++];
+		bool split = false;
+		if(it->has_pattern) {
+			if(it->match < it->pattern_len && c == pattern[it->match]) it->match++;
+			else it->match = 0;
+			
+			if(it->match == it->pattern_len) split = true;
+		} else if(isspace((unsigned char) c)) {
+			it->match = 1;
+			split = true;
+		}
+		
+		if(split) {
+			size_t start = it->start;
+			size_t len = it->at - it->match - start;
+			it->start = it->at;
+			it->match = 0;
+			
+			if(it->has_pattern || len != 0) return esh_new_string(esh, text + start, len); // If matching whitespace, then empty strings should not be yielded (e.g "a<space><space>b" should give "a" "b"; not "a" "" "b"
+		}
+	}
+	
+	it->done = true;
+	size_t len = it->len - it->start;
+	if(it->has_pattern || len != 0) return esh_new_string(esh, it->buff + it->pattern_len + it->start, len);
+	return esh_push_null(esh);
+}
+
+static esh_type split_iter_type = { .name = "iterator", .on_free = split_iter_free, .next = split_next, .n_refs = 1 };
+
+static esh_fn_result split(esh_state *esh, size_t n_args, size_t i) {
+	if(i != 0) return ESH_FN_RETURN(1); // The coroutine created by split_co
+	
+	bool is_str = esh_as_string(esh, 0, NULL) != NULL;
+	if(!is_str && !esh_is_char_stream(esh, 0)) {
+		if(esh_new_c_fn(esh, "split", split_co, 1, 1, false)) return ESH_FN_ERR;
+		if(esh_make_coroutine(esh, -1)) return ESH_FN_ERR;
+		for(size_t j = 0; j < n_args; j++) if(esh_dup(esh, j)) return ESH_FN_ERR;
+		return ESH_FN_CALL(n_args, 1);
+	}
+	
+	struct split_iter *it = esh_new_object(esh, sizeof(struct split_iter), &split_iter_type);
+	if(!it) return ESH_FN_ERR;
+	*it = (struct split_iter) {
+		.obj = it->obj,
+		.stream = NULL,
+		
+		.buff = NULL,
+		.pattern_len = 0,
+		.len = 0,
+		.cap = 0,
+		.start = 0,
+		.at = 0,
+		.match = 0,
+		
+		.has_pattern = n_args == 2,
+		.at_end = is_str,
+		.done = false
+	};
+	
+	if(it->has_pattern) {
+		size_t pattern_len;
+		const char *pattern = esh_as_string(esh, 1, &pattern_len);
+		if(!pattern) return ESH_FN_ERR;
+		if(split_iter_reserve(esh, it, pattern_len)) return ESH_FN_ERR;
+		memcpy(it->buff, pattern, pattern_len);
+		it->pattern_len = pattern_len;
+	}
+	
+	if(is_str) {
+		size_t len;
+		const char *str = esh_as_string(esh, 0, &len);
+		if(split_iter_reserve(esh, it, len)) return ESH_FN_ERR;
+		memcpy(it->buff + it->pattern_len, str, len);
+		it->len = len;
+	} else {
+		if(esh_set_ref(esh, it, 0, 0)) return ESH_FN_ERR;
+	}
+	
+	return ESH_FN_RETURN(1);
+}
+
 static esh_fn_result includes(esh_state *esh, size_t n_args, size_t i) {
 	assert(n_args == 2);
 	assert(i == 0);
@@ -2187,6 +2432,29 @@ static esh_fn_result includes(esh_state *esh, size_t n_args, size_t i) {
 	return ESH_FN_RETURN(1);
 }
 
+struct array_iter {
+	esh_object obj;
+	void *arr;
+	long long i;
+	bool done;
+};
+
+static int array_iter_next(esh_state *esh, void *p, size_t size_hint) {
+	(void) size_hint;
+	struct array_iter *it = p;
+	if(it->done) return esh_push_null(esh);
+	
+	if(esh_push_ref(esh, it, 0)) return 1;
+	if(esh_index_i(esh, -1, it->i++)) return 1;
+	esh_swap(esh, -1, -2);
+	esh_pop(esh, 1);
+	
+	if(esh_is_null(esh, -1)) it->done = true;
+	return 0;
+}
+
+static esh_type array_iter_type = { .name = "iterator", .next = array_iter_next, .n_refs = 1 };
+
 /*@
 	iter a
 	a           array of T
@@ -2195,12 +2463,80 @@ static esh_fn_result includes(esh_state *esh, size_t n_args, size_t i) {
 	Returns a coroutine that yields all values in an array in order.
 */
 static esh_fn_result iter(esh_state *esh, size_t n_args, size_t i) {
+	(void) i;
 	assert(n_args == 1);
 	
-	if(esh_index_i(esh, 0, i)) return ESH_FN_ERR;
-	if(esh_is_null(esh, -1)) return ESH_FN_RETURN(1);
+	struct array_iter *it = esh_new_object(esh, sizeof(struct array_iter), &array_iter_type);
+	if(!it) return ESH_FN_ERR;
+	it->i = 0;
+	it->done = false;
+	if(esh_set_ref(esh, it, 0, 0)) return ESH_FN_ERR;
+	
+	return ESH_FN_RETURN(1);
+}
+
+struct object_iter {
+	esh_object obj;
+	void *src;
+	esh_iterator iter;
+};
+
+// Pushes the next key and value of the object, or nothing once the object is done
+static int object_iter_step(esh_state *esh, struct object_iter *it) {
+	if(it->iter.done) return 0;
+	
+	if(esh_push_ref(esh, it, 0)) return 1;
+	if(esh_iter_next(esh, -1, &it->iter)) return 1;
+	if(!it->iter.done) {
+		esh_swap(esh, -3, -2);
+		esh_swap(esh, -2, -1);
+	}
+	esh_pop(esh, 1);
+	
+	return 0;
+}
+
+static int keys_next(esh_state *esh, void *p, size_t size_hint) {
+	(void) size_hint;
+	struct object_iter *it = p;
+	if(object_iter_step(esh, it)) return 1;
+	if(it->iter.done) return esh_push_null(esh);
+	
+	esh_pop(esh, 1);
+	return 0;
+}
+
+static int values_next(esh_state *esh, void *p, size_t size_hint) {
+	(void) size_hint;
+	struct object_iter *it = p;
+	if(object_iter_step(esh, it)) return 1;
+	if(it->iter.done) return esh_push_null(esh);
+	
+	esh_swap(esh, -1, -2);
+	esh_pop(esh, 1);
+	return 0;
+}
+
+static int entries_next(esh_state *esh, void *p, size_t size_hint) {
+	(void) size_hint;
+	struct object_iter *it = p;
+	if(object_iter_step(esh, it)) return 1;
+	if(it->iter.done) return esh_push_null(esh);
+	
+	return esh_new_array(esh, 2);
+}
+
+static esh_type keys_iter_type = { .name = "iterator", .next = keys_next, .n_refs = 1 };
+static esh_type values_iter_type = { .name = "iterator", .next = values_next, .n_refs = 1 };
+static esh_type entries_iter_type = { .name = "iterator", .next = entries_next, .n_refs = 1 };
+
+static esh_fn_result new_object_iter(esh_state *esh, esh_type *type) {
+	struct object_iter *it = esh_new_object(esh, sizeof(struct object_iter), type);
+	if(!it) return ESH_FN_ERR;
+	it->iter = esh_iter_begin(esh);
+	if(esh_set_ref(esh, it, 0, 0)) return ESH_FN_ERR;
 	
-	return ESH_FN_YIELD(1, 0);
+	return ESH_FN_RETURN(1);
 }
 
 /*@
@@ -2211,19 +2547,9 @@ static esh_fn_result iter(esh_state *esh, size_t n_args, size_t i) {
 	Returns a coroutine that yields all keys in an object.
 */
 static esh_fn_result keys(esh_state *esh, size_t n_args, size_t i) {
+	(void) i;
 	assert(n_args == 1);
-	
-	esh_iterator *iter = esh_locals(esh, sizeof(esh_iterator), NULL);
-	if(i == 0) *iter = esh_iter_begin(esh);
-	
-	if(esh_iter_next(esh, 0, iter)) return ESH_FN_ERR;
-	if(iter->done) {
-		if(esh_push_null(esh)) return ESH_FN_ERR;
-		return ESH_FN_RETURN(1);
-	}
-	esh_pop(esh, 1);
-	
-	return ESH_FN_YIELD(1, 0);
+	return new_object_iter(esh, &keys_iter_type);
 }
 
 /*@
@@ -2234,20 +2560,9 @@ static esh_fn_result keys(esh_state *esh, size_t n_args, size_t i) {
 	Returns a coroutine that yields all values in an object.
 */
 static esh_fn_result values(esh_state *esh, size_t n_args, size_t i) {
+	(void) i;
 	assert(n_args == 1);
-	
-	esh_iterator *iter = esh_locals(esh, sizeof(esh_iterator), NULL);
-	if(i == 0) *iter = esh_iter_begin(esh);
-	
-	if(esh_iter_next(esh, 0, iter)) return ESH_FN_ERR;
-	if(iter->done) {
-		if(esh_push_null(esh)) return ESH_FN_ERR;
-		return ESH_FN_RETURN(1);
-	}
-	esh_swap(esh, -1, -2);
-	esh_pop(esh, 1);
-	
-	return ESH_FN_YIELD(1, 0);
+	return new_object_iter(esh, &values_iter_type);
 }
 
 /*@
@@ -2259,19 +2574,9 @@ static esh_fn_result values(esh_state *esh, size_t n_args, size_t i) {
 	Each yielded value is an array of two items, where the first entry is the key and the second the value.
 */
 static esh_fn_result entries(esh_state *esh, size_t n_args, size_t i) {
+	(void) i;
 	assert(n_args == 1);
-	
-	esh_iterator *iter = esh_locals(esh, sizeof(esh_iterator), NULL);
-	if(i == 0) *iter = esh_iter_begin(esh);
-	
-	if(esh_iter_next(esh, 0, iter)) return ESH_FN_ERR;
-	if(iter->done) {
-		if(esh_push_null(esh)) return ESH_FN_ERR;
-		return ESH_FN_RETURN(1);
-	}
-	if(esh_new_array(esh, 2)) return ESH_FN_ERR;
-	
-	return ESH_FN_YIELD(1, 0);
+	return new_object_iter(esh, &entries_iter_type);
 }
 
 /*@
@@ -2394,7 +2699,7 @@ static esh_fn_result replace(esh_state *esh, size_t n_args, size_t i) {
 int esh_load_stdlib(esh_state *esh) {
 	#define REQ(x) if(x) return 1
 	
-	REQ(esh_new_c_fn(esh, "print", print, 0, 0, true));
+	REQ(esh_new_c_leaf_fn(esh, "print", print, 0, 0, true));
 	REQ(esh_set_global(esh, "print"));
 	
 	REQ(esh_new_c_fn(esh, "forevery", forevery, 1, 0, true));
@@ -2406,16 +2711,19 @@ int esh_load_stdlib(esh_state *esh) {
 	REQ(esh_new_c_fn(esh, "gc", gc, 1, 0, false));
 	REQ(esh_set_global(esh, "gc"));
 
-	REQ(esh_new_c_fn(esh, "gc-conf", gc_conf, 1, 0, false));
+	REQ(esh_new_c_fn(esh, "gc-conf", gc_conf, 1, 3, false));
 	REQ(esh_set_global(esh, "gc-conf"));
 	
+	REQ(esh_new_c_fn(esh, "gc-stats", gc_stats, 0, 0, false));
+	REQ(esh_set_global(esh, "gc-stats"));
+	
 	REQ(esh_new_c_fn(esh, "foreach-in", foreach_in, 2, 0, true));
 	REQ(esh_set_global(esh, "foreach-in"));
 	
-	REQ(esh_new_c_fn(esh, "sizeof", sizeof_fn, 1, 0, false));
+	REQ(esh_new_c_leaf_fn(esh, "sizeof", sizeof_fn, 1, 0, false));
 	REQ(esh_set_global(esh, "sizeof"));
 	
-	REQ(esh_new_c_fn(esh, "assert", assert_fn, 1, 0, false));
+	REQ(esh_new_c_leaf_fn(esh, "assert", assert_fn, 1, 0, false));
 	REQ(esh_set_global(esh, "assert"));
 
 	REQ(esh_new_c_fn(esh, "imap", imap, 2, 0, false));
@@ -2430,10 +2738,10 @@ int esh_load_stdlib(esh_state *esh) {
 	REQ(esh_new_c_fn(esh, "fndump", fndump, 1, 0, false));
 	REQ(esh_set_global(esh, "fndump"));
 
-	REQ(esh_new_c_fn(esh, "parse-json", parse_json_fn, 1, 0, false));
+	REQ(esh_new_c_leaf_fn(esh, "parse-json", parse_json_fn, 1, 0, false));
 	REQ(esh_set_global(esh, "parse-json"));
 	
-	REQ(esh_new_c_fn(esh, "to-json", to_json_fn, 1, 0, false));
+	REQ(esh_new_c_leaf_fn(esh, "to-json", to_json_fn, 1, 0, false));
 	REQ(esh_set_global(esh, "to-json"));
 	
 	REQ(esh_new_c_fn(esh, "fori", fori, 2, 0, false));
@@ -2442,67 +2750,67 @@ int esh_load_stdlib(esh_state *esh) {
 	REQ(esh_new_c_fn(esh, "write", write_fn, 2, 0, false));
 	REQ(esh_set_global(esh, "write"));
 	
-	REQ(esh_new_c_fn(esh, "isplit", isplit, 1, 1, false));
+	REQ(esh_new_c_leaf_fn(esh, "isplit", isplit, 1, 1, false));
 	REQ(esh_set_global(esh, "isplit"));
 	
-	REQ(esh_new_c_fn(esh, "join", join, 1, 1, false));
+	REQ(esh_new_c_leaf_fn(esh, "join", join, 1, 1, false));
 	REQ(esh_set_global(esh, "join"));
 	
 	REQ(esh_new_c_fn(esh, "include", include, 1, 0, false));
 	REQ(esh_set_global(esh, "include"));
 	
-	REQ(esh_new_c_fn(esh, "getenv", getenv_fn, 1, 0, false));
+	REQ(esh_new_c_leaf_fn(esh, "getenv", getenv_fn, 1, 0, false));
 	REQ(esh_set_global(esh, "getenv"));
 	
-	REQ(esh_new_c_fn(esh, "beginswith", beginswith, 2, 0, false));
+	REQ(esh_new_c_leaf_fn(esh, "beginswith", beginswith, 2, 0, false));
 	REQ(esh_set_global(esh, "beginswith"));
 	
-	REQ(esh_new_c_fn(esh, "match", match, 2, 0, false));
+	REQ(esh_new_c_leaf_fn(esh, "match", match, 2, 0, false));
 	REQ(esh_set_global(esh, "match"));
 	
-	REQ(esh_new_c_fn(esh, "slice", slice, 3, 0, false));
+	REQ(esh_new_c_leaf_fn(esh, "slice", slice, 3, 0, false));
 	REQ(esh_set_global(esh, "slice"));
 	
-	REQ(esh_new_c_fn(esh, "union", union_fn, 2, 0, false));
+	REQ(esh_new_c_leaf_fn(esh, "union", union_fn, 2, 0, false));
 	REQ(esh_set_global(esh, "union"));
 	
-	REQ(esh_new_c_fn(esh, "intersection", intersection, 2, 0, false));
+	REQ(esh_new_c_leaf_fn(esh, "intersection", intersection, 2, 0, false));
 	REQ(esh_set_global(esh, "intersection"));
 	
-	REQ(esh_new_c_fn(esh, "time", time_fn, 0, 0, false));
+	REQ(esh_new_c_leaf_fn(esh, "time", time_fn, 0, 0, false));
 	REQ(esh_set_global(esh, "time"));
 	
-	REQ(esh_new_c_fn(esh, "localtime", localtime_fn, 0, 1, false));
+	REQ(esh_new_c_leaf_fn(esh, "localtime", localtime_fn, 0, 1, false));
 	REQ(esh_set_global(esh, "localtime"));
 	
-	REQ(esh_new_c_fn(esh, "gmtime", gmtime_fn, 0, 1, false));
+	REQ(esh_new_c_leaf_fn(esh, "gmtime", gmtime_fn, 0, 1, false));
 	REQ(esh_set_global(esh, "gmtime"));
 	
 	REQ(esh_new_c_fn(esh, "forchars", forchars, 2, 0, false));
 	REQ(esh_set_global(esh, "forchars"));
 	
-	REQ(esh_new_c_fn(esh, "strlen", strlen_fn, 1, 0, false));
+	REQ(esh_new_c_leaf_fn(esh, "strlen", strlen_fn, 1, 0, false));
 	REQ(esh_set_global(esh, "strlen"));
 
-	REQ(esh_new_c_fn(esh, "strip", strip, 1, 0, false));
+	REQ(esh_new_c_leaf_fn(esh, "strip", strip, 1, 0, false));
 	REQ(esh_set_global(esh, "strip"));
 	
-	REQ(esh_new_c_fn(esh, "repeat", repeat, 2, 0, false));
+	REQ(esh_new_c_leaf_fn(esh, "repeat", repeat, 2, 0, false));
 	REQ(esh_set_global(esh, "repeat"));
 	
 	REQ(esh_new_c_fn(esh, "readlines", readlines, 2, 0, false));
 	REQ(esh_set_global(esh, "readlines"));
 	
-	REQ(esh_new_c_fn(esh, "puts", puts_fn, 1, 0, false));
+	REQ(esh_new_c_leaf_fn(esh, "puts", puts_fn, 1, 0, false));
 	REQ(esh_set_global(esh, "puts"));
 	
-	REQ(esh_new_c_fn(esh, "ascii", ascii, 0, 0, true));
+	REQ(esh_new_c_leaf_fn(esh, "ascii", ascii, 0, 0, true));
 	REQ(esh_set_global(esh, "ascii"));
 	
-	REQ(esh_new_c_fn(esh, "charcode", charcode, 1, 0, false));
+	REQ(esh_new_c_leaf_fn(esh, "charcode", charcode, 1, 0, false));
 	REQ(esh_set_global(esh, "charcode"));
 	
-	REQ(esh_new_c_fn(esh, "isprint", isprint_fn, 1, 0, false));
+	REQ(esh_new_c_leaf_fn(esh, "isprint", isprint_fn, 1, 0, false));
 	REQ(esh_set_global(esh, "isprint"));
 	
 	REQ(esh_new_c_fn(esh, "try", try_fn, 1, 0, true));
@@ -2511,61 +2819,61 @@ int esh_load_stdlib(esh_state *esh) {
 	REQ(esh_new_c_fn(esh, "stackdump", stackdump, 0, 0, false));
 	REQ(esh_set_global(esh, "stackdump"));
 	
-	REQ(esh_new_c_fn(esh, "time-add", time_add, 1, 0, true));
+	REQ(esh_new_c_leaf_fn(esh, "time-add", time_add, 1, 0, true));
 	REQ(esh_set_global(esh, "time-add"));
 	
 	REQ(esh_new_c_fn(esh, "eval", eval, 1, 0, false));
 	REQ(esh_set_global(esh, "eval"));
 	
-	REQ(esh_new_c_fn(esh, "is-space", is_space, 1, 0, false));
+	REQ(esh_new_c_leaf_fn(esh, "is-space", is_space, 1, 0, false));
 	REQ(esh_set_global(esh, "is-space"));
 	
 	REQ(esh_new_c_fn(esh, "load", load, 1, 0, false));
 	REQ(esh_set_global(esh, "load"));
 	
-	REQ(esh_new_c_fn(esh, "escape-pattern", escape_pattern, 1, 0, false));
+	REQ(esh_new_c_leaf_fn(esh, "escape-pattern", escape_pattern, 1, 0, false));
 	REQ(esh_set_global(esh, "escape-pattern"));
 	
-	REQ(esh_new_c_fn(esh, "is-string", is_string, 1, 0, false));
+	REQ(esh_new_c_leaf_fn(esh, "is-string", is_string, 1, 0, false));
 	REQ(esh_set_global(esh, "is-string"));
 	
 	REQ(esh_new_c_fn(esh, "load-dl", load_dl, 1, 0, false));
 	REQ(esh_set_global(esh, "load-dl"));
 	
-	REQ(esh_new_c_fn(esh, "endswith", endswith, 2, 0, false));
+	REQ(esh_new_c_leaf_fn(esh, "endswith", endswith, 2, 0, false));
 	REQ(esh_set_global(esh, "endswith"));
 
-	REQ(esh_new_c_fn(esh, "exists", exists, 1, 0, false));
+	REQ(esh_new_c_leaf_fn(esh, "exists", exists, 1, 0, false));
 	REQ(esh_set_global(esh, "exists"));
 	
-	REQ(esh_new_c_fn(esh, "is-defined", is_defined, 0, 0, true));
+	REQ(esh_new_c_leaf_fn(esh, "is-defined", is_defined, 0, 0, true));
 	REQ(esh_set_global(esh, "is-defined"));
 	
-	REQ(esh_new_c_fn(esh, "max", max_fn, 1, 0, true));
+	REQ(esh_new_c_leaf_fn(esh, "max", max_fn, 1, 0, true));
 	REQ(esh_set_global(esh, "max"));
 	
-	REQ(esh_new_c_fn(esh, "min", min_fn, 1, 0, true));
+	REQ(esh_new_c_leaf_fn(esh, "min", min_fn, 1, 0, true));
 	REQ(esh_set_global(esh, "min"));
 	
-	REQ(esh_new_c_fn(esh, "alphsort", alphsort, 1, 0, false));
+	REQ(esh_new_c_leaf_fn(esh, "alphsort", alphsort, 1, 0, false));
 	REQ(esh_set_global(esh, "alphsort"));
 
-	REQ(esh_new_c_fn(esh, "numsort", numsort, 1, 0, false));
+	REQ(esh_new_c_leaf_fn(esh, "numsort", numsort, 1, 0, false));
 	REQ(esh_set_global(esh, "numsort"));
 	
-	REQ(esh_new_c_fn(esh, "base64/encode", base64_encode, 1, 0, false));
+	REQ(esh_new_c_leaf_fn(esh, "base64/encode", base64_encode, 1, 0, false));
 	REQ(esh_set_global(esh, "base64/encode"));
 	
-	REQ(esh_new_c_fn(esh, "hex/encode", hex_encode, 1, 0, false));
+	REQ(esh_new_c_leaf_fn(esh, "hex/encode", hex_encode, 1, 0, false));
 	REQ(esh_set_global(esh, "hex/encode"));
 	
-	REQ(esh_new_c_fn(esh, "hex/decode", hex_decode, 1, 0, false));
+	REQ(esh_new_c_leaf_fn(esh, "hex/decode", hex_decode, 1, 0, false));
 	REQ(esh_set_global(esh, "hex/decode"));
 	
-	REQ(esh_new_c_fn(esh, "substr", substr, 2, 1, false));
+	REQ(esh_new_c_leaf_fn(esh, "substr", substr, 2, 1, false));
 	REQ(esh_set_global(esh, "substr"));
 	
-	REQ(esh_new_c_fn(esh, "utf16/encode", utf16_encode_fn, 1, 0, false));
+	REQ(esh_new_c_leaf_fn(esh, "utf16/encode", utf16_encode_fn, 1, 0, false));
 	REQ(esh_set_global(esh, "utf16/encode"));
 	
 	REQ(esh_new_c_fn(esh, "co", coroutine_fn, 1, 0, false));
@@ -2591,34 +2899,28 @@ int esh_load_stdlib(esh_state *esh) {
 	REQ(esh_make_coroutine(esh, -1));
 	REQ(esh_set_global(esh, "filter"));
 	
-	REQ(esh_new_c_fn(esh, "chars", chars, 1, 0, false));
-	REQ(esh_make_coroutine(esh, -1));
+	REQ(esh_new_c_leaf_fn(esh, "chars", chars, 1, 0, false));
 	REQ(esh_set_global(esh, "chars"));
 	
-	REQ(esh_new_c_fn(esh, "as-string", as_string, 1, 0, false));
+	REQ(esh_new_c_leaf_fn(esh, "as-string", as_string, 1, 0, false));
 	REQ(esh_set_global(esh, "as-string"));
 
 	REQ(esh_new_c_fn(esh, "split", split, 1, 1, false));
-	REQ(esh_make_coroutine(esh, -1));
 	REQ(esh_set_global(esh, "split"));
 	
-	REQ(esh_new_c_fn(esh, "includes", includes, 2, 0, false));
+	REQ(esh_new_c_leaf_fn(esh, "includes", includes, 2, 0, false));
 	REQ(esh_set_global(esh, "includes"));
 	
-	REQ(esh_new_c_fn(esh, "iter", iter, 1, 0, false));
-	REQ(esh_make_coroutine(esh, -1));
+	REQ(esh_new_c_leaf_fn(esh, "iter", iter, 1, 0, false));
 	REQ(esh_set_global(esh, "iter"));
 
-	REQ(esh_new_c_fn(esh, "keys", keys, 1, 0, false));
-	REQ(esh_make_coroutine(esh, -1));
+	REQ(esh_new_c_leaf_fn(esh, "keys", keys, 1, 0, false));
 	REQ(esh_set_global(esh, "keys"));
 	
-	REQ(esh_new_c_fn(esh, "values", values, 1, 0, false));
-	REQ(esh_make_coroutine(esh, -1));
+	REQ(esh_new_c_leaf_fn(esh, "values", values, 1, 0, false));
 	REQ(esh_set_global(esh, "values"));
 
-	REQ(esh_new_c_fn(esh, "entries", entries, 1, 0, false));
-	REQ(esh_make_coroutine(esh, -1));
+	REQ(esh_new_c_leaf_fn(esh, "entries", entries, 1, 0, false));
 	REQ(esh_set_global(esh, "entries"));
 	
 	REQ(esh_new_c_fn(esh, "collect", collect, 1, 0, false));
@@ -2627,7 +2929,7 @@ int esh_load_stdlib(esh_state *esh) {
 	REQ(esh_new_c_fn(esh, "nth", nth, 2, 0, false));
 	REQ(esh_set_global(esh, "nth"));
 
-	REQ(esh_new_c_fn(esh, "replace", replace, 3, 0, false));
+	REQ(esh_new_c_leaf_fn(esh, "replace", replace, 3, 0, false));
 	REQ(esh_set_global(esh, "replace"));
 
 	#ifdef __unix__
@@ -115,6 +115,9 @@ typedef struct cmd_opts {
 	int args_from;
 	
 	int gc_freq;
+	int gc_mode;
+	bool gc_trace;
+	int peephole;
 } cmd_opts;
 
 static bool parse_longopt(const char *opt, const char *next_arg, cmd_opts *opts) {
@@ -134,6 +137,32 @@ static bool parse_longopt(const char *opt, const char *next_arg, cmd_opts *opts)
 		return true;
 	}
 	
+	if(strcmp(opt, "gc-mode") == 0) {
+		if(!next_arg) {
+			fprintf(stderr, "'--%s' requires an argument\n", opt);
+			exit(-1);
+		}
+		if(strcmp(next_arg, "count") == 0) opts->gc_mode = ESH_GC_MODE_COUNT;
+		else if(strcmp(next_arg, "bytes") == 0) opts->gc_mode = ESH_GC_MODE_BYTES;
+		else if(strcmp(next_arg, "adaptive") == 0) opts->gc_mode = ESH_GC_MODE_ADAPTIVE;
+		else if(strcmp(next_arg, "concurrent") == 0) opts->gc_mode = ESH_GC_MODE_CONCURRENT;
+		else {
+			fprintf(stderr, "Invalid option '%s' for '--%s' (must be 'count', 'bytes', 'adaptive' or 'concurrent')\n", next_arg, opt);
+			exit(-1);
+		}
+		return true;
+	}
+	
+	if(strcmp(opt, "gc-trace") == 0) {
+		opts->gc_trace = true;
+		return false;
+	}
+	
+	if(strcmp(opt, "no-peephole") == 0) {
+		opts->peephole = 0;
+		return false;
+	}
+	
 	fprintf(stderr, "Unkown option '--%s'\n", opt);
 	exit(-1);
 }
@@ -150,12 +179,15 @@ static bool parse_shortopt(char opt, const char *next_arg, cmd_opts *opts) {
 static void parse_cmd_opts(int argc, const char **argv, cmd_opts *opts) {
 	opts->script = NULL;
 	opts->gc_freq = -1;
+	opts->gc_mode = -1;
+	opts->gc_trace = false;
+	opts->peephole = -1;
 	
 	for(int i = 1; i < argc; i++) {
 		const char *arg = argv[i];
 		const char *next = i == argc - 1? NULL : argv[i + 1];
 		if(arg[0] == '-') {
-			bool used_arg;
+			bool used_arg = false;
 			if(arg[1] == '-') used_arg = parse_longopt(arg + 2, next, opts);
 			else for(const char *c = arg + 1; *c != '\0'; c++) {
 				bool res = parse_shortopt(*c, next, opts);
@@ -193,6 +225,9 @@ int main(int argc, const char **argv) {
 	cmd_opts opts;
 	parse_cmd_opts(argc, argv, &opts);
 	esh_gc_conf(esh, opts.gc_freq, -1);
+	esh_gc_pacing_conf(esh, opts.gc_mode, -1, -1, -1);
+	esh_gc_trace(esh, opts.gc_trace);
+	esh_opt_conf(esh, opts.peephole);
 	
 	if(opts.script) {
 		if(esh_object_of(esh, 0)) goto ESH_ERR;
@@ -93,7 +93,11 @@ static esh_type char_stream_type = {
 	descriptor should not be closed manually; outside of using char_stream_close(), of course.
 */
 static esh_char_stream *new_char_stream(esh_state *esh, int fd) {
-	if(char_stream_limit && n_char_streams >= char_stream_limit) esh_gc(esh, 0);
+	// Streams that were dropped before being read to the end are usually still young, so a minor collection gets most descriptors back without tracing the whole heap
+	if(char_stream_limit && n_char_streams >= char_stream_limit) {
+		esh_gc_minor(esh);
+		if(n_char_streams >= char_stream_limit) esh_gc(esh, 0);
+	}
 	
 	esh_char_stream *cs = esh_new_object(esh, sizeof(esh_char_stream), &char_stream_type);
 	if(!cs) return NULL;
@@ -213,6 +213,65 @@ void test_c_fn_as_cmd() {
 	esh_close(esh);
 }
 
+esh_fn_result c_leaf_fn(esh_state *esh, size_t n_args, size_t i) {
+	ASSERT(i == 0, NULL);
+	ASSERT(n_args == 1, NULL);
+	
+	long long x;
+	if(esh_as_int(esh, 0, &x)) return ESH_FN_ERR;
+	if(x < 0) {
+		esh_err_printf(esh, "Negative argument");
+		return ESH_FN_ERR;
+	}
+	
+	if(esh_push_int(esh, x + 1)) return ESH_FN_ERR;
+	if(esh_push_int(esh, x * 2)) return ESH_FN_ERR;
+	return ESH_FN_RETURN(2);
+}
+
+void test_c_leaf_fn() {
+	esh_state *esh = esh_open(NULL);
+	
+	ASSERT(!esh_new_c_leaf_fn(esh, "leaf", c_leaf_fn, 1, 0, false), NULL);
+	ASSERT(!esh_set_global(esh, "leaf"), NULL);
+	
+	const char *src =
+		"function f with x do\n"
+		"	local a, b = leaf $x\n"
+		"	local c = ($leaf $x)\n"
+		"	return \"$a $b $($c:0) $($c:1)\"\n"
+		"end\n"
+		"r = f 3\n"
+		"n = 0\n"
+		"while $n < 100 do\n"
+		"	n, d = leaf $n\n"
+		"end\n"
+	;
+	int err = esh_loads(esh, "test", src, false);
+	ASSERT(!err, NULL);
+	err = esh_exec_fn(esh);
+	ASSERT(!err, NULL);
+	
+	ASSERT_GLOBAL_STR("r", "4 6 4 6");
+	ASSERT_GLOBAL_STR("n", "100");
+	ASSERT_GLOBAL_STR("d", "198");
+	
+	// Errors still unwind through, and are traced as, a frame of the leaf function
+	src =
+		"function g with x do\n"
+		"	leaf $x\n"
+		"end\n"
+		"g (0 - 1)\n"
+	;
+	err = esh_loads(esh, "test", src, false);
+	ASSERT(!err, NULL);
+	err = esh_exec_fn(esh);
+	ASSERT(err, NULL);
+	ASSERT(strstr(esh_get_stack_trace(esh), "leaf\ng") != NULL, esh_get_stack_trace(esh));
+	
+	esh_close(esh);
+}
+
 void test_local_vars() {
 	esh_state *esh = esh_open(NULL);
 	
@@ -1329,3 +1388,677 @@ void test_exec_non_upval_function() {
 	
 	esh_close(esh);
 }
+
+void test_int_values() {
+	esh_state *esh = t_env(
+		"a = 60 * 60 * 24 * 365 * 1000\n"
+		"b = \"n=$($a + 1)\"\n"
+		"c = (5 == \"5\")\n"
+		"d = (\"-12\" == (0 - 12))\n"
+		"e = (05 == 5) or different\n"
+		"f = -7 + 2\n"
+		"g = { 1, 2, 3 }:2\n"
+	);
+	
+	int err = esh_exec_fn(esh);
+	ASSERT(!err, NULL);
+	
+	ASSERT_GLOBAL_STR("a", "31536000000");
+	ASSERT_GLOBAL_STR("b", "n=31536000001");
+	ASSERT_GLOBAL_STR("c", "true");
+	ASSERT_GLOBAL_STR("d", "true");
+	ASSERT_GLOBAL_STR("e", "different");
+	ASSERT_GLOBAL_STR("f", "-5");
+	ASSERT_GLOBAL_STR("g", "3");
+	
+	err = esh_push_int(esh, 9000000000000000000ll);
+	ASSERT(!err, NULL);
+	err = esh_push_int(esh, -123456789);
+	ASSERT(!err, NULL);
+	long long i;
+	ASSERT(!esh_as_int(esh, -2, &i) && i == 9000000000000000000ll, NULL);
+	const char *s1 = esh_as_string(esh, -2, NULL);
+	const char *s2 = esh_as_string(esh, -1, NULL);
+	ASSERT(s1 && strcmp(s1, "9000000000000000000") == 0, NULL);
+	ASSERT(s2 && strcmp(s2, "-123456789") == 0, NULL);
+	
+	esh_close(esh);
+}
+
+void test_global_inline_cache() {
+	esh_state *esh = t_env(
+		"function get with do return $g end\n"
+		"function run with do r = get! end\n"
+		"g = 1\n"
+	);
+	
+	int err = esh_exec_fn(esh);
+	ASSERT(!err, NULL);
+	
+	ASSERT(!esh_get_global(esh, "run") && !esh_exec_fn(esh), NULL);
+	ASSERT_GLOBAL_STR("r", "1");
+	
+	ASSERT(!esh_new_string(esh, "2", 1) && !esh_set_global(esh, "g"), NULL);
+	ASSERT(!esh_get_global(esh, "run") && !esh_exec_fn(esh), NULL);
+	ASSERT_GLOBAL_STR("r", "2");
+	
+	for(int i = 0; i < 200; i++) { // Forces the globals table to be rehashed
+		char name[16];
+		snprintf(name, sizeof(name), "v%i", i);
+		ASSERT(!esh_push_int(esh, i) && !esh_set_global(esh, name), NULL);
+	}
+	ASSERT(!esh_new_string(esh, "3", 1) && !esh_set_global(esh, "g"), NULL);
+	ASSERT(!esh_get_global(esh, "run") && !esh_exec_fn(esh), NULL);
+	ASSERT_GLOBAL_STR("r", "3");
+	
+	ASSERT(!esh_push_null(esh) && !esh_set_global(esh, "g"), NULL);
+	ASSERT(!esh_get_global(esh, "run"), NULL);
+	ASSERT(esh_exec_fn(esh), NULL);
+	
+	esh_close(esh);
+}
+
+static const char *peephole_src =
+	"function count with n acc do\n"
+	"	if $n < 1 or $n == 0 then\n"
+	"		return $acc\n"
+	"	end\n"
+	"	acc = $acc + 1\n"
+	"	return count ($n - 1) $acc\n"
+	"end\n"
+	"function two with do\n"
+	"	return 3, 4\n"
+	"end\n"
+	"function run with do\n"
+	"	local s = \"5\"\n"
+	"	s = $s - 2\n"
+	"	local big = 2305843009213693951\n"
+	"	big = $big + 1\n"
+	"	local o = { 10, 20, k = { v = 7 } }\n"
+	"	function pair with do\n"
+	"		return $s, $o:1\n"
+	"	end\n"
+	"	local a, b = pair!\n"
+	"	local c, d = two!\n"
+	"	local e = \"none\"\n"
+	"	if not ($a > 2) then\n"
+	"		e = \"small\"\n"
+	"	else if $a != 3 and $b == 20 then\n"
+	"		e = \"odd\"\n"
+	"	else\n"
+	"		e = \"three\"\n"
+	"	end\n"
+	"	local f = $a == 3 and $b == 20 and $c < $d\n"
+	"	local g = $a == 4 or $b == 21 or \"fallback\"\n"
+	"	local h = count 5 0\n"
+	"	return \"$s $a $b $c $d $e $f $g $($o:k:v) $({5, 6, 7}:1) $h\", $big\n"
+	"end\n"
+	"r, big = run!\n";
+
+void test_peephole() { // The optimized and unoptimized code should behave identically
+	for(int peephole = 0; peephole <= 1; peephole++) {
+		esh_state *esh = esh_open(NULL);
+		ASSERT(esh != NULL, NULL);
+		esh_opt_conf(esh, peephole);
+		
+		int err = esh_loads(esh, "test", peephole_src, false);
+		ASSERT(!err, NULL);
+		err = esh_exec_fn(esh);
+		ASSERT(!err, NULL);
+		
+		ASSERT_GLOBAL_STR("r", "3 3 20 3 4 three true fallback 7 6 5");
+		if(sizeof(void *) == 8) ASSERT_GLOBAL_STR("big", "2305843009213693952");
+		
+		esh_close(esh);
+	}
+}
+
+void test_co_shared_closure() {
+	esh_state *esh = t_env(
+		"f = with x do\n"
+		"	yield $x\n"
+		"	yield ($x + 1)\n"
+		"end\n"
+		"co $f\n"
+		"g = f 5\n"
+		"a = \"$(next $g) $(next $g)\"\n"
+		"function mk with do\n"
+		"	return with x do return $x * 2 end\n"
+		"end\n"
+		"h = mk!\n"
+		"co $h\n"
+		"k = mk!\n"
+		"b = k 4\n" // Only the closure given to co is a coroutine
+	);
+	int err = esh_load_stdlib(esh);
+	ASSERT(!err, NULL);
+	
+	err = esh_exec_fn(esh);
+	ASSERT(!err, NULL);
+	
+	ASSERT_GLOBAL_STR("a", "5 6");
+	ASSERT_GLOBAL_STR("b", "8");
+	
+	esh_close(esh);
+}
+
+void test_constant_folding() {
+	esh_state *esh = t_env(
+		"function mk with x do\n"
+		"	return const { 1, 2, k = const { v = \"z\" } }, const { 1, $x }\n"
+		"end\n"
+		"a = 60 * 60 * 24 - 400 / 4\n"
+		"b = \"day=$(60 * 60 * 24)s $a\"\n"
+		"c = (1 < 2) and not (\"1\" == 2)\n"
+		"d = \"$(1 + 1)\"\n"
+		"o1, p1 = mk 1\n"
+		"o2, p2 = mk 2\n"
+		"e = $o1:k:v\n"
+		"f = ($o1 == $o2) and ($p1 != $p2)\n"
+		"function never with do\n" // Overflowing products and literals that don't fit in an int are left to the runtime
+		"	print (2305843009213693951 * 16) (-2305843009213693951 * 2305843009213693951)\n"
+		"	print (-9223372036854775808 / -1) (9223372036854775807 + 1)\n"
+		"end\n"
+		"g = 7 / 0\n"
+		"h = 2305843009213693951 * 4\n"
+	);
+	
+	int err = esh_exec_fn(esh);
+	ASSERT(!err, NULL);
+	
+	ASSERT_GLOBAL_STR("a", "86300");
+	ASSERT_GLOBAL_STR("b", "day=86400s 86300");
+	ASSERT_GLOBAL_STR("d", "2");
+	ASSERT_GLOBAL_STR("c", "true");
+	ASSERT_GLOBAL_STR("e", "z");
+	ASSERT_GLOBAL_STR("f", "true"); // The literal constant object is shared, the other one is rebuilt on each call
+	ASSERT_GLOBAL_STR("g", "0");
+	ASSERT_GLOBAL_STR("h", "9223372036854775804");
+	
+	ASSERT(!esh_get_global(esh, "o1"), NULL);
+	ASSERT(!esh_push_int(esh, 5), NULL);
+	ASSERT(esh_set_s(esh, -2, "k", 1, -1), "Constant object was mutated");
+	
+	esh_close(esh);
+}
+
+void test_native_loops() {
+	esh_state *esh = t_env(
+		"a = 2\n"
+		"b = 5\n"
+		"s = \"\"\n"
+		"for i in $a..$b do s = \"$s$i\" end\n"
+		"for i in 0..10 do\n"
+		"	if $i == 2 then continue end\n"
+		"	if $i == 5 then break end\n"
+		"	s = \"$s,$i\"\n"
+		"end\n"
+		"n = 0\n"
+		"t = 0\n"
+		"while $n < 3 do\n"
+		"	for j in 0..100 do\n"
+		"		if $j == $n then break end\n"
+		"		t = $t + 1\n"
+		"	end\n"
+		"	n = $n + 1\n"
+		"end\n"
+		"function sum with x do\n"
+		"	local s = 0\n"
+		"	for i in 0..$x do s = $s + $i end\n"
+		"	return $s\n"
+		"end\n"
+		"u = sum 100\n"
+		"while = 1\n"
+	);
+	
+	int err = esh_exec_fn(esh);
+	ASSERT(!err, NULL);
+	
+	ASSERT_GLOBAL_STR("s", "234,0,1,3,4");
+	ASSERT_GLOBAL_STR("t", "3");
+	ASSERT_GLOBAL_STR("u", "4950");
+	ASSERT_GLOBAL_STR("while", "1"); // The keywords are only reserved in statement position
+	
+	esh_close(esh);
+}
+
+void test_closure_captures() {
+	esh_state *esh = t_env(
+		"function counter with start do\n"
+		"	local unused = 10\n"
+		"	local n = $start\n"
+		"	return with do\n"
+		"		n = $n + 1\n"
+		"		return $n\n"
+		"	end\n"
+		"end\n"
+		"c = counter 5\n"
+		"c!\n"
+		"r = c!\n"
+		"function outer with a b do\n"
+		"	local x = \"x\"\n"
+		"	return with do return with do return \"$b$x\" end end\n"
+		"end\n"
+		"inner = ((outer 1 2)!)\n"
+		"s = inner!\n"
+		"make = with do return with x do return $x end end\n"
+		"same = \"no\"\n"
+		"if (make!) == (make!) then same = \"yes\" end\n"
+	);
+	
+	int err = esh_exec_fn(esh);
+	ASSERT(!err, NULL);
+	
+	ASSERT_GLOBAL_STR("r", "7");
+	ASSERT_GLOBAL_STR("s", "2x");
+	ASSERT_GLOBAL_STR("same", "yes"); // Closures without free variables are only created once
+	
+	esh_close(esh);
+}
+
+static size_t t_realloc_calls = 0;
+static long long t_live_blocks = 0;
+
+static void *t_counting_realloc(void *p, size_t n) {
+	if(n == 0) {
+		if(p) t_live_blocks--;
+		free(p);
+		return NULL;
+	}
+	
+	if(!p) t_live_blocks++;
+	t_realloc_calls++;
+	return realloc(p, n);
+}
+
+void test_compile_allocations() { // The compiler takes its buffers from an arena, and repeated names share an immediate
+	size_t calls[2];
+	for(int i = 0; i < 2; i++) {
+		size_t reps = i == 0? 100 : 1000;
+		const char *line = "echo repeated-argument $repeated-global\n";
+		esh_state *esh = esh_open(t_counting_realloc);
+		ASSERT(esh != NULL, NULL);
+		esh_gc_conf(esh, 0, -1);
+		
+		char *src = malloc(strlen(line) * reps + 1);
+		ASSERT(src != NULL, NULL);
+		src[0] = '\0';
+		for(size_t j = 0; j < reps; j++) strcat(src, line);
+		
+		size_t before = t_realloc_calls;
+		ASSERT(!esh_loads(esh, "test", src, false), NULL);
+		calls[i] = t_realloc_calls - before;
+		
+		free(src);
+		if(i == 1) ASSERT(calls[1] < calls[0] + 10, "Compiling allocates for every statement");
+		esh_close(esh);
+	}
+}
+
+void test_index_inline_cache() {
+	esh_state *esh = t_env(
+		"function get_x with o do return $o:x end\n"
+		"function set_x with o v do o:x = $v end\n"
+		"a = { x = 1, y = 2 }\n"
+		"b = { y = 3, x = 4 }\n"
+		"c = { x = 5, y = 6 }\n"
+		"r = \"$(get_x $a) $(get_x $b) $(get_x $c) $(get_x $a)\"\n"
+		"set_x $a 7\n"
+		"set_x $b 8\n"
+		"set_x $c null\n"
+		"set_x $a 9\n"
+		"s = \"$(get_x $a) $(get_x $b) $($c:y)\"\n"
+		"u = \"set\"\n"
+		"if not get_x $c then u = \"unset\" end\n"
+		"k = const { x = 10 }\n"
+		"t = get_x $k\n"
+	);
+	
+	int err = esh_exec_fn(esh);
+	ASSERT(!err, NULL);
+	
+	ASSERT_GLOBAL_STR("r", "1 4 5 1");
+	ASSERT_GLOBAL_STR("s", "9 8 6");
+	ASSERT_GLOBAL_STR("u", "unset");
+	ASSERT_GLOBAL_STR("t", "10");
+	
+	// Cached stores must not bypass constness
+	ASSERT(esh_loads(esh, "test", "set_x $k 1\n", false) == 0, NULL);
+	ASSERT(esh_exec_fn(esh) != 0, "Constant object was mutated");
+	
+	esh_close(esh);
+}
+
+static size_t n_tracked_freed;
+
+static void tracked_free(esh_state *esh, void *obj) {
+	(void) esh, (void) obj;
+	n_tracked_freed++;
+}
+
+static esh_type tracked_type = { .name = "tracked", .on_free = tracked_free };
+
+void test_generational_gc() {
+	esh_state *esh = t_env(NULL);
+	esh_gc_conf(esh, 1, -1); // Collect the young generation on every allocation
+	n_tracked_freed = 0;
+	
+	ASSERT(!esh_object_of(esh, 0), NULL);
+	esh_gc(esh, 0); // The object is promoted to the old generation
+	
+	// Temporaries are freed by minor collections, while the old generation is too small for a major cycle
+	for(int i = 0; i < 100; i++) {
+		ASSERT(esh_new_object(esh, sizeof(esh_object), &tracked_type) != NULL, NULL);
+		esh_pop(esh, 1);
+	}
+	ASSERT(n_tracked_freed == 99, "Young garbage was not collected");
+	
+	// A young object that is only referenced by an old one is kept alive through the remembered set
+	ASSERT(esh_new_object(esh, sizeof(esh_object), &tracked_type) != NULL, NULL);
+	ASSERT(!esh_new_string(esh, "key", 3), NULL);
+	ASSERT(!esh_set(esh, -3, -1, -2), NULL);
+	esh_pop(esh, 2);
+	
+	for(int i = 0; i < 100; i++) {
+		ASSERT(!esh_new_string(esh, "temporary", 9), NULL);
+		esh_pop(esh, 1);
+	}
+	ASSERT(n_tracked_freed == 100, "Referenced young object was collected");
+	
+	ASSERT(!esh_index_s(esh, -1, "key", 3), NULL);
+	ASSERT(esh_as_type(esh, -1, &tracked_type) != NULL, NULL);
+	
+	esh_close(esh);
+}
+
+void test_lazy_sweep() {
+	esh_state *esh = t_env(NULL);
+	esh_gc_conf(esh, 0, -1);
+	n_tracked_freed = 0;
+	
+	ASSERT(!esh_object_of(esh, 0), NULL);
+	ASSERT(esh_new_object(esh, sizeof(esh_object), &tracked_type) != NULL, NULL);
+	ASSERT(!esh_object_of(esh, 0), NULL);
+	for(int i = 0; i < 2000; i++) {
+		ASSERT(esh_new_object(esh, sizeof(esh_object), &tracked_type) != NULL, NULL);
+		ASSERT(!esh_set_i(esh, -2, i, -1), NULL);
+		esh_pop(esh, 1);
+	}
+	esh_gc(esh, 0);
+	ASSERT(n_tracked_freed == 0, "Referenced objects were collected");
+	esh_pop(esh, 1);
+	
+	// Garbage is freed a slab at a time by the steps after marking
+	int steps = 0;
+	while(n_tracked_freed == 0 && steps++ < 100000) esh_gc(esh, 1);
+	ASSERT(n_tracked_freed != 0, "Garbage was never swept");
+	#ifndef NO_POOL
+	ASSERT(n_tracked_freed < 2000, "Sweep wasn't incremental");
+	#endif
+	
+	esh_gc(esh, 0);
+	ASSERT(n_tracked_freed == 2000, "Garbage was not collected");
+	ASSERT(esh_as_type(esh, -1, &tracked_type) != NULL, NULL);
+	
+	esh_close(esh);
+}
+
+void test_intern_during_sweep() {
+	esh_state *esh = t_env(NULL);
+	esh_gc_conf(esh, 0, -1);
+	n_tracked_freed = 0;
+	
+	// Old interned keys that nothing references anymore, in slabs interleaved with garbage
+	ASSERT(!esh_object_of(esh, 0), NULL);
+	ASSERT(!esh_object_of(esh, 0), NULL);
+	char key[32];
+	for(int i = 0; i < 2000; i++) {
+		int len = snprintf(key, sizeof(key), "long interned key %i", i);
+		ASSERT(esh_new_object(esh, sizeof(esh_object), &tracked_type) != NULL, NULL);
+		ASSERT(!esh_set_s(esh, -2, key, len, -1), NULL);
+		esh_pop(esh, 1);
+	}
+	esh_gc(esh, 0);
+	esh_pop(esh, 1);
+	
+	int steps = 0;
+	while(n_tracked_freed == 0 && steps++ < 100000) esh_gc(esh, 1);
+	
+	// Interning the keys again while the sweep is underway must keep them alive
+	for(int i = 0; i < 2000; i++) {
+		int len = snprintf(key, sizeof(key), "long interned key %i", i);
+		ASSERT(!esh_set_s(esh, -1, key, len, -1), NULL);
+	}
+	esh_gc(esh, 0);
+	esh_gc(esh, 0);
+	
+	for(int i = 0; i < 2000; i++) {
+		int len = snprintf(key, sizeof(key), "long interned key %i", i);
+		ASSERT(!esh_index_s(esh, -1, key, len), NULL);
+		ASSERT(!esh_is_null(esh, -1), "Interned key was freed by the sweep");
+		esh_pop(esh, 1);
+	}
+	
+	esh_close(esh);
+}
+
+void test_gc_byte_pacing() {
+	esh_state *esh = t_env(NULL);
+	esh_gc_pacing_conf(esh, ESH_GC_MODE_BYTES, 4096, -1, -1);
+	n_tracked_freed = 0;
+	
+	for(int i = 0; i < 10; i++) {
+		ASSERT(esh_new_object(esh, sizeof(esh_object), &tracked_type) != NULL, NULL);
+		esh_pop(esh, 1);
+	}
+	ASSERT(n_tracked_freed == 0, "Collected before the nursery was full");
+	
+	// A single large allocation fills the nursery, however few allocations were made
+	static char big[8192];
+	ASSERT(!esh_new_string(esh, big, sizeof(big)), NULL);
+	ASSERT(n_tracked_freed == 10, "Large allocation didn't run the GC");
+	
+	esh_close(esh);
+}
+
+void test_gc_stats() {
+	esh_state *esh = t_env(NULL);
+	esh_gc_conf(esh, 0, -1);
+	
+	ASSERT(!esh_object_of(esh, 0), NULL);
+	for(int i = 0; i < 15; i++) {
+		ASSERT(esh_new_object(esh, sizeof(esh_object), &tracked_type) != NULL, NULL);
+		if(i < 10) ASSERT(!esh_set_i(esh, -2, i, -1), NULL);
+		esh_pop(esh, 1);
+	}
+	esh_gc(esh, 0);
+	
+	ASSERT(!esh_gc_stats(esh), NULL);
+	long long n;
+	ASSERT(!esh_index_s(esh, -1, "types", 5), NULL);
+	ASSERT(!esh_index_s(esh, -1, "tracked", 7), NULL);
+	ASSERT(!esh_as_int(esh, -1, &n) && n == 10, "Live objects were miscounted");
+	esh_pop(esh, 2);
+	
+	ASSERT(!esh_index_s(esh, -1, "objects-freed", 13), NULL);
+	ASSERT(!esh_as_int(esh, -1, &n) && n >= 5, "Freed objects were not counted");
+	esh_pop(esh, 1);
+	ASSERT(!esh_index_s(esh, -1, "major-cycles", 12), NULL);
+	ASSERT(!esh_as_int(esh, -1, &n) && n == 1, NULL);
+	
+	esh_close(esh);
+}
+
+static long long t_live_objects(esh_state *esh) {
+	long long n = 0;
+	ASSERT(!esh_gc_stats(esh), NULL);
+	ASSERT(!esh_index_s(esh, -1, "types", 5), NULL);
+	ASSERT(!esh_index_s(esh, -1, "object", 6), NULL);
+	if(!esh_is_null(esh, -1)) ASSERT(!esh_as_int(esh, -1, &n), NULL);
+	esh_pop(esh, 3);
+	return n;
+}
+
+void test_multiple_returns_unboxed() { // Values that are unpacked or discarded right away stay on the stack
+	for(int peephole = 0; peephole <= 1; peephole++) {
+		esh_state *esh = t_env(NULL);
+		esh_gc_conf(esh, 0, -1);
+		esh_opt_conf(esh, peephole);
+		
+		const char *src =
+			"function two with x do\n"
+			"	return $x, ($x + 1)\n"
+			"end\n"
+			"function run with n do\n"
+			"	local i = 0\n"
+			"	local s = 0\n"
+			"	while $i < $n do\n"
+			"		two $i\n"
+			"		$two $i\n"
+			"		local a, b = two $i\n"
+			"		c, d = ($two $i)\n"
+			"		s = $s + $a + $b + $c + $d\n"
+			"		i = $i + 1\n"
+			"	end\n"
+			"	return $s\n"
+			"end\n"
+			"boxed = two 5\n"
+		;
+		ASSERT(!esh_loads(esh, "test", src, false), NULL);
+		ASSERT(!esh_exec_fn(esh), NULL);
+		long long before = t_live_objects(esh);
+		
+		ASSERT(!esh_loads(esh, "test", "r = run 1000", false), NULL);
+		ASSERT(!esh_exec_fn(esh), NULL);
+		ASSERT(t_live_objects(esh) - before < 10, "Multiple return values were boxed");
+		
+		ASSERT_GLOBAL_STR("r", "2000000");
+		ASSERT(!esh_get_global(esh, "boxed") && !esh_index_i(esh, -1, 1) && !esh_is_null(esh, -1), "Multiple return values stored as one weren't boxed");
+		
+		esh_close(esh);
+	}
+}
+
+static void *t_small_realloc(void *p, size_t n) { // Fails allocations of a megabyte or more
+	if(n == 0) {
+		free(p);
+		return NULL;
+	}
+	
+	if(n >= 1 << 20) return NULL;
+	return realloc(p, n);
+}
+
+void test_tail_calls() { // Calls in tail position take the place of the returning frame, so deep recursion doesn't grow the stacks
+	esh_state *esh = esh_open(t_small_realloc);
+	ASSERT(esh != NULL, NULL);
+	
+	ASSERT(!esh_new_c_leaf_fn(esh, "leaf", c_leaf_fn, 1, 0, false), NULL);
+	ASSERT(!esh_set_global(esh, "leaf"), NULL);
+	
+	const char *src =
+		"function count with n acc do\n"
+		"	if $n == 0 then return $acc end\n"
+		"	return count ($n - 1) ($acc + 1)\n"
+		"end\n"
+		"function even with n do\n"
+		"	if $n == 0 then return yes end\n"
+		"	return $odd ($n - 1)\n"
+		"end\n"
+		"function odd with n do\n"
+		"	if $n == 0 then return no end\n"
+		"	return $even ($n - 1)\n"
+		"end\n"
+		"function to-leaf with n do\n"
+		"	if $n == 0 then return leaf 41 end\n"
+		"	return to-leaf ($n - 1)\n"
+		"end\n"
+		"function pair with n do\n"
+		"	if $n == 0 then return 1, 2 end\n"
+		"	return pair ($n - 1)\n"
+		"end\n"
+		"a = count 200000 0\n"
+		"b = even 200001\n"
+		"c, d = to-leaf 200000\n"
+		"e, f = pair 10\n"
+		"g = pair 10\n"
+		"h = $g:1\n"
+	;
+	int err = esh_loads(esh, "test", src, false);
+	ASSERT(!err, NULL);
+	err = esh_exec_fn(esh);
+	ASSERT(!err, NULL);
+	
+	ASSERT_GLOBAL_STR("a", "200000");
+	ASSERT_GLOBAL_STR("b", "no");
+	ASSERT_GLOBAL_STR("c", "42");
+	ASSERT_GLOBAL_STR("d", "82");
+	ASSERT_GLOBAL_STR("e", "1");
+	ASSERT_GLOBAL_STR("f", "2");
+	ASSERT_GLOBAL_STR("h", "2");
+	
+	esh_close(esh);
+}
+
+void test_gc_concurrent() {
+	esh_state *esh = t_env(
+		"function churn with do\n"
+		"	local live = { }\n"
+		"	for i in 0..3000 do live:$i = { id = $i, name = \"entry $i\" } end\n"
+		"	for r in 0..4 do\n"
+		"		for i in 0..3000 do\n"
+		"			local e = $live:$i\n"
+		"			e:name = \"entry $i $r\"\n"
+		"			live:$i = { id = $i, name = $e:name, prev = $e }\n"
+		"		end\n"
+		"	end\n"
+		"	local ok = 0\n"
+		"	for i in 0..3000 do\n"
+		"		local e = $live:$i\n"
+		"		if $e:id == $i and $e:name == \"entry $i 3\" and $e:prev:prev:id == $i then ok = $ok + 1 end\n"
+		"	end\n"
+		"	return $ok\n"
+		"end\n"
+		"ok = (churn!)\n"
+	);
+	esh_gc_pacing_conf(esh, ESH_GC_MODE_CONCURRENT, 4096, -1, -1); // Major cycles are run by the worker while the script mutates the heap
+	
+	int err = esh_exec_fn(esh);
+	ASSERT(!err, NULL);
+	ASSERT_GLOBAL_STR("ok", "3000");
+	
+	esh_close(esh);
+}
+
+void test_pool_custom_realloc() {
+	t_live_blocks = 0;
+	esh_state *esh = esh_open(t_counting_realloc);
+	ASSERT(esh != NULL, NULL);
+	#ifndef NO_POOL
+	long long baseline = t_live_blocks;
+	#endif
+	
+	// Small objects come from slabs, so they don't show up as blocks of their own
+	ASSERT(!esh_object_of(esh, 0), NULL);
+	for(int i = 0; i < 10000; i++) {
+		char key[32];
+		int len = snprintf(key, sizeof(key), "key-%i", i);
+		ASSERT(!esh_new_string(esh, "some longer value", 17), NULL);
+		ASSERT(!esh_set_s(esh, -2, key, len, -1), NULL);
+		esh_pop(esh, 1);
+	}
+	#ifndef NO_POOL
+	ASSERT(t_live_blocks - baseline < 1000, "Objects were not allocated from slabs");
+	#endif
+	
+	// Arenas are given back once their slabs are empty
+	esh_pop(esh, 1);
+	esh_gc(esh, 0);
+	esh_gc(esh, 0);
+	#ifndef NO_POOL
+	ASSERT(t_live_blocks - baseline < 10, "Empty arenas were not released");
+	#endif
+	
+	esh_close(esh);
+	ASSERT(t_live_blocks == 0, "Memory leaked");
+}
@@ -1,13 +1,14 @@
 #include "esh_object.h"
 
 #include <assert.h>
+#include <stdio.h>
 
 #define DUMMY_VAL (esh_val) 1
 
 void test_add_entry() {
 	esh_state *esh = esh_open(NULL);
 	
-	esh_object obj;
+	esh_table obj;
 	esh_object_init_entries(esh, &obj);
 	
 	esh_object_set(esh, &obj, "foo", 3, DUMMY_VAL);
@@ -20,7 +21,7 @@ void test_add_entry() {
 void test_add_entries() {
 	esh_state *esh = esh_open(NULL);
 	
-	esh_object obj;
+	esh_table obj;
 	esh_object_init_entries(esh, &obj);
 	
 	esh_object_set(esh, &obj, "foo", 3, DUMMY_VAL);
@@ -35,7 +36,7 @@ void test_add_entries() {
 void test_get_entries() {
 	esh_state *esh = esh_open(NULL);
 	
-	esh_object obj;
+	esh_table obj;
 	esh_object_init_entries(esh, &obj);
 	
 	esh_object_set(esh, &obj, "foo", 3, DUMMY_VAL);
@@ -55,7 +56,7 @@ void test_get_entries() {
 void test_duplicate_entries() {
 	esh_state *esh = esh_open(NULL);
 	
-	esh_object obj;
+	esh_table obj;
 	esh_object_init_entries(esh, &obj);
 	esh_object_set(esh, &obj, "foo", 3, DUMMY_VAL);
 	esh_object_set(esh, &obj, "foobar", 6, DUMMY_VAL);
@@ -69,7 +70,7 @@ void test_duplicate_entries() {
 void test_delete_entry() {
 	esh_state *esh = esh_open(NULL);
 	
-	esh_object obj;
+	esh_table obj;
 	esh_object_init_entries(esh, &obj);
 	
 	esh_object_set(esh, &obj, "foo", 3, DUMMY_VAL);
@@ -94,7 +95,7 @@ void test_delete_entry() {
 void test_delete_grow() {
 	esh_state *esh = esh_open(NULL);
 	
-	esh_object obj;
+	esh_table obj;
 	esh_object_init_entries(esh, &obj);
 	
 	esh_object_set(esh, &obj, "foo", 3, DUMMY_VAL);
@@ -126,7 +127,7 @@ void test_delete_grow() {
 void test_delete_readd_entry() {
 	esh_state *esh = esh_open(NULL);
 	
-	esh_object obj;
+	esh_table obj;
 	esh_object_init_entries(esh, &obj);
 	
 	esh_object_set(esh, &obj, "foo", 3, DUMMY_VAL);
@@ -148,6 +149,196 @@ void test_delete_readd_entry() {
 	assert(!esh_object_get(esh, &obj, "foo1", 4, &_));
 	
 	
+	esh_object_free_entries(esh, &obj);
+	esh_close(esh);
+}
+
+void test_array_part() {
+	esh_state *esh = esh_open(NULL);
+	
+	esh_table obj;
+	esh_object_init_entries(esh, &obj);
+	
+	for(size_t i = 0; i < 100; i++) esh_object_set_i(esh, &obj, i, DUMMY_VAL);
+	esh_object_set(esh, &obj, "100", 3, DUMMY_VAL);
+	esh_object_set(esh, &obj, "0100", 4, DUMMY_VAL);
+	assert(obj.len == 102);
+	assert(obj.array_len == 101);
+	assert(obj.entries_len == 1);
+	
+	esh_val _;
+	assert(esh_object_get(esh, &obj, "42", 2, &_));
+	assert(esh_object_get_i(esh, &obj, 100, &_));
+	assert(!esh_object_get_i(esh, &obj, 101, &_));
+	
+	esh_object_delete_entry(esh, &obj, "50", 2);
+	assert(obj.len == 101);
+	assert(!esh_object_get_i(esh, &obj, 50, &_));
+	assert(esh_object_get_i(esh, &obj, 51, &_));
+	
+	esh_object_set_i(esh, &obj, 50, DUMMY_VAL);
+	assert(obj.len == 102);
+	
+	esh_object_free_entries(esh, &obj);
+	esh_close(esh);
+}
+
+void test_array_part_migrate() {
+	esh_state *esh = esh_open(NULL);
+	
+	esh_table obj;
+	esh_object_init_entries(esh, &obj);
+	
+	esh_object_set(esh, &obj, "2", 1, DUMMY_VAL);
+	esh_object_set(esh, &obj, "1", 1, DUMMY_VAL);
+	assert(obj.array_len == 0);
+	assert(obj.entries_len == 2);
+	
+	esh_object_set(esh, &obj, "0", 1, DUMMY_VAL);
+	assert(obj.array_len == 3);
+	assert(obj.entries_len == 0);
+	assert(obj.len == 3);
+	
+	esh_object_set_i(esh, &obj, 2, ESH_NULL);
+	esh_object_set_i(esh, &obj, 1, ESH_NULL);
+	assert(obj.array_len == 1);
+	assert(obj.len == 1);
+	
+	esh_object_free_entries(esh, &obj);
+	esh_close(esh);
+}
+
+void test_interned_keys() {
+	esh_state *esh = esh_open(NULL);
+	esh_gc_conf(esh, 0, -1); // The object below lives on the C stack, so the GC can't see its keys
+	
+	esh_table obj;
+	esh_object_init_entries(esh, &obj);
+	esh_object_make_dict(esh, &obj);
+	
+	esh_object_set(esh, &obj, "long_key", 8, DUMMY_VAL);
+	esh_val key = esh_intern_find(esh, "long_key", 8);
+	assert(key != ESH_NULL);
+	assert(esh_intern(esh, "long_key", 8) == key);
+	
+	esh_object_entry *entry = esh_object_get_entry(esh, &obj, key);
+	assert(entry != NULL && entry->key == key);
+	
+	// Strings that are not interned are looked up through the intern table
+	esh_new_string(esh, "long_key", 8);
+	esh_val str = esh->current_thread->stack[esh->current_thread->stack_len - 1];
+	assert(str != key);
+	
+	esh_val _;
+	assert(esh_object_get_v(esh, &obj, str, &_));
+	assert(esh_intern_val(esh, str) == key);
+	
+	assert(!esh_object_get(esh, &obj, "other_key", 9, &_));
+	assert(esh_intern_find(esh, "other_key", 9) == ESH_NULL);
+	
+	// The intern table does not keep strings alive. New keys are shaded, so they survive the first cycle
+	esh_object_free_entries(esh, &obj);
+	esh_gc(esh, 0);
+	esh_gc(esh, 0);
+	assert(esh_intern_find(esh, "long_key", 8) == ESH_NULL);
+	
+	esh_close(esh);
+}
+
+void test_shapes() {
+	esh_state *esh = esh_open(NULL);
+	esh_gc_conf(esh, 0, -1);
+	
+	esh_table a, b;
+	esh_object_init_entries(esh, &a);
+	esh_object_init_entries(esh, &b);
+	
+	esh_object_set(esh, &a, "x", 1, DUMMY_VAL);
+	esh_object_set(esh, &a, "position", 8, DUMMY_VAL);
+	esh_object_set(esh, &b, "x", 1, DUMMY_VAL);
+	esh_object_set(esh, &b, "position", 8, DUMMY_VAL);
+	assert(a.shape != NULL && a.shape == b.shape);
+	assert(a.cap == 0);
+	assert(a.len == 2);
+	
+	// Overwriting a key keeps the shape, a different key order does not
+	esh_object_set(esh, &b, "x", 1, (esh_val) 3);
+	assert(a.shape == b.shape);
+	
+	esh_table c;
+	esh_object_init_entries(esh, &c);
+	esh_object_set(esh, &c, "position", 8, DUMMY_VAL);
+	esh_object_set(esh, &c, "x", 1, DUMMY_VAL);
+	assert(c.shape != a.shape);
+	
+	// Deleting a key moves the object to dictionary mode
+	esh_object_delete_entry(esh, &b, "x", 1);
+	assert(b.shape == NULL && b.cap != 0);
+	assert(b.len == 1);
+	
+	esh_val val;
+	assert(esh_object_get(esh, &b, "position", 8, &val));
+	assert(!esh_object_get(esh, &b, "x", 1, &val));
+	assert(esh_object_get(esh, &a, "x", 1, &val) && val == DUMMY_VAL);
+	
+	// As does growing past the maximum number of slots
+	for(size_t i = 0; i <= ESH_SHAPE_MAX_SLOTS; i++) {
+		char key[16];
+		int len = snprintf(key, sizeof(key), "key%zu", i);
+		esh_object_set(esh, &c, key, len, DUMMY_VAL);
+	}
+	assert(c.shape == NULL);
+	assert(c.len == ESH_SHAPE_MAX_SLOTS + 3);
+	assert(esh_object_get(esh, &c, "key7", 4, &val));
+	assert(esh_object_get(esh, &c, "x", 1, &val));
+	
+	esh_object_free_entries(esh, &a);
+	esh_object_free_entries(esh, &b);
+	esh_object_free_entries(esh, &c);
+	esh_close(esh);
+}
+
+void test_delete_churn() {
+	esh_state *esh = esh_open(NULL);
+	esh_gc_conf(esh, 0, -1);
+	
+	esh_table obj;
+	esh_object_init_entries(esh, &obj);
+	esh_object_make_dict(esh, &obj);
+	
+	char key[32];
+	esh_val _;
+	
+	// A sliding window of 8 keys, so that tombstones pile up unless they are compacted
+	for(size_t i = 0; i < 10000; i++) {
+		int len = snprintf(key, sizeof(key), "job-%zu", i);
+		esh_object_set(esh, &obj, key, len, DUMMY_VAL);
+		
+		if(i >= 8) {
+			len = snprintf(key, sizeof(key), "job-%zu", i - 8);
+			assert(esh_object_delete_entry(esh, &obj, key, len));
+		}
+	}
+	assert(obj.len == 8);
+	assert(obj.cap <= 32);
+	assert(esh_object_get(esh, &obj, "job-9999", 8, &_));
+	assert(!esh_object_get(esh, &obj, "job-9991", 8, &_));
+	
+	// Tables that were mostly emptied shrink on the next insertion
+	for(size_t i = 0; i < 1000; i++) {
+		int len = snprintf(key, sizeof(key), "key-%zu", i);
+		esh_object_set(esh, &obj, key, len, DUMMY_VAL);
+	}
+	size_t big_cap = obj.cap;
+	for(size_t i = 0; i < 1000; i++) {
+		int len = snprintf(key, sizeof(key), "key-%zu", i);
+		if(i % 100 != 0) esh_object_delete_entry(esh, &obj, key, len);
+	}
+	esh_object_set(esh, &obj, "new", 3, DUMMY_VAL);
+	assert(obj.cap < big_cap);
+	assert(esh_object_get(esh, &obj, "key-500", 7, &_));
+	assert(!esh_object_get(esh, &obj, "key-501", 7, &_));
+	
 	esh_object_free_entries(esh, &obj);
 	esh_close(esh);
 }